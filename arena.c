@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+
+#include "conf.h"
+#include "arena.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* boards taking less than this are cleared by writing zeros */
+#define CLEAR_REMOVE_MIN (64 << 10)
+
+/**
+ * First page of an arena file, followed by the game slots.  A file is only
+ * reused by a build with the same layout.
+ */
+struct arena_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t game_size;
+	uint32_t slots;
+	uint32_t map_width, map_height;
+
+	/* slots below this have held a game */
+	uint32_t used;
+
+	/* of the fields above */
+	uint32_t checksum;
+};
+
+#define ARENA_MAGIC "KROPKARN"
+#define ARENA_VERSION 1
+#define ARENA_HEADER_SIZE 4096
+
+/* part of a game written only by the manager, covered by its checksum */
+#define GAME_RECORD_SIZE (offsetof(struct game, checksum))
+
+/**
+ * All games live in one shared mapping, created by the root process before it
+ * forks, so every process sees it at the same address.  By default it
+ * disappears with the last process, so nothing is left behind when the
+ * manager dies.  Kept in a file, it outlives the server instead, and the next
+ * one picks up the games in progress.
+ */
+struct game *arena = 0;
+unsigned int arena_slots;
+
+/* memory object behind the arena */
+int arena_fd = -1;
+
+/* header of an arena kept in a file, 0 otherwise */
+struct arena_header *arena_header = 0;
+size_t arena_file_size;
+
+/* manager only: slots never used so far start at arena_used, freed ones are
+   stacked in free_slots */
+unsigned int arena_used;
+int *free_slots;
+unsigned int free_count;
+
+/**
+ * FNV-1a hash, enough to tell records torn by a crash
+ */
+static uint32_t arena_checksum(const void *data, size_t size) {
+	const unsigned char *p = data;
+	uint32_t h = 2166136261u;
+	while (size--)
+		h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+static void arena_seal_header() {
+	arena_header->checksum = arena_checksum(arena_header,
+			offsetof(struct arena_header, checksum));
+}
+
+/**
+ * Maps the arena from a file, creating it if it is empty.
+ * Returns 0 on success, -1 on failure.
+ */
+static int arena_init_file(unsigned int slots, const char *path) {
+	size_t size = ARENA_HEADER_SIZE + (size_t)slots * sizeof(struct game);
+	struct stat st;
+
+	arena_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (arena_fd == -1) {
+		perror(path);
+		return -1;
+	}
+	/* the lock is shared with the children and goes with the last of them */
+	if (flock(arena_fd, LOCK_EX | LOCK_NB) == -1) {
+		fprintf(stderr, "%s: in use by another server\n", path);
+		close(arena_fd);
+		return -1;
+	}
+	if (fstat(arena_fd, &st) == -1) {
+		perror(path);
+		close(arena_fd);
+		return -1;
+	}
+	int fresh = st.st_size == 0;
+	if (!fresh && st.st_size != size) {
+		fprintf(stderr, "%s: not an arena of this build\n", path);
+		close(arena_fd);
+		return -1;
+	}
+	/* sparse, blocks are only allocated for slots that have held a game */
+	if (fresh && ftruncate(arena_fd, size) == -1) {
+		perror(path);
+		close(arena_fd);
+		return -1;
+	}
+
+	void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, arena_fd, 0);
+	if (p == MAP_FAILED) {
+		perror("arena: mmap");
+		close(arena_fd);
+		return -1;
+	}
+
+	struct arena_header *h = p;
+	if (fresh) {
+		memcpy(h->magic, ARENA_MAGIC, sizeof(h->magic));
+		h->version = ARENA_VERSION;
+		h->game_size = sizeof(struct game);
+		h->slots = slots;
+		h->map_width = MAP_WIDTH;
+		h->map_height = MAP_HEIGHT;
+		h->used = 0;
+	} else if (memcmp(h->magic, ARENA_MAGIC, sizeof(h->magic)) != 0 ||
+			h->version != ARENA_VERSION ||
+			h->game_size != sizeof(struct game) || h->slots != slots ||
+			h->map_width != MAP_WIDTH || h->map_height != MAP_HEIGHT ||
+			h->used > slots || h->checksum != arena_checksum(h,
+				offsetof(struct arena_header, checksum))) {
+		fprintf(stderr, "%s: not an arena of this build\n", path);
+		munmap(p, size);
+		close(arena_fd);
+		return -1;
+	}
+
+	arena_header = h;
+	arena_seal_header();
+	arena_file_size = size;
+	arena = (struct game*)((char*)p + ARENA_HEADER_SIZE);
+	arena_slots = slots;
+	arena_used = h->used;
+	DBG(2, "Arena of %u game slots in %s, %u used before\n",
+			slots, path, arena_used);
+	return 0;
+}
+
+/**
+ * Maps an arena created by an earlier process, handed over by descriptor
+ * Returns 0 on success, -1 on failure.
+ */
+int arena_attach(int fd, unsigned int slots, int in_file) {
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		perror("arena: fstat");
+		return -1;
+	}
+	void *p = mmap(0, st.st_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | (in_file ? 0 : MAP_NORESERVE), fd, 0);
+	if (p == MAP_FAILED) {
+		perror("arena: mmap");
+		return -1;
+	}
+
+	arena_fd = fd;
+	arena_slots = slots;
+	if (in_file) {
+		arena_header = p;
+		arena_file_size = st.st_size;
+		arena = (struct game*)((char*)p + ARENA_HEADER_SIZE);
+		arena_used = arena_header->used;
+	} else
+		arena = p;
+	DBG(2, "Arena of %u game slots taken over\n", slots);
+	return 0;
+}
+
+/**
+ * Creates the arena, kept in the file at path if that is not null.  Call
+ * before forking.
+ * Returns 0 on success, -1 on failure.
+ */
+int arena_init(unsigned int slots, const char *path) {
+	size_t size = (size_t)slots * sizeof(struct game);
+	void *p = MAP_FAILED;
+
+	if (path)
+		return arena_init_file(slots, path);
+
+	if (ARENA_HUGE_PAGES) {
+		size_t huge = 2 << 20;
+		size_t huge_size = (size + huge - 1) & ~(huge - 1);
+		arena_fd = memfd_create("kropkid-games", MFD_CLOEXEC | MFD_HUGETLB);
+		/* reserve the pages now, rather than fail on first touch */
+		if (arena_fd != -1 && ftruncate(arena_fd, huge_size) == 0)
+			p = mmap(0, huge_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, arena_fd, 0);
+		if (p == MAP_FAILED) {
+			DBG(1, "No huge pages for the arena, using normal pages\n");
+			if (arena_fd != -1)
+				close(arena_fd);
+		} else
+			size = huge_size;
+	}
+
+	if (p == MAP_FAILED) {
+		arena_fd = memfd_create("kropkid-games", MFD_CLOEXEC);
+		if (arena_fd == -1) {
+			perror("arena: memfd_create");
+			return -1;
+		}
+		if (ftruncate(arena_fd, size) == -1) {
+			perror("arena: ftruncate");
+			close(arena_fd);
+			return -1;
+		}
+		p = mmap(0, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_NORESERVE, arena_fd, 0);
+		if (p == MAP_FAILED) {
+			perror("arena: mmap");
+			close(arena_fd);
+			return -1;
+		}
+	}
+
+	arena = p;
+	arena_slots = slots;
+	DBG(2, "Arena of %u game slots, %zu kB\n", slots, size >> 10);
+	return 0;
+}
+
+struct game *arena_game(int slot) {
+	if (slot < 0 || slot >= arena_slots)
+		return 0;
+	return arena + slot;
+}
+
+/**
+ * Takes a free slot.  Only the manager allocates slots.
+ * Returns the slot index, -1 if the arena is full.
+ */
+int arena_alloc() {
+	if (free_count > 0)
+		return free_slots[--free_count];
+	if (arena_used >= arena_slots)
+		return -1;
+	if (arena_header) {
+		arena_header->used = arena_used + 1;
+		arena_seal_header();
+	}
+	return arena_used++;
+}
+
+void arena_free(int slot) {
+	if (!free_slots) {
+		/* one entry per slot, so pushing can never overflow */
+		free_slots = malloc(arena_slots * sizeof(int));
+		if (!free_slots) {
+			perror("arena: malloc");
+			return;
+		}
+	}
+	free_slots[free_count++] = slot;
+}
+
+/**
+ * Empties the map, dot sets and score of a slot for a new game.  Pages of a large
+ * board are given back to the system rather than zeroed, so a new game only
+ * takes memory again for the tiles it is played on.
+ */
+void arena_clear(int slot) {
+	struct game *g = arena + slot;
+	char *start = g->map, *end = (char*)&g->score + sizeof(g->score);
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	char *first = (char*)(((uintptr_t)start + page - 1) & ~(page - 1));
+	char *last = (char*)((uintptr_t)end & ~(page - 1));
+
+	/* huge page arenas can only drop whole huge pages, those are zeroed */
+	if (last - first >= CLEAR_REMOVE_MIN &&
+			madvise(first, last - first, MADV_REMOVE) == 0) {
+		memset(start, 0, first - start);
+		memset(last, 0, end - last);
+	} else
+		memset(start, 0, end - start);
+}
+
+/**
+ * Returns the number of slots holding a game
+ */
+unsigned int arena_in_use() {
+	return arena_used - free_count;
+}
+
+/**
+ * Updates the checksum of the manager's part of a game.  Call after changing
+ * any of its fields.
+ */
+void arena_seal(struct game *g) {
+	g->checksum = arena_checksum(g, GAME_RECORD_SIZE);
+}
+
+/**
+ * Returns 1 if the manager's part of the game in the slot is intact
+ */
+int arena_valid(const struct game *g) {
+	return g->slot == g - arena &&
+		g->checksum == arena_checksum(g, GAME_RECORD_SIZE);
+}
+
+/**
+ * Returns the number of slots that have been used.  Slots from there on are
+ * free, the manager recovers those below from the games they hold.
+ */
+unsigned int arena_high_water() {
+	return arena_used;
+}
+
+/**
+ * Sets the number of used slots, as handed over by an earlier manager
+ */
+void arena_set_high_water(unsigned int used) {
+	arena_used = used;
+}
+
+/**
+ * Returns 1 if the arena is kept in a file
+ */
+int arena_in_file() {
+	return arena_header != 0;
+}
+
+/**
+ * Writes back the pages of an arena kept in a file.  Only the manager syncs,
+ * so players never wait for the disk.
+ */
+void arena_sync() {
+	if (arena_header && msync(arena_header, arena_file_size, MS_SYNC) == -1)
+		perror("arena: msync");
+}
+
+static void *arena_sync_main(void *arg) {
+	struct timespec interval = {
+		.tv_sec = ARENA_SYNC_INTERVAL / 1000,
+		.tv_nsec = ARENA_SYNC_INTERVAL % 1000 * 1000000 };
+	while (1) {
+		nanosleep(&interval, 0);
+		arena_sync();
+	}
+	return 0;
+}
+
+/**
+ * Starts the thread writing back an arena kept in a file every
+ * ARENA_SYNC_INTERVAL ms, so the moves in between go out in one batch.
+ * Returns 0 on success, -1 on failure.
+ */
+int arena_start_sync() {
+	pthread_t thread;
+	if (!arena_header)
+		return 0;
+	int err = pthread_create(&thread, 0, arena_sync_main, 0);
+	if (err != 0) {
+		fprintf(stderr, "arena: pthread_create: %s\n", strerror(err));
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "game_manager.h"
+
+/* memory object behind the arena, and its number of game slots */
+extern int arena_fd;
+extern unsigned int arena_slots;
+
+int arena_init(unsigned int slots, const char *path);
+
+int arena_attach(int fd, unsigned int slots, int in_file);
+
+struct game *arena_game(int slot);
+
+int arena_alloc();
+
+void arena_free(int slot);
+
+void arena_clear(int slot);
+
+unsigned int arena_in_use();
+
+void arena_seal(struct game *g);
+
+int arena_valid(const struct game *g);
+
+unsigned int arena_high_water();
+
+void arena_set_high_water(unsigned int used);
+
+int arena_in_file();
+
+void arena_sync();
+
+int arena_start_sync();
+
+#endif
@@ -0,0 +1,446 @@
+#include "bitboard.h"
+#include "rules.h"
+#include "trace.h"
+#include "conf.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if BITBOARD_FITS
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define BB_X86
+	#include <immintrin.h>
+#endif
+
+/**
+ * Within a row, seeds spread towards higher fields by adding them to the runs
+ * of propagating fields, and towards lower fields by a Kogge-Stone occluded
+ * fill of seven shift-and-mask steps (1, 2, 4 ... 64 fields).  After all rows
+ * are filled, a sweep down and a sweep up the rows carry fields across rows,
+ * refilling each row they extend.  Sweeps repeat until they add nothing.  The
+ * fill of all rows is written for AVX2 (two rows per register), SSE2 and
+ * plain 64-bit words, the best one supported by the CPU is picked by
+ * bb_init().
+ */
+
+#define ROW_LO_MASK \
+	((MAP_WIDTH >= 64) ? ~0ULL : ((1ULL << (MAP_WIDTH % 64)) - 1))
+#define ROW_HI_MASK \
+	((MAP_WIDTH <= 64) ? 0ULL : \
+	 (MAP_WIDTH == 128) ? ~0ULL : ((1ULL << (MAP_WIDTH % 64)) - 1))
+
+enum FILL_RESULT {
+	FILL_DONE,
+	FILL_GREW,
+	FILL_STOPPED
+};
+
+#define BB_SET(bb, y, x) ((bb)->row[y][(x) >> 6] |= 1ULL << ((x) & 63))
+#define BB_GET(bb, y, x) (((bb)->row[y][(x) >> 6] >> ((x) & 63)) & 1)
+
+/* 128-bit row shifts by n < 64 fields on lo/hi word pairs */
+#define SHR_LO(lo, hi, n) (((lo) >> (n)) | ((hi) << (64 - (n))))
+#define SHR_HI(lo, hi, n) ((hi) >> (n))
+
+static void fill_row_scalar(uint64_t *g, const uint64_t *p0) {
+	uint64_t glo = g[0], ghi = g[1];
+	uint64_t plo = p0[0], phi = p0[1];
+	uint64_t tlo, thi;
+	int n;
+
+	/* towards higher fields: adding the seeds to the runs carries them up to
+	   the end of each run */
+	tlo = plo + glo;
+	thi = phi + ghi + (tlo < plo);
+	glo |= (tlo ^ plo ^ glo) & plo;
+	ghi |= (thi ^ phi ^ ghi) & phi;
+
+	/* towards lower fields */
+	for (n = 1; n < 64; n <<= 1) {
+		tlo = SHR_LO(glo, ghi, n); thi = SHR_HI(glo, ghi, n);
+		glo |= plo & tlo; ghi |= phi & thi;
+		tlo = SHR_LO(plo, phi, n); thi = SHR_HI(plo, phi, n);
+		plo &= tlo; phi &= thi;
+	}
+	glo |= plo & ghi;
+
+	g[0] = glo;
+	g[1] = ghi;
+}
+
+static void fill_rows_scalar(struct bitboard *gen, const struct bitboard *pro) {
+	int y;
+	for (y = 0; y < MAP_HEIGHT; y++)
+		if (gen->row[y][0] | gen->row[y][1])
+			fill_row_scalar(gen->row[y], pro->row[y]);
+}
+
+/**
+ * Carries filled fields one sweep down and one sweep up the rows, filling
+ * every row that gained fields before moving on to the next one.
+ * Returns FILL_STOPPED as soon as a row meets stop (which may be NULL),
+ * FILL_GREW if any field was added and FILL_DONE otherwise.
+ */
+static int fill_columns_scalar(struct bitboard *gen, const struct bitboard *pro,
+		const struct bitboard *stop)
+{
+	uint64_t added = 0;
+	int y, dir;
+	for (dir = 1; dir >= -1; dir -= 2)
+		for (y = (dir > 0) ? 1 : MAP_HEIGHT - 2;
+				y >= 0 && y < MAP_HEIGHT; y += dir) {
+			uint64_t *g = gen->row[y];
+			const uint64_t *from = gen->row[y - dir], *p = pro->row[y];
+			uint64_t alo = from[0] & p[0] & ~g[0];
+			uint64_t ahi = from[1] & p[1] & ~g[1];
+			if (!(alo | ahi))
+				continue;
+			uint64_t old_lo = g[0], old_hi = g[1];
+			g[0] |= alo;
+			g[1] |= ahi;
+			fill_row_scalar(g, p);
+			added |= (g[0] ^ old_lo) | (g[1] ^ old_hi);
+			if (stop && ((g[0] & stop->row[y][0]) | (g[1] & stop->row[y][1])))
+				return FILL_STOPPED;
+		}
+	return added ? FILL_GREW : FILL_DONE;
+}
+
+#ifdef BB_X86
+
+/* the same shifts on whole 128-bit lanes, n must be a constant below 64 */
+#define SSE_SHR(v, n) _mm_or_si128(_mm_srli_epi64(v, n), \
+		_mm_slli_epi64(_mm_srli_si128(v, 8), 64 - (n)))
+#define AVX_SHR(v, n) _mm256_or_si256(_mm256_srli_epi64(v, n), \
+		_mm256_slli_epi64(_mm256_srli_si256(v, 8), 64 - (n)))
+
+#define SSE_STEP(g, p, SHIFT, n) \
+	g = _mm_or_si128(g, _mm_and_si128(p, SHIFT(g, n))); \
+	p = _mm_and_si128(p, SHIFT(p, n));
+#define AVX_STEP(g, p, SHIFT, n) \
+	g = _mm256_or_si256(g, _mm256_and_si256(p, SHIFT(g, n))); \
+	p = _mm256_and_si256(p, SHIFT(p, n));
+
+/* carry-in vector of the 128-bit sum a + b, only the bits set in mask */
+#define SSE_CARRIES(a, b, mask) ({ \
+	__m128i s64 = _mm_add_epi64(a, b); \
+	__m128i out = _mm_srli_epi64(_mm_or_si128(_mm_and_si128(a, b), \
+				_mm_andnot_si128(s64, _mm_or_si128(a, b))), 63); \
+	__m128i sum = _mm_add_epi64(s64, _mm_slli_si128(out, 8)); \
+	_mm_and_si128(_mm_xor_si128(sum, _mm_xor_si128(a, b)), mask); })
+#define AVX_CARRIES(a, b, mask) ({ \
+	__m256i s64 = _mm256_add_epi64(a, b); \
+	__m256i out = _mm256_srli_epi64(_mm256_or_si256(_mm256_and_si256(a, b), \
+				_mm256_andnot_si256(s64, _mm256_or_si256(a, b))), 63); \
+	__m256i sum = _mm256_add_epi64(s64, _mm256_slli_si256(out, 8)); \
+	_mm256_and_si256(_mm256_xor_si256(sum, _mm256_xor_si256(a, b)), mask); })
+
+static inline __m128i fill_row_sse2(__m128i g, __m128i p0) {
+	__m128i p = p0;
+
+	/* towards higher fields, see fill_row_scalar */
+	g = _mm_or_si128(g, SSE_CARRIES(p0, g, p0));
+
+	SSE_STEP(g, p, SSE_SHR, 1);
+	SSE_STEP(g, p, SSE_SHR, 2);
+	SSE_STEP(g, p, SSE_SHR, 4);
+	SSE_STEP(g, p, SSE_SHR, 8);
+	SSE_STEP(g, p, SSE_SHR, 16);
+	SSE_STEP(g, p, SSE_SHR, 32);
+	return _mm_or_si128(g, _mm_and_si128(p, _mm_srli_si128(g, 8)));
+}
+
+#define SSE_IS_ZERO(v) \
+	(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xffff)
+
+static void fill_rows_sse2(struct bitboard *gen, const struct bitboard *pro) {
+	int y;
+	for (y = 0; y < MAP_HEIGHT; y++) {
+		__m128i g = _mm_load_si128((__m128i*)gen->row[y]);
+		if (!SSE_IS_ZERO(g))
+			_mm_store_si128((__m128i*)gen->row[y], fill_row_sse2(g,
+						_mm_load_si128((__m128i*)pro->row[y])));
+	}
+}
+
+static int fill_columns_sse2(struct bitboard *gen, const struct bitboard *pro,
+		const struct bitboard *stop)
+{
+	__m128i zero = _mm_setzero_si128(), added = zero;
+	int y, dir;
+	for (dir = 1; dir >= -1; dir -= 2) {
+		y = (dir > 0) ? 0 : MAP_HEIGHT - 1;
+		__m128i prev = _mm_load_si128((__m128i*)gen->row[y]);
+		for (y += dir; y >= 0 && y < MAP_HEIGHT; y += dir) {
+			__m128i g = _mm_load_si128((__m128i*)gen->row[y]);
+			__m128i p = _mm_load_si128((__m128i*)pro->row[y]);
+			__m128i a = _mm_andnot_si128(g, _mm_and_si128(prev, p));
+			if (SSE_IS_ZERO(a)) {
+				prev = g;
+				continue;
+			}
+			prev = fill_row_sse2(_mm_or_si128(g, a), p);
+			_mm_store_si128((__m128i*)gen->row[y], prev);
+			added = _mm_or_si128(added, _mm_xor_si128(prev, g));
+			if (stop && !SSE_IS_ZERO(_mm_and_si128(prev,
+							_mm_load_si128((__m128i*)stop->row[y]))))
+				return FILL_STOPPED;
+		}
+	}
+	return SSE_IS_ZERO(added) ? FILL_DONE : FILL_GREW;
+}
+
+__attribute__((target("avx2")))
+static void fill_rows_avx2(struct bitboard *gen, const struct bitboard *pro) {
+	int y;
+	for (y = 0; y < BB_HEIGHT; y += 2) {
+		__m256i g = _mm256_load_si256((__m256i*)gen->row[y]);
+		if (_mm256_testz_si256(g, g))
+			continue;
+		__m256i p = _mm256_load_si256((__m256i*)pro->row[y]);
+
+		g = _mm256_or_si256(g, AVX_CARRIES(p, g, p));
+
+		AVX_STEP(g, p, AVX_SHR, 1);
+		AVX_STEP(g, p, AVX_SHR, 2);
+		AVX_STEP(g, p, AVX_SHR, 4);
+		AVX_STEP(g, p, AVX_SHR, 8);
+		AVX_STEP(g, p, AVX_SHR, 16);
+		AVX_STEP(g, p, AVX_SHR, 32);
+		g = _mm256_or_si256(g, _mm256_and_si256(p, _mm256_srli_si256(g, 8)));
+
+		_mm256_store_si256((__m256i*)gen->row[y], g);
+	}
+}
+
+#endif
+
+struct bb_engine {
+	const char *name;
+	void (*fill_rows)(struct bitboard*, const struct bitboard*);
+	int (*fill_columns)(struct bitboard*, const struct bitboard*,
+			const struct bitboard*);
+};
+
+static const struct bb_engine bb_engines[] = {
+#ifdef BB_X86
+	{ "avx2", fill_rows_avx2, fill_columns_sse2 },
+	{ "sse2", fill_rows_sse2, fill_columns_sse2 },
+#endif
+	{ "scalar", fill_rows_scalar, fill_columns_scalar }
+};
+
+/* the portable fill until bb_init() has run */
+static const struct bb_engine *bb_engine =
+	&bb_engines[sizeof(bb_engines) / sizeof(bb_engines[0]) - 1];
+
+/**
+ * Picks the best fill implementation the CPU supports.  Call at startup,
+ * before any thread places dots.
+ */
+void bb_init() {
+#ifdef BB_X86
+	__builtin_cpu_init();
+	bb_engine = &bb_engines[__builtin_cpu_supports("avx2") ? 0 : 1];
+#endif
+}
+
+static const struct bb_engine *get_engine() {
+	return bb_engine;
+}
+
+/**
+ * Returns the name of the fill implementation in use
+ */
+const char *bb_engine_name() {
+	return get_engine()->name;
+}
+
+/**
+ * Switches to the named fill implementation ("avx2", "sse2" or "scalar"), for
+ * benchmarks and cross-checks.  Like bb_init(), call it before any thread
+ * places dots.  Returns 0 on success, -1 if not available.
+ */
+int bb_use_engine(const char *name) {
+	int i;
+	for (i = 0; i < sizeof(bb_engines) / sizeof(bb_engines[0]); i++)
+		if (!strcmp(bb_engines[i].name, name)) {
+#ifdef BB_X86
+			__builtin_cpu_init();
+			if (!strcmp(name, "avx2") && !__builtin_cpu_supports("avx2"))
+				return -1;
+#endif
+			bb_engine = &bb_engines[i];
+			return 0;
+		}
+	return -1;
+}
+
+/**
+ * Sets the bits of fields holding dots of the given player that have not been
+ * captured
+ */
+void bb_walls_from_map(struct bitboard *walls, const char *map, char player) {
+	int y, x;
+	for (y = 0; y < MAP_HEIGHT; y++) {
+		const char *row = map + y * MAP_WIDTH;
+		uint64_t lo = 0, hi = 0;
+		x = 0;
+#ifdef BB_X86
+		__m128i flags = _mm_set1_epi8(PLAYER | DISABLED);
+		__m128i own = _mm_set1_epi8(player);
+		for (; x + 16 <= MAP_WIDTH; x += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+			uint64_t bits = (unsigned)_mm_movemask_epi8(
+					_mm_cmpeq_epi8(_mm_and_si128(v, flags), own));
+			if (x < 64)
+				lo |= bits << x;
+			else
+				hi |= bits << (x - 64);
+		}
+#endif
+		for (; x < MAP_WIDTH; x++)
+			if ((row[x] & (PLAYER | DISABLED)) == player) {
+				if (x < 64)
+					lo |= 1ULL << x;
+				else
+					hi |= 1ULL << (x - 64);
+			}
+		walls->row[y][0] = lo;
+		walls->row[y][1] = hi;
+	}
+	for (; y < BB_HEIGHT; y++)
+		walls->row[y][0] = walls->row[y][1] = 0;
+}
+
+/**
+ * Grows gen over the fields of pro connected to it, until nothing changes or
+ * it meets a field of stop.  stop may be NULL.
+ * Returns 1 if stopped, 0 otherwise.
+ */
+int bb_fill_until(struct bitboard *gen, const struct bitboard *pro,
+		const struct bitboard *stop)
+{
+	const struct bb_engine *e = get_engine();
+	uint64_t met = 0;
+	int y, r;
+	for (y = 0; y < MAP_HEIGHT; y++) {
+		gen->row[y][0] &= pro->row[y][0];
+		gen->row[y][1] &= pro->row[y][1];
+	}
+	e->fill_rows(gen, pro);
+	if (stop) {
+		for (y = 0; y < MAP_HEIGHT; y++)
+			met |= (gen->row[y][0] & stop->row[y][0]) |
+				(gen->row[y][1] & stop->row[y][1]);
+		if (met)
+			return 1;
+	}
+	while ((r = e->fill_columns(gen, pro, stop)) == FILL_GREW);
+	return r == FILL_STOPPED;
+}
+
+/**
+ * Grows gen over the fields of pro connected to it, until nothing changes
+ */
+void bb_fill(struct bitboard *gen, const struct bitboard *pro) {
+	bb_fill_until(gen, pro, 0);
+}
+
+/**
+ * Sets pro to the fields not occupied by walls and edge to those of them on
+ * the edge of the map
+ */
+static void bb_open_fields(struct bitboard *pro, struct bitboard *edge,
+		const struct bitboard *walls)
+{
+	int y;
+	memset(pro, 0, sizeof(*pro));
+	memset(edge, 0, sizeof(*edge));
+	for (y = 0; y < MAP_HEIGHT; y++) {
+		pro->row[y][0] = ~walls->row[y][0] & ROW_LO_MASK;
+		pro->row[y][1] = ~walls->row[y][1] & ROW_HI_MASK;
+		if (y == 0 || y == MAP_HEIGHT - 1) {
+			edge->row[y][0] = pro->row[y][0];
+			edge->row[y][1] = pro->row[y][1];
+		} else {
+			if (!BB_GET(walls, y, 0))
+				BB_SET(edge, y, 0);
+			if (!BB_GET(walls, y, MAP_WIDTH - 1))
+				BB_SET(edge, y, MAP_WIDTH - 1);
+		}
+	}
+}
+
+/**
+ * Computes the fields that have a path to the edge of the map not crossing
+ * any of the walls.  Everything else that is not a wall has been closed.
+ */
+void bb_reach_edge(struct bitboard *reach, const struct bitboard *walls) {
+	struct bitboard pro;
+	bb_open_fields(&pro, reach, walls);
+	bb_fill(reach, &pro);
+}
+
+/**
+ * Counterpart of process_map() working on bit planes.  The area of each
+ * neighbour of the new dot is filled until it meets the edge; areas that
+ * never do are disabled.  Areas found open also stop later fills.
+ * Returns the number of newly disabled fields, which are stored in captured
+ * and counted in score unless those are NULL.
+ */
+int process_map_bitboard(char *map, int start_y, int start_x, int *captured,
+		struct score *score)
+{
+	static const int dy[4] = { 0, 0, -1, 1 };
+	static const int dx[4] = { -1, 1, 0, 0 };
+	char player = map[start_y * MAP_WIDTH + start_x] & PLAYER;
+	struct bitboard walls, pro, stop, seen, area;
+	int i, y, w, count = 0;
+
+	bb_walls_from_map(&walls, map, player);
+	bb_open_fields(&pro, &stop, &walls);
+	memset(&seen, 0, sizeof(seen));
+
+	for (i = 0; i < 4; i++) {
+		int ny = start_y + dy[i], nx = start_x + dx[i];
+		if (ny < 0 || ny >= MAP_HEIGHT || nx < 0 || nx >= MAP_WIDTH ||
+				!BB_GET(&pro, ny, nx) || BB_GET(&seen, ny, nx))
+			continue;
+
+		memset(&area, 0, sizeof(area));
+		BB_SET(&area, ny, nx);
+		int open = bb_fill_until(&area, &pro, &stop);
+		for (y = 0; y < MAP_HEIGHT; y++)
+			for (w = 0; w < 2; w++) {
+				seen.row[y][w] |= area.row[y][w];
+				if (open)
+					stop.row[y][w] |= area.row[y][w];
+			}
+		if (open)
+			continue;
+
+		for (y = 1; y < MAP_HEIGHT - 1; y++)
+			for (w = 0; w < 2; w++) {
+				uint64_t bits = area.row[y][w];
+				while (bits) {
+					int cell = y * MAP_WIDTH + w * 64 + __builtin_ctzll(bits);
+					if (!(map[cell] & DISABLED)) {
+						if (captured)
+							captured[count] = cell;
+						if (score)
+							SCORE_DISABLED(score, player, map[cell]);
+						count++;
+					}
+					map[cell] = (map[cell] & PLAYER) | DISABLED;
+					bits &= bits - 1;
+				}
+			}
+	}
+	TRACE(TRACE_PROCESS_MAP_BITBOARD, start_y * MAP_WIDTH + start_x, player,
+			count);
+	return count;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef BITBOARD_H
+#define BITBOARD_H
+
+#include <stdint.h>
+
+#include "conf.h"
+#include "board.h"
+#include "rules.h"
+
+/* bitboard rows hold at most 128 fields, and the map must be stored row by
+   row in a single tile */
+#if MAP_WIDTH <= 128 && TILES_X == 1 && TILES_Y == 1
+	#define BITBOARD_FITS 1
+#else
+	#define BITBOARD_FITS 0
+#endif
+
+/* rows are paired up for AVX2, so there is one spare row for odd heights */
+#define BB_HEIGHT ((MAP_HEIGHT + 1) & ~1)
+
+/**
+ * One bit per map field, bit x of row y standing for field (y, x).  Each row
+ * is a 128-bit lane, stored as low and high 64-bit words.
+ */
+struct bitboard {
+	uint64_t row[BB_HEIGHT][2];
+} __attribute__((aligned(32)));
+
+void bb_walls_from_map(struct bitboard *walls, const char *map, char player);
+
+int bb_fill_until(struct bitboard *gen, const struct bitboard *pro,
+		const struct bitboard *stop);
+
+void bb_fill(struct bitboard *gen, const struct bitboard *pro);
+
+void bb_reach_edge(struct bitboard *reach, const struct bitboard *walls);
+
+int process_map_bitboard(char *map, int start_y, int start_x, int *captured,
+		struct score *score);
+
+void bb_init();
+
+const char *bb_engine_name();
+
+int bb_use_engine(const char *name);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+#include "conf.h"
+
+/*
+ * Layout of the map in memory.  Fields are stored tile by tile, each tile row
+ * by row, so the fields around a move share a few pages.  The arena only
+ * backs pages that have been touched, so a large board takes memory for the
+ * tiles played on rather than for its whole area.
+ */
+#define TILES_X ((MAP_WIDTH + TILE_WIDTH - 1) / TILE_WIDTH)
+#define TILES_Y ((MAP_HEIGHT + TILE_HEIGHT - 1) / TILE_HEIGHT)
+#define TILE_CELLS (TILE_WIDTH * TILE_HEIGHT)
+
+/* size of a map, including the unused part of tiles on the right and bottom
+   edges */
+#define MAP_CELLS (TILES_X * TILES_Y * TILE_CELLS)
+
+#if TILES_X == 1 && TILES_Y == 1
+	#define CELL(y, x) ((y) * TILE_WIDTH + (x))
+	#define CELL_Y(c) ((c) / TILE_WIDTH)
+	#define CELL_X(c) ((c) % TILE_WIDTH)
+#else
+	#define CELL(y, x) \
+		((((y) / TILE_HEIGHT) * TILES_X + (x) / TILE_WIDTH) * TILE_CELLS + \
+		((y) % TILE_HEIGHT) * TILE_WIDTH + (x) % TILE_WIDTH)
+	#define CELL_Y(c) \
+		((c) / TILE_CELLS / TILES_X * TILE_HEIGHT + \
+		(c) % TILE_CELLS / TILE_WIDTH)
+	#define CELL_X(c) \
+		((c) / TILE_CELLS % TILES_X * TILE_WIDTH + (c) % TILE_WIDTH)
+#endif
+
+/* part of the board visible on the terminal at a time */
+#define VIEW_WIDTH (MAP_WIDTH < 80 ? MAP_WIDTH : 80)
+#define VIEW_HEIGHT (MAP_HEIGHT < 22 ? MAP_HEIGHT : 22)
+
+#endif
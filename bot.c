@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+
+#include "conf.h"
+#include "arena.h"
+#include "bot.h"
+#include "feed.h"
+#include "game_manager.h"
+#include "ipc_message.h"
+#include "mcts.h"
+#include "move_log.h"
+#include "rules.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+
+int bot_threads = BOT_THREADS;
+int bot_move_time = BOT_MOVE_TIME;
+
+/**
+ * Game the computer player is seated in, as player 2
+ */
+struct bot_game {
+	int slot;
+
+	/* key of the game when it was taken up, the slot may be reused later */
+	char key[7];
+
+	/* human player's eventfd, fetched from the manager on the first move */
+	int opponent_fd;
+};
+
+static struct bot_game *games;
+static int game_count, game_size;
+
+/**
+ * Takes up a game the manager has seated the computer player in
+ */
+static void bot_adopt(int slot) {
+	struct game *g = arena_game(slot);
+	if (!g)
+		return;
+	if (game_count == game_size) {
+		int size = game_size ? game_size * 2 : 16;
+		struct bot_game *p = realloc(games, size * sizeof(*p));
+		if (!p) {
+			notify(BOT_SESSION(slot), MSG_SESSION_QUIT);
+			return;
+		}
+		games = p;
+		game_size = size;
+	}
+	struct bot_game *bg = &games[game_count++];
+	bg->slot = slot;
+	memcpy(bg->key, g->key, sizeof(bg->key));
+	bg->opponent_fd = -1;
+}
+
+/**
+ * Drops the i-th game, leaving the seat unless it has already been freed
+ */
+static void bot_leave(int i) {
+	struct bot_game *bg = &games[i];
+	struct game *g = arena_game(bg->slot);
+	if (g && g->sessions[1] == BOT_SESSION(bg->slot) &&
+			strcmp(g->key, bg->key) == 0)
+		notify(BOT_SESSION(bg->slot), MSG_SESSION_QUIT);
+	if (bg->opponent_fd != -1)
+		close(bg->opponent_fd);
+	games[i] = games[--game_count];
+}
+
+/**
+ * Searches for a move, makes it and wakes up the human player, as
+ * map_set() does for a session
+ */
+static void bot_move(struct bot_game *bg, struct game *g, int threads,
+		int move_time)
+{
+	static int captured[MAP_CELLS];
+	struct mcts_result r;
+	if (mcts_search(g->map, g->dots.bounds, 2, threads, move_time, &r) == -1)
+		return;
+
+	int count = place_dot(g->map, &g->dots, CELL_Y(r.cell), CELL_X(r.cell),
+			2, captured, &g->score);
+	move_log_append(&g->log, r.cell, 2, captured, count);
+	feed_publish(&g->feed, &g->log, g->map, &g->score, 1);
+
+	uint64_t one = 1;
+	if (bg->opponent_fd == -1)
+		bg->opponent_fd = get_opponent_poke(BOT_SESSION(bg->slot));
+	if (bg->opponent_fd != -1 &&
+			write(bg->opponent_fd, &one, sizeof(one)) == -1)
+		perror("bot: poke");
+
+	DBG(2, "Computer player #%s: %llu playouts in %llu ms, %.0f/s\n",
+			bg->key, (unsigned long long)r.playouts,
+			(unsigned long long)(r.ns / 1000000),
+			r.ns ? r.playouts * 1e9 / r.ns : 0.0);
+	report_bot_move(BOT_SESSION(bg->slot), r.playouts, r.ns);
+}
+
+/**
+ * Plays all games of the computer player, one move at a time, woken up by
+ * the manager and the human players on its eventfd.  The moves due in a
+ * pass share bot_move_time, down to BOT_MIN_MOVE_TIME each, so players wait
+ * about as long however many games there are.
+ */
+static void bot_main(int poke_fd) {
+	struct pollfd pfd = { .fd = poke_fd, .events = POLLIN };
+	uint64_t pokes;
+	int i, slot, due, move_time;
+
+	int threads = bot_threads;
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+	if (threads <= 0)
+		threads = 1;
+
+	for (;;) {
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("bot: poll");
+			exit(1);
+		}
+		if (read(poke_fd, &pokes, sizeof(pokes)) == -1)
+			continue;
+
+		while ((slot = get_bot_game()) != -1)
+			bot_adopt(slot);
+
+		for (i = 0, due = 0; i < game_count; ) {
+			struct bot_game *bg = &games[i];
+			struct game *g = arena_game(bg->slot);
+			if (!g || g->state != GAME_ACTIVE ||
+					g->sessions[1] != BOT_SESSION(bg->slot) ||
+					strcmp(g->key, bg->key) != 0) {
+				/* the human player has left */
+				bot_leave(i);
+				continue;
+			}
+			/* the computer player is player 2, which moves first */
+			if (move_log_last_player(&g->log) != 2)
+				due++;
+			i++;
+		}
+		if (due == 0)
+			continue;
+
+		move_time = bot_move_time / due;
+		if (move_time < BOT_MIN_MOVE_TIME)
+			move_time = BOT_MIN_MOVE_TIME;
+		for (i = 0; i < game_count; i++) {
+			struct game *g = arena_game(games[i].slot);
+			if (move_log_last_player(&g->log) != 2)
+				bot_move(&games[i], g, threads, move_time);
+		}
+	}
+}
+
+/**
+ * Starts the computer player as a child of the calling manager, which it
+ * does not outlive.
+ * poke_fd	eventfd the manager and the human players write to.  It is
+ * 			handed over with the games on upgrades, so players keep waking
+ * 			up the computer player started by the next manager.
+ * Returns the PID of the player, -1 on failure.
+ */
+pid_t start_bot(int poke_fd) {
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() == 1)
+		exit(0);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_IGN);
+
+	/* a line per move, which would be lost in the buffer on SIGTERM */
+	setvbuf(stdout, 0, _IOLBF, 0);
+
+	DBG(2, "Computer player is running\n");
+	bot_main(poke_fd);
+	return -1;
+}
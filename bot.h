@@ -0,0 +1,12 @@
+#ifndef BOT_H
+#define BOT_H
+
+#include <sys/types.h>
+
+/* search threads and milliseconds per move, see BOT_THREADS in conf.h */
+extern int bot_threads;
+extern int bot_move_time;
+
+pid_t start_bot(int poke_fd);
+
+#endif
@@ -7,12 +7,172 @@
 	#define MGR_SOCKET "/var/run/kropkid_sock"
 #endif
 
-#define MAP_HEIGHT 22
-#define MAP_WIDTH 80
+/* Port of kropkid_exporter, which only listens on the loopback interface */
+#ifndef EXPORTER_PORT
+	#define EXPORTER_PORT 23002
+#endif
+
+/*
+ * Size of the board.  Boards larger than 80x22 scroll with the cursor, and
+ * are stored in tiles of TILE_WIDTH x TILE_HEIGHT fields, 4096 fields making
+ * one page.  Smaller boards are a single tile.
+ */
+#ifndef MAP_HEIGHT
+	#define MAP_HEIGHT 22
+#endif
+#ifndef MAP_WIDTH
+	#define MAP_WIDTH 80
+#endif
+#if MAP_WIDTH <= 80 && MAP_HEIGHT <= 22
+	#define TILE_WIDTH MAP_WIDTH
+	#define TILE_HEIGHT MAP_HEIGHT
+#else
+	#define TILE_WIDTH 64
+	#define TILE_HEIGHT 64
+#endif
 #define MAP_LEFT 0
 #define MAP_TOP 0
 
-#define MAX_GAMES 1024
+/* Limit of concurrent games, 0 to allow as many as the arena holds */
+#ifndef MAX_GAMES
+	#define MAX_GAMES 0
+#endif
+
+/*
+ * Game slots in the shared arena.  The arena is reserved up front, but memory
+ * is only used for slots that have held a game.
+ */
+#ifndef ARENA_SLOTS
+	#define ARENA_SLOTS 65536
+#endif
+
+/* Back the arena with huge pages if the system has them reserved */
+#ifndef ARENA_HUGE_PAGES
+	#define ARENA_HUGE_PAGES 0
+#endif
+
+/*
+ * Milliseconds between writebacks of an arena kept in a file (-f).  Moves
+ * made since the last one are lost when the machine goes down, not when only
+ * the server does.
+ */
+#ifndef ARENA_SYNC_INTERVAL
+	#define ARENA_SYNC_INTERVAL 1000
+#endif
+
+/*
+ * Game records (-g).  The manager reads the moves of every game each
+ * RECORD_INTERVAL ms and flushes them to the records each
+ * RECORD_FLUSH_INTERVAL ms.  A checkpoint of the board is stored every
+ * RECORD_CHECKPOINT moves, replays seek to any move from the last one.
+ * Records of games without moves since the last flush are closed, and no
+ * more than RECORD_OPEN_FILES are kept open.
+ */
+#ifndef RECORD_INTERVAL
+	#define RECORD_INTERVAL 100
+#endif
+#ifndef RECORD_FLUSH_INTERVAL
+	#define RECORD_FLUSH_INTERVAL 1000
+#endif
+#ifndef RECORD_CHECKPOINT
+	#define RECORD_CHECKPOINT 32
+#endif
+#ifndef RECORD_OPEN_FILES
+	#define RECORD_OPEN_FILES 256
+#endif
+
+/*
+ * Capacity of the move log of each game, in moves and in captured fields.
+ * Both must be powers of two.  Readers lagging further behind redraw the map.
+ */
+#define MOVE_LOG_SIZE 64
+#define MOVE_LOG_CELLS 4096
+
+/*
+ * Output kept for the spectators of each game, in bytes, a power of two of at
+ * least a frame.  Spectators look for new output every SPECTATE_TICK ms.
+ */
+#define FEED_SIZE 65536
+#ifndef SPECTATE_TICK
+	#define SPECTATE_TICK 50
+#endif
+
+/*
+ * Capture engine used by place_dot() unless kropkid -c picks another, the
+ * search on boards the bitboard engine does not support
+ * 0 - field by field search (rules.c)
+ * 1 - bit plane flood fill (bitboard.c)
+ */
+#ifndef RULES_ENGINE
+	#define RULES_ENGINE 0
+#endif
+
+/*
+ * Computer player, only on boards of a single tile.  Search threads, 0 for
+ * half the cores, leaving the rest to the sessions, or -1 to play without
+ * it.  Milliseconds to think about the moves due in all games together, and
+ * at least for each.
+ */
+#ifndef BOT_THREADS
+	#define BOT_THREADS 0
+#endif
+#ifndef BOT_MOVE_TIME
+	#define BOT_MOVE_TIME 1000
+#endif
+#ifndef BOT_MIN_MOVE_TIME
+	#define BOT_MIN_MOVE_TIME 50
+#endif
+
+/* Event server worker threads, 0 for one per core */
+#ifndef EVENT_WORKERS
+	#define EVENT_WORKERS 0
+#endif
+
+/*
+ * Sessions served by a process of the prefork pool before it is replaced,
+ * 0 to keep it for good
+ */
+#ifndef PREFORK_MAX_SESSIONS
+	#define PREFORK_MAX_SESSIONS 10000
+#endif
+
+/*
+ * Milliseconds an upgraded server started on SIGHUP has to take over, after
+ * which the running one carries on accepting
+ */
+#ifndef HANDOFF_TIMEOUT
+	#define HANDOFF_TIMEOUT 10000
+#endif
+
+/*
+ * Bytes read from a telnet client at a time.  Keys decoded from a read are
+ * handled together, with one screen update.
+ */
+#define TELNET_INPUT_SIZE 256
+
+/* Maximum epoll events handled per wakeup of an event server worker */
+#define EVENT_BATCH 64
+
+/*
+ * Bytes of output an event server connection may have waiting to be sent.
+ * A player falling further behind gets no updates until it has caught up and
+ * is then redrawn, other connections are closed.  Spectators skip updates
+ * well before that, see FEED_SIZE.
+ */
+#define EVENT_PENDING_MAX (4 * FEED_SIZE)
+
+/*
+ * Keep a ring of the last TRACE_SIZE binary trace records in every process,
+ * dumped to TRACE_PATH.<pid> on SIGUSR2 and decoded by kropkid_trace.
+ * TRACE_SIZE must be a power of two.
+ */
+#ifndef TRACE_ENABLED
+	#define TRACE_ENABLED 1
+#endif
+#define TRACE_SIZE 8192
+#ifndef TRACE_PATH
+	#define TRACE_PATH "/tmp/kropkid-trace"
+#endif
 
 /*
  * 0 - No debug messages
@@ -0,0 +1,1314 @@
+#define _GNU_SOURCE
+
+#include "conf.h"
+#include "arena.h"
+#include "event_server.h"
+#include "feed.h"
+#include "game_manager.h"
+#include "ipc_message.h"
+#include "record.h"
+#include "render.h"
+#include "rules.h"
+#include "telnet_input.h"
+#include "trace.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define min(x, y) (((x) < (y)) ? (x) : (y))
+#define max(x, y) (((x) > (y)) ? (x) : (y))
+
+enum CONN_STATE {
+	CONN_MENU,
+	CONN_JOIN,
+	CONN_INGAME,
+	CONN_SPECTATE,
+	CONN_MATCH,
+	CONN_REPLAY,
+	/* waiting for the reply to a manager request, keys are left queued */
+	CONN_REQUEST
+};
+
+/*
+ * Manager requests whose replies are read from the worker's channel as they
+ * come.  A conn waits for the reply in CONN_REQUEST, except for the eventfd
+ * of its opponent, which is fetched while it plays.
+ */
+enum REQUEST_KIND {
+	REQUEST_HOST,
+	REQUEST_JOIN,
+	REQUEST_BOT,
+	REQUEST_MATCH,
+	/* the game of a conn poked in the quick-match queue */
+	REQUEST_MATCHED,
+	REQUEST_MATCH_CANCEL,
+	REQUEST_SPECTATE,
+	REQUEST_OPPONENT_POKE
+};
+
+/* request sent on the worker's channel, replies come in the same order */
+struct manager_request {
+	uint32_t id;
+	enum REQUEST_KIND kind;
+	/* 0 once the conn has closed */
+	struct event_conn *conn;
+	/* game of the conn the request was sent in, see game_serial */
+	unsigned int game_serial;
+	/* channel the request was sent on, see channel_epoch */
+	unsigned int channel_epoch;
+};
+
+struct event_conn;
+struct event_worker;
+
+/* epoll user data, tells apart the socket and the poke eventfd of a conn */
+struct conn_handle {
+	struct event_conn *conn;
+	int is_poke;
+};
+
+/* epoll user data of the spectator timers and the channels to the manager */
+static struct conn_handle tick_handle, channel_handle;
+
+/**
+ * Per-connection state machine replacing session_start, session_join and
+ * session_ingame of the forking server
+ */
+struct event_conn {
+	int sock;
+
+	/* eventfd written by the opponent after a move */
+	int efd;
+
+	/* opponent's eventfd from the manager, for opponents served by another
+	   process, -1 until needed */
+	int opponent_efd;
+
+	struct conn_handle sock_handle, poke_handle;
+
+	/* keys typed by the user, handled a read at a time */
+	struct telnet_input input;
+
+	/* worker whose epoll instance the conn is in */
+	struct event_worker *worker;
+
+	/* session id used in manager messages */
+	pid_t sid;
+
+	enum CONN_STATE state;
+	int closing;
+
+	/* poked while in CONN_REQUEST */
+	int poked;
+
+	/* game key typed in so far, CONN_JOIN only, and kept while spectating */
+	char game_key[7];
+	int key_len;
+	/* menu option the key is typed in for, j, w or r */
+	char key_action;
+
+	/* CONN_INGAME only */
+	struct game *game;
+	/* counts the games attached to, tells replies for an earlier one */
+	unsigned int game_serial;
+	/* opponent_efd has been asked for */
+	int fetching_poke;
+	char player;
+	/* moves read from the game's log */
+	uint32_t log_cursor;
+	int waiting_for_opponent;
+	int cur_y, cur_x;
+	/* redraw asked for in the current batch of input */
+	int map_redraw;
+	/* part of the map on the terminal */
+	struct viewport view;
+
+	/* CONN_SPECTATE only, linked in the worker's list of spectators */
+	struct game *spectated;
+	uint32_t feed_cursor;
+	int feed_redraw;
+	struct event_conn *next_spectator, *prev_spectator;
+
+	/* CONN_REPLAY only */
+	struct replay *replay;
+	int replay_redraw;
+
+	/* stdio stream appending to the pending output below */
+	FILE *out;
+	char *pending;
+	size_t pending_len, pending_size, pending_sent;
+	/* epoll events the socket is registered for */
+	uint32_t events;
+	/* output dropped past EVENT_PENDING_MAX, redrawn once the rest is sent */
+	int out_overrun;
+
+	struct event_conn *next_closed;
+};
+
+struct event_worker {
+	pthread_t thread;
+	int epfd;
+	int listen_sock;
+
+	/* ticks every SPECTATE_TICK ms while the worker has spectators */
+	int timer_fd;
+	struct event_conn *spectators;
+
+	/* spectator to serve next in the current tick, 0 when done */
+	struct event_conn *tick_next;
+
+	/* requests waiting for replies on the worker's channel to the manager,
+	   a ring of requests_size entries */
+	struct manager_request *requests;
+	unsigned int requests_head, requests_count, requests_size;
+	/* counts the channels opened, replies on a closed one are lost */
+	unsigned int channel_epoch;
+};
+
+/*
+ * Maps session ids to connections so sessions can poke each other across
+ * worker threads.  Slot i holds session id session_base + i.
+ */
+pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+struct event_conn **registry = 0;
+int registry_size = 0;
+int registry_free = 0;
+pid_t session_base = EVENT_SESSION_BASE;
+
+/* retiring stops accepting once max_sessions connections have been opened,
+   and exits the process when the last one closes */
+struct event_worker *workers;
+int workers_count;
+struct event_server_options options;
+unsigned int sessions_accepted = 0;
+int conns_open = 0;
+int retired = 0;
+
+/**
+ * Assigns a session id to the connection.  Returns 0 on success, -1 on failure.
+ */
+int registry_add(struct event_conn *c) {
+	int slot;
+	pthread_mutex_lock(&registry_lock);
+	for (slot = registry_free; slot < registry_size; slot++)
+		if (!registry[slot])
+			break;
+	if (slot == registry_size) {
+		int new_size = registry_size ? registry_size * 2 : 1024;
+		if (new_size > EVENT_INSTANCE_SESSIONS) {
+			pthread_mutex_unlock(&registry_lock);
+			return -1;
+		}
+		struct event_conn **r =
+			realloc(registry, new_size * sizeof(struct event_conn*));
+		if (!r) {
+			pthread_mutex_unlock(&registry_lock);
+			return -1;
+		}
+		memset(r + registry_size, 0,
+				(new_size - registry_size) * sizeof(struct event_conn*));
+		registry = r;
+		registry_size = new_size;
+	}
+	registry[slot] = c;
+	registry_free = slot + 1;
+	c->sid = session_base + slot;
+	pthread_mutex_unlock(&registry_lock);
+	return 0;
+}
+
+void registry_remove(struct event_conn *c) {
+	int slot = c->sid - session_base;
+	pthread_mutex_lock(&registry_lock);
+	registry[slot] = 0;
+	if (slot < registry_free)
+		registry_free = slot;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/**
+ * Wakes up the connection with the given session id if this process serves
+ * it.  The eventfd is written under the registry lock, so it cannot be closed
+ * in the meantime.
+ * Returns 0 if the connection was found, -1 otherwise.
+ */
+int event_poke(pid_t sid) {
+	int slot = sid - session_base, found = 0;
+	uint64_t one = 1;
+	pthread_mutex_lock(&registry_lock);
+	if (slot >= 0 && slot < registry_size && registry[slot]) {
+		found = 1;
+		if (write(registry[slot]->efd, &one, sizeof(one)) == -1)
+			DBG(1, "event_poke: write failed\n");
+	}
+	pthread_mutex_unlock(&registry_lock);
+	return found ? 0 : -1;
+}
+
+/**
+ * Returns 1 if this process serves the connection with the given session id,
+ * 0 otherwise
+ */
+int event_serves(pid_t sid) {
+	int slot = sid - session_base, found;
+	pthread_mutex_lock(&registry_lock);
+	found = slot >= 0 && slot < registry_size && registry[slot] != 0;
+	pthread_mutex_unlock(&registry_lock);
+	return found;
+}
+
+/**
+ * Returns the session id of the opponent in the conn's game, 0 if there is
+ * none
+ */
+pid_t conn_opponent(struct event_conn *c) {
+	return (c->game->sessions[0] == c->sid) ?
+		c->game->sessions[1] : c->game->sessions[0];
+}
+
+/**
+ * Queues a request sent to the manager for its reply.  The worker's channel
+ * is watched from the first request on, and again after it has been
+ * reopened.  Returns 0 on success, -1 if the request has not been sent or
+ * cannot be queued.
+ */
+int conn_send(struct event_conn *c, enum REQUEST_KIND kind, uint32_t id) {
+	struct event_worker *w = c->worker;
+	if (id == 0)
+		return -1;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &channel_handle;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, ipc_channel(), &ev) == 0)
+		/* a new channel, the replies to earlier requests will not come */
+		w->channel_epoch++;
+
+	if (w->requests_count == w->requests_size) {
+		unsigned int size = w->requests_size ? w->requests_size * 2 : 64, i;
+		struct manager_request *r = malloc(size * sizeof(*r));
+		if (!r)
+			return -1;
+		for (i = 0; i < w->requests_count; i++)
+			r[i] = w->requests[(w->requests_head + i) % w->requests_size];
+		free(w->requests);
+		w->requests = r;
+		w->requests_head = 0;
+		w->requests_size = size;
+	}
+	struct manager_request *r = &w->requests[
+		(w->requests_head + w->requests_count++) % w->requests_size];
+	r->id = id;
+	r->kind = kind;
+	r->conn = c;
+	r->game_serial = c->game_serial;
+	r->channel_epoch = w->channel_epoch;
+	return 0;
+}
+
+/**
+ * Asks the manager for the eventfd of an opponent served by another process,
+ * unless it is on its way
+ */
+void conn_fetch_opponent_poke(struct event_conn *c) {
+	pid_t opponent = conn_opponent(c);
+	if (c->opponent_efd != -1 || c->fetching_poke || opponent == 0 ||
+			event_serves(opponent))
+		return;
+	if (conn_send(c, REQUEST_OPPONENT_POKE,
+				send_opponent_poke_query(c->sid)) == 0)
+		c->fetching_poke = 1;
+}
+
+/**
+ * Wakes up the opponent, through its eventfd if it is served by another
+ * process.  Until the eventfd has been fetched the manager passes pokes on.
+ */
+void conn_poke_opponent(struct event_conn *c, pid_t opponent) {
+	uint64_t one = 1;
+	if (event_poke(opponent) == 0)
+		return;
+	if (c->opponent_efd == -1) {
+		relay_poke(c->sid);
+		conn_fetch_opponent_poke(c);
+	} else if (write(c->opponent_efd, &one, sizeof(one)) == -1)
+		perror("event server: poke");
+}
+
+ssize_t conn_out_write(void *cookie, const char *buf, size_t size) {
+	struct event_conn *c = cookie;
+	if (c->out_overrun)
+		return size;
+	if (c->pending_len - c->pending_sent + size > EVENT_PENDING_MAX) {
+		/* the client is not reading, stop queueing for it */
+		TRACE(TRACE_FRAME_DROP, c->sock, c->pending_len - c->pending_sent, 0);
+		if (c->state == CONN_INGAME)
+			c->out_overrun = 1;
+		else
+			c->closing = 1;
+		return size;
+	}
+	if (c->pending_len + size > c->pending_size) {
+		size_t new_size = max(c->pending_size * 2, c->pending_len + size);
+		char *p = realloc(c->pending, new_size);
+		if (!p)
+			return -1;
+		c->pending = p;
+		c->pending_size = new_size;
+	}
+	memcpy(c->pending + c->pending_len, buf, size);
+	c->pending_len += size;
+	return size;
+}
+
+/*
+ * Screen update of the conn being handled.  Handlers render into it and end
+ * with conn_end_frame, so it is empty between events.
+ */
+static __thread struct frame screen;
+
+/**
+ * Appends the screen update to the pending output, after anything written to
+ * the stdio stream before it.
+ */
+void conn_end_frame(struct event_conn *c) {
+	fflush(c->out);
+	if (screen.len > 0) {
+		TRACE(TRACE_FRAME_SEND, c->sock, screen.len, 0);
+		conn_out_write(c, screen.data, screen.len);
+	}
+	frame_init(&screen);
+}
+
+void conn_print_menu(struct event_conn *c) {
+	fputs("kropkid\r\n"
+			"<http://github.com/PawelStiasny/kropkid>\r\n"
+			"Your terminal should be at least 80x24 characters\r\n\r\n"
+			"[h]ost / [j]oin / [m]atch / [c]omputer / "
+			"[w]atch / [r]eplay / [q]uit? ", c->out);
+	c->state = CONN_MENU;
+}
+
+/**
+ * Redraws the screen of a conn whose output was dropped, once the output
+ * queued before has been sent
+ */
+void conn_catch_up(struct event_conn *c) {
+	c->out_overrun = 0;
+	frame_puts(&screen, "\e[0m\e[2J\e[H");
+	if (c->state == CONN_INGAME) {
+		print_map(&screen, c->game->map, &c->view, MAP_TOP, MAP_LEFT);
+		print_status(&screen, c->game->key, &c->game->score, c->player,
+				c->waiting_for_opponent, c->cur_y, c->cur_x, &c->view);
+	}
+	conn_end_frame(c);
+	if (c->state == CONN_MENU)
+		conn_print_menu(c);
+}
+
+/**
+ * Sends as much pending output as the socket accepts.  Registers for EPOLLOUT
+ * while output remains.
+ */
+void conn_flush(struct event_worker *w, struct event_conn *c) {
+	fflush(c->out);
+	while (c->pending_sent < c->pending_len) {
+		ssize_t r = send(c->sock, c->pending + c->pending_sent,
+				c->pending_len - c->pending_sent,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				c->closing = 1;
+			break;
+		}
+		c->pending_sent += r;
+	}
+	if (c->pending_sent == c->pending_len) {
+		c->pending_sent = c->pending_len = 0;
+		if (c->out_overrun && !c->closing) {
+			conn_catch_up(c);
+			conn_flush(w, c);
+			return;
+		}
+	}
+
+	/* input waits while a manager request is in flight */
+	uint32_t events = (c->state == CONN_REQUEST ? 0 : EPOLLIN) |
+		(c->pending_len > 0 ? EPOLLOUT : 0);
+	if (events != c->events && !c->closing) {
+		struct epoll_event ev;
+		ev.events = events;
+		ev.data.ptr = &c->sock_handle;
+		epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->sock, &ev);
+		c->events = events;
+	}
+}
+
+/**
+ * Attaches to the game in the arena slot, counterpart of init_game().
+ * Returns 0 on success, -1 on failure.
+ */
+int conn_init_game(struct event_conn *c, int slot) {
+	struct game *g = arena_game(slot);
+	if (!g)
+		return -1;
+	c->game = g;
+	c->game_serial++;
+	c->player = (g->sessions[0] == c->sid) ? 1 : 2;
+	c->log_cursor = move_log_head(&g->log);
+
+	char last = move_log_last_player(&g->log);
+	c->waiting_for_opponent = last ? last == c->player : c->player == 1;
+
+	/* a host asks once it has heard from its opponent */
+	conn_fetch_opponent_poke(c);
+	return 0;
+}
+
+void conn_enter_game(struct event_conn *c) {
+	c->state = CONN_INGAME;
+	c->cur_y = MAP_HEIGHT / 2;
+	c->cur_x = MAP_WIDTH / 2;
+	c->view.y = c->view.x = 0;
+	viewport_follow(&c->view, c->cur_y, c->cur_x);
+	frame_puts(&screen, "\e[2J\e[H");
+	print_map(&screen, c->game->map, &c->view, MAP_TOP, MAP_LEFT);
+	print_status(&screen, c->game->key, &c->game->score, c->player,
+			c->waiting_for_opponent, c->cur_y, c->cur_x, &c->view);
+}
+
+/**
+ * Detaches from the game and lets the manager know, which pokes the opponent
+ */
+void conn_leave_game(struct event_conn *c) {
+	c->game = 0;
+	notify(c->sid, MSG_SESSION_QUIT);
+	if (c->opponent_efd != -1) {
+		close(c->opponent_efd);
+		c->opponent_efd = -1;
+	}
+}
+
+/**
+ * Arms the worker's timer for its first spectator and disarms it after the
+ * last one has gone
+ */
+void worker_set_timer(struct event_worker *w) {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (w->spectators) {
+		its.it_interval.tv_nsec = SPECTATE_TICK * 1000000L;
+		its.it_value = its.it_interval;
+	}
+	if (timerfd_settime(w->timer_fd, 0, &its, 0) == -1)
+		perror("event server: timerfd_settime");
+}
+
+/**
+ * Draws the spectated part of the map from scratch, counterpart of the redraw
+ * in session_spectate
+ */
+void conn_spectate_redraw(struct event_conn *c) {
+	c->feed_cursor = feed_head(&c->spectated->feed);
+	c->feed_redraw = 0;
+	frame_puts(&screen, "\e[0m\e[2J\e[H");
+	print_map(&screen, c->spectated->map, &c->view, MAP_TOP, MAP_LEFT);
+	print_score(&screen, &c->spectated->score);
+	frame_printf(&screen, "\e[24;0H\e[0KWatching game #%s  "
+			"q:Stop watching  r:Redraw", c->game_key);
+	conn_end_frame(c);
+}
+
+void conn_start_spectating(struct event_conn *c, struct game *g) {
+	struct event_worker *w = c->worker;
+	c->state = CONN_SPECTATE;
+	c->spectated = g;
+	c->view.y = FEED_VIEW_Y;
+	c->view.x = FEED_VIEW_X;
+	feed_watch(&g->feed);
+	conn_spectate_redraw(c);
+
+	c->prev_spectator = 0;
+	c->next_spectator = w->spectators;
+	if (w->spectators)
+		w->spectators->prev_spectator = c;
+	w->spectators = c;
+	if (!c->next_spectator)
+		worker_set_timer(w);
+}
+
+void conn_stop_spectating(struct event_conn *c) {
+	struct event_worker *w = c->worker;
+	if (c->prev_spectator)
+		c->prev_spectator->next_spectator = c->next_spectator;
+	else
+		w->spectators = c->next_spectator;
+	if (c->next_spectator)
+		c->next_spectator->prev_spectator = c->prev_spectator;
+	if (w->tick_next == c)
+		w->tick_next = c->next_spectator;
+	c->spectated = 0;
+	if (!w->spectators)
+		worker_set_timer(w);
+}
+
+/**
+ * Passes output published in the feed since the last tick on to the
+ * spectator, without rendering anything.  A spectator whose output is piling
+ * up skips updates and is redrawn once it has caught up.
+ */
+void conn_spectate_update(struct event_conn *c) {
+	struct game *g = c->spectated;
+	if (g->state != GAME_ACTIVE || strcmp(g->key, c->game_key) != 0) {
+		conn_stop_spectating(c);
+		fputs("\e[0m\e[2J\e[HThe game is over\r\n", c->out);
+		conn_print_menu(c);
+		return;
+	}
+
+	feed_watch(&g->feed);
+	if (c->pending_len - c->pending_sent > FEED_SIZE) {
+		c->feed_redraw = 1;
+		return;
+	}
+	if (c->feed_redraw) {
+		conn_spectate_redraw(c);
+		return;
+	}
+
+	struct iovec iov[2];
+	ssize_t len = feed_peek(&g->feed, c->feed_cursor, iov);
+	if (len == 0)
+		return;
+	fflush(c->out);
+	size_t mark = c->pending_len;
+	if (len > 0) {
+		conn_out_write(c, iov[0].iov_base, iov[0].iov_len);
+		conn_out_write(c, iov[1].iov_base, iov[1].iov_len);
+	}
+	if (len == -1 || feed_overrun(&g->feed, c->feed_cursor)) {
+		c->pending_len = mark;
+		conn_spectate_redraw(c);
+	} else
+		c->feed_cursor += len;
+}
+
+void conn_handle_spectate(struct event_conn *c, int input) {
+	if (input == 'q') {
+		conn_stop_spectating(c);
+		fputs("\e[0m\e[2J\e[H", c->out);
+		conn_print_menu(c);
+	} else if (input == 'r' || input == 0x0c)
+		conn_spectate_redraw(c);
+}
+
+/**
+ * Starts serving the spectators of the worker on a tick of its timer, unless
+ * the last tick is still being served
+ */
+void worker_start_tick(struct event_worker *w) {
+	uint64_t ticks;
+	if (read(w->timer_fd, &ticks, sizeof(ticks)) == -1)
+		return;
+	if (!w->tick_next)
+		w->tick_next = w->spectators;
+}
+
+/**
+ * Serves up to EVENT_BATCH spectators of the current tick, so that the
+ * players' events are not held up by thousands of spectators.  Conns failing
+ * meanwhile are added to closed.
+ */
+void worker_spectate_tick(struct event_worker *w, struct event_conn **closed) {
+	int n;
+	for (n = 0; n < EVENT_BATCH && w->tick_next; n++) {
+		struct event_conn *c = w->tick_next;
+		w->tick_next = c->next_spectator;
+		if (c->closing)
+			continue;
+		conn_spectate_update(c);
+		conn_flush(w, c);
+		if (c->closing) {
+			c->next_closed = *closed;
+			*closed = c;
+		}
+	}
+}
+
+/**
+ * Shows a recorded game, counterpart of session_replay().  The board is drawn
+ * once per batch of input.
+ */
+void conn_start_replay(struct event_conn *c) {
+	memset(&c->view, 0, sizeof(c->view));
+	c->replay_redraw = 1;
+	c->state = CONN_REPLAY;
+}
+
+void conn_stop_replay(struct event_conn *c) {
+	replay_close(c->replay);
+	c->replay = 0;
+}
+
+void conn_handle_replay(struct event_conn *c, int input) {
+	if (input == 'q') {
+		conn_stop_replay(c);
+		frame_puts(&screen, "\e[0m\e[2J\e[H");
+		conn_end_frame(c);
+		conn_print_menu(c);
+	} else if (input == 'r' || input == 0x0c)
+		c->replay_redraw = 1;
+	else if (input < 0x100)
+		replay_input(c->replay, input);
+}
+
+/**
+ * Goes back to the menu after a choice that has failed
+ */
+void conn_menu_failed(struct event_conn *c, const char *reason) {
+	fprintf(c->out, "\r\n%s\r\n"
+			"[h]ost / [j]oin / [m]atch / [c]omputer / "
+			"[w]atch / [r]eplay / [q]uit? ", reason);
+	c->state = CONN_MENU;
+}
+
+void conn_handle_reply(struct event_conn *c, const struct manager_request *r,
+		int ok, int value, int fd);
+
+/**
+ * Waits in CONN_REQUEST for the reply to the request sent to the manager,
+ * which is handled in conn_handle_reply().
+ * id		id of the request, 0 if it could not be sent
+ */
+void conn_request(struct event_conn *c, enum REQUEST_KIND kind, uint32_t id) {
+	c->poked = 0;
+	if (conn_send(c, kind, id) == -1) {
+		struct manager_request failed = { id, kind, c, c->game_serial, 0 };
+		conn_handle_reply(c, &failed, 0, -1, -1);
+		return;
+	}
+	c->state = CONN_REQUEST;
+}
+
+void conn_handle_menu(struct event_conn *c, int input) {
+	if (input == 'q') {
+		fputs("\r\nGoodbye\r\n", c->out);
+		c->closing = 1;
+	} else if (input == 'h') {
+		notify_idle_session(c->sid, c->efd);
+		conn_request(c, REQUEST_HOST, send_game_slot_query(c->sid));
+	} else if (input == 'm') {
+		conn_request(c, REQUEST_MATCH, send_match_request(c->sid, c->efd));
+	} else if (input == 'c') {
+		notify_idle_session(c->sid, c->efd);
+		conn_request(c, REQUEST_BOT, send_bot_request(c->sid));
+	} else if (input == 'j' || input == 'w' || input == 'r') {
+		fputs("\r\nEnter game key: ", c->out);
+		c->key_len = 0;
+		c->key_action = input;
+		c->state = CONN_JOIN;
+	}
+}
+
+void conn_handle_join(struct event_conn *c, int input) {
+	if (input < 'a' || input > 'z') {
+		fputs("\r\n[h]ost / [j]oin / [m]atch / [c]omputer / "
+				"[w]atch / [r]eplay / [q]uit? ", c->out);
+		c->state = CONN_MENU;
+		return;
+	}
+	c->game_key[c->key_len++] = input;
+	fputc(input, c->out);
+	if (c->key_len < 6)
+		return;
+
+	c->game_key[6] = 0;
+	if (c->key_action == 'r') {
+		c->replay = replay_open_game(c->game_key);
+		if (!c->replay)
+			conn_menu_failed(c, "No record of the game");
+		else
+			conn_start_replay(c);
+		return;
+	}
+	if (c->key_action == 'w') {
+		conn_request(c, REQUEST_SPECTATE,
+				send_spectate_query(c->sid, c->game_key));
+		return;
+	}
+	notify_join_game(c->sid, c->game_key, c->efd);
+	conn_request(c, REQUEST_JOIN, send_game_slot_query(c->sid));
+}
+
+/**
+ * Gives up waiting for an opponent on q, counterpart of session_match().
+ * The wait itself ends in conn_handle_poke().
+ */
+void conn_handle_match(struct event_conn *c, int input) {
+	if (input != 'q')
+		return;
+	/* an opponent may have been found meanwhile, see conn_handle_reply() */
+	conn_request(c, REQUEST_MATCH_CANCEL, send_match_cancel(c->sid));
+}
+
+/**
+ * Carries on with what the conn was doing once the manager has replied.
+ * ok		whether the reply has come, value holds it then
+ * fd		descriptor that came with the reply, -1 for none
+ */
+void conn_handle_reply(struct event_conn *c, const struct manager_request *r,
+		int ok, int value, int fd)
+{
+	if (r->kind == REQUEST_OPPONENT_POKE) {
+		c->fetching_poke = 0;
+		if (c->game && c->game_serial == r->game_serial &&
+				c->opponent_efd == -1)
+			c->opponent_efd = fd;
+		else if (fd != -1)
+			close(fd);
+		return;
+	}
+	if (fd != -1)
+		close(fd);
+
+	int slot = ok ? value : -1;
+	switch (r->kind) {
+		case REQUEST_HOST:
+			if (conn_init_game(c, slot) == -1)
+				conn_menu_failed(c, "Could not host a game");
+			else
+				conn_enter_game(c);
+			break;
+		case REQUEST_JOIN:
+			if (conn_init_game(c, slot) == -1)
+				conn_menu_failed(c, "No games to join");
+			else
+				conn_enter_game(c);
+			break;
+		case REQUEST_BOT:
+			if (conn_init_game(c, slot) == -1) {
+				notify(c->sid, MSG_SESSION_QUIT);
+				conn_menu_failed(c, "No computer player");
+			} else
+				conn_enter_game(c);
+			break;
+		case REQUEST_MATCH:
+			if (!ok)
+				slot = MATCH_FAILED;
+			if (slot == MATCH_WAITING) {
+				fputs("\r\nWaiting for an opponent, [q] to cancel", c->out);
+				c->state = CONN_MATCH;
+				/* the manager pokes once the game has been set up, which
+				   may have happened already */
+				if (c->poked)
+					conn_request(c, REQUEST_MATCHED,
+							send_game_slot_query(c->sid));
+			} else if (conn_init_game(c, slot) == -1)
+				conn_menu_failed(c, "No match");
+			else
+				conn_enter_game(c);
+			break;
+		case REQUEST_MATCHED:
+			if (conn_init_game(c, slot) == -1)
+				c->state = CONN_MATCH;
+			else
+				conn_enter_game(c);
+			break;
+		case REQUEST_MATCH_CANCEL:
+			if (conn_init_game(c, slot) == 0)
+				conn_enter_game(c);
+			else {
+				fputs("\r\n[h]ost / [j]oin / [m]atch / [c]omputer / "
+						"[w]atch / [r]eplay / [q]uit? ", c->out);
+				c->state = CONN_MENU;
+			}
+			break;
+		case REQUEST_SPECTATE: {
+			struct game *g = arena_game(slot);
+			if (!g)
+				conn_menu_failed(c, "No game to watch");
+			else
+				conn_start_spectating(c, g);
+			break;
+		}
+		case REQUEST_OPPONENT_POKE:
+			break;
+	}
+}
+
+void conn_handle_ingame(struct event_conn *c, int input) {
+	switch(input) {
+		case 'q':
+			frame_puts(&screen, "\e[0m\e[2J\e[H");
+			conn_end_frame(c);
+			conn_leave_game(c);
+			conn_print_menu(c);
+			return;
+		case KEY_UP:
+		case 'k' :
+			c->cur_y = max(0, c->cur_y - 1); break;
+		case KEY_DOWN:
+		case 'j':
+			c->cur_y = min(MAP_HEIGHT - 1, c->cur_y + 1); break;
+		case KEY_LEFT:
+		case 'h' :
+			c->cur_x = max(0, c->cur_x - 1); break;
+		case KEY_RIGHT:
+		case 'l':
+			c->cur_x = min(MAP_WIDTH - 1, c->cur_x + 1); break;
+		case ' ': {
+			char *map = c->game->map;
+			int cell = CELL(c->cur_y, c->cur_x);
+			if (!c->waiting_for_opponent && (map[cell] & 3) == 0) {
+				static __thread int captured[MAP_CELLS];
+				int count = place_dot(map, &c->game->dots,
+						c->cur_y, c->cur_x, c->player, captured,
+						&c->game->score);
+				move_log_append(&c->game->log, cell, c->player,
+						captured, count);
+				feed_publish(&c->game->feed, &c->game->log, map,
+						&c->game->score, 3 - c->player);
+				c->waiting_for_opponent = 1;
+				pid_t opponent = (c->game->sessions[0] == c->sid) ?
+					c->game->sessions[1] : c->game->sessions[0];
+				if (opponent != 0)
+					conn_poke_opponent(c, opponent);
+				else
+					DBG(2, "Noone to poke\n");
+				print_moves(&screen, &c->game->log, &c->log_cursor, map,
+						&c->view, MAP_TOP, MAP_LEFT);
+			}
+			break;
+		}
+		case 'r':
+		case 0x0c: /* ^L */
+			c->map_redraw = 1;
+			break;
+	}
+}
+
+/**
+ * Handles the keys queued, up to one sending a manager request, and makes
+ * one screen update of them
+ */
+void conn_handle_keys(struct event_conn *c) {
+	int key;
+	while (!c->closing && c->state != CONN_REQUEST &&
+			(key = telnet_input_next(&c->input)) != -1) {
+		switch (c->state) {
+			case CONN_MENU: conn_handle_menu(c, key); break;
+			case CONN_JOIN: conn_handle_join(c, key); break;
+			case CONN_INGAME: conn_handle_ingame(c, key); break;
+			case CONN_SPECTATE: conn_handle_spectate(c, key); break;
+			case CONN_MATCH: conn_handle_match(c, key); break;
+			case CONN_REPLAY: conn_handle_replay(c, key); break;
+			case CONN_REQUEST: break;
+		}
+	}
+	if (c->state == CONN_REPLAY) {
+		print_replay(&screen, c->replay, &c->view, c->replay_redraw);
+		c->replay_redraw = 0;
+	}
+	if (c->state == CONN_INGAME) {
+		/* scroll and redraw once per batch, a long run of keys could
+		   otherwise fill the frame with redraws */
+		int scrolled = viewport_follow(&c->view, c->cur_y, c->cur_x);
+		if (c->map_redraw)
+			frame_puts(&screen, "\e[0m\e[2J\e[H");
+		if (c->map_redraw || scrolled)
+			print_map(&screen, c->game->map, &c->view, MAP_TOP, MAP_LEFT);
+		c->map_redraw = 0;
+		print_status(&screen, c->game->key, &c->game->score, c->player,
+				c->waiting_for_opponent, c->cur_y, c->cur_x, &c->view);
+	}
+	conn_end_frame(c);
+}
+
+void conn_handle_input(struct event_conn *c) {
+	ssize_t n = telnet_input_read(&c->input, c->sock, MSG_DONTWAIT);
+	if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+		c->closing = 1;
+		return;
+	}
+	conn_handle_keys(c);
+}
+
+/**
+ * Handles a poke from the opponent, counterpart of the poke_fd handling in
+ * session_ingame.
+ */
+void conn_handle_poke(struct event_conn *c) {
+	uint64_t count;
+	if (read(c->efd, &count, sizeof(count)) == -1)
+		return;
+	if (c->state == CONN_REQUEST) {
+		c->poked = 1;
+		return;
+	}
+	if (c->state == CONN_MATCH) {
+		/* the manager pokes once the game has been set up */
+		conn_request(c, REQUEST_MATCHED, send_game_slot_query(c->sid));
+		conn_end_frame(c);
+		return;
+	}
+	if (c->state != CONN_INGAME)
+		return;
+	/* the opponent of a host has shown up */
+	conn_fetch_opponent_poke(c);
+
+	if (c->game->state == GAME_ORPHANED) {
+		frame_puts(&screen, "\e[0m\e[2J\e[HThe other player has left\r\n");
+		conn_end_frame(c);
+		conn_leave_game(c);
+		conn_print_menu(c);
+	} else if (move_log_head(&c->game->log) != c->log_cursor ||
+			(c->waiting_for_opponent &&
+			move_log_last_player(&c->game->log) != c->player)) {
+		/* an opponent served elsewhere may have moved before this conn
+		   drew its own move, and with it the opponent's */
+		print_moves(&screen, &c->game->log, &c->log_cursor, c->game->map,
+				&c->view, MAP_TOP, MAP_LEFT);
+		c->waiting_for_opponent = 0;
+		frame_puts(&screen, "\e[8;50H\e[0K");
+		print_status(&screen, c->game->key, &c->game->score, c->player,
+				c->waiting_for_opponent, c->cur_y, c->cur_x, &c->view);
+		conn_end_frame(c);
+	}
+}
+
+void conn_open(struct event_worker *w, int sock) {
+	struct event_conn *c = calloc(1, sizeof(struct event_conn));
+	if (!c) {
+		close(sock);
+		return;
+	}
+	c->sock = sock;
+	c->worker = w;
+	c->sock_handle.conn = c;
+	c->poke_handle.conn = c;
+	c->poke_handle.is_poke = 1;
+	c->opponent_efd = -1;
+	c->events = EPOLLIN;
+
+	c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	cookie_io_functions_t out_functions = { .write = conn_out_write };
+	c->out = fopencookie(c, "w", out_functions);
+	if (c->efd == -1 || !c->out || registry_add(c) == -1) {
+		perror("event server: conn_open");
+		if (c->efd != -1) close(c->efd);
+		if (c->out) fclose(c->out);
+		free(c->pending);
+		free(c);
+		close(sock);
+		return;
+	}
+
+	/* screen updates leave in one send, do not hold them back */
+	int yes = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &c->sock_handle;
+	epoll_ctl(w->epfd, EPOLL_CTL_ADD, sock, &ev);
+	ev.data.ptr = &c->poke_handle;
+	epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->efd, &ev);
+
+	__sync_add_and_fetch(&conns_open, 1);
+	TRACE(TRACE_CONN_OPEN, c->sid, 0, 0);
+
+	/* set raw terminal, no echo (telnet protocol) */
+	fputs("\xff\xfb\x01\xff\xfb\x03\xff\xfd\x0f3", c->out);
+	conn_print_menu(c);
+	conn_flush(w, c);
+}
+
+/**
+ * Drops the conn from the requests waiting for replies, as it is closing
+ */
+void worker_forget_conn(struct event_worker *w, struct event_conn *c) {
+	unsigned int i;
+	for (i = 0; i < w->requests_count; i++) {
+		struct manager_request *r =
+			&w->requests[(w->requests_head + i) % w->requests_size];
+		if (r->conn == c)
+			r->conn = 0;
+	}
+}
+
+/**
+ * Hands the reply to the request at the head of the worker's queue to its
+ * conn.  Conns failing meanwhile are added to closed.
+ */
+void worker_reply(struct event_worker *w, int ok, int value, int fd,
+		struct event_conn **closed)
+{
+	struct manager_request r = w->requests[w->requests_head];
+	w->requests_head = (w->requests_head + 1) % w->requests_size;
+	w->requests_count--;
+
+	struct event_conn *c = r.conn;
+	if (!c || c->closing) {
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	conn_handle_reply(c, &r, ok, value, fd);
+	/* keys typed meanwhile */
+	conn_handle_keys(c);
+	conn_flush(w, c);
+	if (c->closing) {
+		c->next_closed = *closed;
+		*closed = c;
+	}
+}
+
+/**
+ * Reads the replies that have come on the worker's channel.  Requests whose
+ * replies are lost with a channel are answered as failed.
+ */
+void worker_read_replies(struct event_worker *w, struct event_conn **closed) {
+	for (;;) {
+		uint32_t id;
+		int value = -1, fd;
+		ssize_t n = ipc_read_reply(&id, &value, sizeof(value), &fd);
+		if (n == -1 && errno == EAGAIN)
+			return;
+		if (n == -1) {
+			/* the channel has been closed, a later request reopens it */
+			DBG(1, "event server: channel to the manager lost\n");
+			w->channel_epoch++;
+		}
+
+		while (w->requests_count > 0 &&
+				w->requests[w->requests_head].channel_epoch !=
+				w->channel_epoch)
+			worker_reply(w, 0, -1, -1, closed);
+		if (n == -1)
+			return;
+
+		if (w->requests_count == 0 ||
+				w->requests[w->requests_head].id != id) {
+			DBG(1, "event server: unexpected reply %u\n", id);
+			if (fd != -1)
+				close(fd);
+			continue;
+		}
+		worker_reply(w, n == sizeof(value), value, fd, closed);
+	}
+}
+
+void conn_close(struct event_worker *w, struct event_conn *c) {
+	TRACE(TRACE_CONN_CLOSE, c->sid, 0, 0);
+	if (c->game)
+		conn_leave_game(c);
+	else if (c->state == CONN_MATCH || c->state == CONN_REQUEST)
+		/* takes the conn out of the quick-match queue, or out of a game
+		   the request has put it in */
+		notify(c->sid, MSG_SESSION_QUIT);
+	worker_forget_conn(w, c);
+	if (c->spectated)
+		conn_stop_spectating(c);
+	if (c->replay)
+		conn_stop_replay(c);
+	registry_remove(c);
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->sock, 0);
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->efd, 0);
+	close(c->efd);
+	close(c->sock);
+	fclose(c->out);
+	free(c->pending);
+	free(c);
+
+	if (__sync_sub_and_fetch(&conns_open, 1) == 0 && retired) {
+		DBG(2, "Event server retired\n");
+		exit(0);
+	}
+}
+
+/**
+ * Stops accepting connections in all workers.  The process exits once the
+ * open connections have closed.
+ */
+void retire() {
+	int i;
+	if (__sync_lock_test_and_set(&retired, 1))
+		return;
+	for (i = 0; i < workers_count; i++)
+		epoll_ctl(workers[i].epfd, EPOLL_CTL_DEL, workers[i].listen_sock, 0);
+	DBG(2, "Event server retiring after %u sessions\n", sessions_accepted);
+	if (options.retire)
+		options.retire();
+	if (__sync_fetch_and_add(&conns_open, 0) == 0)
+		exit(0);
+}
+
+void accept_connections(struct event_worker *w) {
+	while (!retired) {
+		int sock = accept4(w->listen_sock, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("event server: accept4");
+			return;
+		}
+		conn_open(w, sock);
+		if (options.max_sessions && __sync_add_and_fetch(
+					&sessions_accepted, 1) == options.max_sessions)
+			retire();
+	}
+}
+
+void *event_worker_main(void *arg) {
+	struct event_worker *w = arg;
+	struct epoll_event events[EVENT_BATCH];
+
+	frame_init(&screen);
+	for (;;) {
+		/* do not sleep while a tick is being served */
+		int n = epoll_wait(w->epfd, events, EVENT_BATCH,
+				w->tick_next ? 0 : -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("event server: epoll_wait");
+			exit(1);
+		}
+
+		/* conns closed in this batch are freed once the batch is done, as
+		   later events may still refer to them */
+		struct event_conn *closed = 0;
+		int i;
+		for (i = 0; i < n; i++) {
+			struct conn_handle *h = events[i].data.ptr;
+			if (!h) {
+				accept_connections(w);
+				continue;
+			}
+			if (h == &tick_handle) {
+				worker_start_tick(w);
+				continue;
+			}
+			if (h == &channel_handle) {
+				worker_read_replies(w, &closed);
+				continue;
+			}
+			struct event_conn *c = h->conn;
+			if (c->closing)
+				continue;
+
+			if (h->is_poke)
+				conn_handle_poke(c);
+			else if (c->state == CONN_REQUEST) {
+				/* input is read once the reply has come */
+				if (events[i].events & (EPOLLHUP | EPOLLERR))
+					c->closing = 1;
+			} else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				conn_handle_input(c);
+			conn_flush(w, c);
+
+			if (c->closing) {
+				c->next_closed = closed;
+				closed = c;
+			}
+		}
+		if (w->tick_next)
+			worker_spectate_tick(w, &closed);
+
+		while (closed) {
+			struct event_conn *c = closed;
+			closed = c->next_closed;
+			conn_close(w, c);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Serves telnet connections on the listening socket from a fixed set of
+ * worker threads instead of forking per connection.  Does not return unless
+ * the workers cannot be started, and exits once it has retired, after
+ * max_sessions connections or on SIGHUP.
+ * listen_sock		bound and listening TCP socket
+ * opt		number of workers, instance and retirement settings
+ */
+int run_event_server(int listen_sock, const struct event_server_options *opt) {
+	options = *opt;
+	session_base = EVENT_SESSION_BASE +
+		options.instance * EVENT_INSTANCE_SESSIONS;
+
+	int worker_count = options.workers;
+	if (worker_count <= 0)
+		worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (worker_count <= 0)
+		worker_count = 1;
+
+	/* only the calling thread takes SIGHUP, see below */
+	sigset_t hup;
+	sigemptyset(&hup);
+	sigaddset(&hup, SIGHUP);
+	if (pthread_sigmask(SIG_BLOCK, &hup, 0) != 0)
+		return -1;
+
+	int flags = fcntl(listen_sock, F_GETFL);
+	if (flags == -1 || fcntl(listen_sock, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -1;
+
+	workers = calloc(worker_count, sizeof(struct event_worker));
+	if (!workers)
+		return -1;
+
+	int i;
+	for (i = 0; i < worker_count; i++) {
+		struct event_worker *w = &workers[i];
+		w->listen_sock = listen_sock;
+		w->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (w->epfd == -1)
+			return -1;
+
+		/* every worker accepts, EPOLLEXCLUSIVE wakes only one of them */
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = 0;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, listen_sock, &ev) == -1)
+			return -1;
+
+		w->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				TFD_NONBLOCK | TFD_CLOEXEC);
+		ev.events = EPOLLIN;
+		ev.data.ptr = &tick_handle;
+		if (w->timer_fd == -1 ||
+				epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->timer_fd, &ev) == -1)
+			return -1;
+	}
+	workers_count = worker_count;
+
+	for (i = 0; i < worker_count; i++)
+		if (pthread_create(&workers[i].thread, 0, event_worker_main,
+					&workers[i]) != 0)
+			return -1;
+	DBG(2, "Event server %d running with %d workers\n",
+			options.instance, worker_count);
+
+	for (;;) {
+		int sig;
+		if (sigwait(&hup, &sig) == 0 &&
+				(!options.hangup || options.hangup() == 0))
+			retire();
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef EVENT_SERVER_H
+#define EVENT_SERVER_H
+
+struct event_server_options {
+	/* worker threads, 0 for one per core */
+	int workers;
+
+	/* picks the range of session ids, unique among running event servers */
+	int instance;
+
+	/* connections to accept before retiring, 0 for no limit */
+	unsigned int max_sessions;
+
+	/* called once the server has stopped accepting, may be NULL */
+	void (*retire)(void);
+
+	/* called on SIGHUP, which retires the server unless this returns -1,
+	   may be NULL */
+	int (*hangup)(void);
+};
+
+int run_event_server(int listen_sock, const struct event_server_options *opt);
+
+#endif
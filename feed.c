@@ -0,0 +1,103 @@
+#include "conf.h"
+#include "feed.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* feeds are rendered while a spectator has looked this many seconds ago */
+#define FEED_WATCH_SECONDS 2
+
+/**
+ * Returns the current second, from 1 so that 0 can stand for never
+ */
+static uint32_t feed_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec + 1;
+}
+
+/**
+ * Keeps the feed rendered.  Spectators call this on every tick, so rendering
+ * stops soon after the last one has gone.  Thousands of spectators only read
+ * the shared line, except for one write a second.
+ */
+void feed_watch(struct game_feed *f) {
+	uint32_t now = feed_clock();
+	if (__atomic_load_n(&f->watched, __ATOMIC_RELAXED) != now)
+		__atomic_store_n(&f->watched, now, __ATOMIC_RELAXED);
+}
+
+/**
+ * Renders the moves logged since the last call, the score and whose turn it
+ * is, and appends them to the feed.  Call after logging a move.  Does nothing unless
+ * the game is being watched.
+ */
+void feed_publish(
+		struct game_feed *f, const struct move_log *log, const char *map,
+		const struct score *score, char to_move)
+{
+	static __thread struct frame out;
+	uint32_t watched = __atomic_load_n(&f->watched, __ATOMIC_RELAXED);
+	if (!watched || feed_clock() - watched > FEED_WATCH_SECONDS)
+		return;
+
+	frame_init(&out);
+	f->view.y = FEED_VIEW_Y;
+	f->view.x = FEED_VIEW_X;
+	print_moves(&out, log, &f->log_cursor, map, &f->view, MAP_TOP, MAP_LEFT);
+	print_score(&out, score);
+	frame_printf(&out, "\e[24;60H\e[0K%c to move", (to_move == 1) ? 'X' : 'O');
+
+	/* reserve the bytes first, so readers can tell what may be changing */
+	uint32_t head = f->head;
+	__atomic_store_n(&f->reserved, head + out.len, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	size_t first = head % FEED_SIZE;
+	size_t tail = (out.len < FEED_SIZE - first) ? out.len : FEED_SIZE - first;
+	memcpy(f->data + first, out.data, tail);
+	memcpy(f->data, out.data + tail, out.len - tail);
+	__atomic_store_n(&f->head, head + out.len, __ATOMIC_RELEASE);
+	TRACE(TRACE_FEED_PUBLISH, out.len, to_move, 0);
+}
+
+/**
+ * Returns the number of bytes published so far
+ */
+uint32_t feed_head(const struct game_feed *f) {
+	return __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Points iov at the output published since the cursor, without copying it.
+ * Returns its length, 0 if there is none, or -1 if the spectator has fallen
+ * behind and has to redraw from the map.  Check feed_overrun once the output
+ * has been used.
+ */
+ssize_t feed_peek(
+		const struct game_feed *f, uint32_t cursor, struct iovec iov[2])
+{
+	uint32_t head = feed_head(f);
+	if (head == cursor)
+		return 0;
+	if (head - cursor > FEED_SIZE)
+		return -1;
+
+	size_t first = cursor % FEED_SIZE, len = head - cursor;
+	size_t tail = (len < FEED_SIZE - first) ? len : FEED_SIZE - first;
+	iov[0].iov_base = (char*)f->data + first;
+	iov[0].iov_len = tail;
+	iov[1].iov_base = (char*)f->data;
+	iov[1].iov_len = len - tail;
+	return len;
+}
+
+/**
+ * Tells whether output from the cursor on may have been overwritten while it
+ * was being used
+ */
+int feed_overrun(const struct game_feed *f, uint32_t cursor) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&f->reserved, __ATOMIC_RELAXED) - cursor > FEED_SIZE;
+}
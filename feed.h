@@ -0,0 +1,57 @@
+#ifndef FEED_H
+#define FEED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "conf.h"
+#include "board.h"
+#include "move_log.h"
+#include "render.h"
+
+/* spectators watch the centre of the board */
+#define FEED_VIEW_Y ((MAP_HEIGHT - VIEW_HEIGHT) / 2)
+#define FEED_VIEW_X ((MAP_WIDTH - VIEW_WIDTH) / 2)
+
+/**
+ * Terminal output for the spectators of a game, in the shared game state.
+ * The player who has just moved renders the update once and appends it here,
+ * and every spectator sends the same bytes to its terminal.  Players take
+ * turns, so there is only ever one writer.  Nothing is rendered while nobody
+ * watches.
+ */
+struct game_feed {
+	/* CLOCK_MONOTONIC_COARSE second a spectator last looked at the feed */
+	uint32_t watched;
+
+	/* moves rendered so far */
+	uint32_t log_cursor;
+
+	/* bytes ever reserved by the writer and ever published */
+	uint32_t reserved, head;
+
+	/* part of the map spectators see, with its fields as last rendered */
+	struct viewport view;
+
+	char data[FEED_SIZE];
+};
+
+/* part of the feed cleared for a new game, the data need not be */
+#define FEED_HEADER_SIZE (offsetof(struct game_feed, data))
+
+void feed_watch(struct game_feed *f);
+
+void feed_publish(
+		struct game_feed *f, const struct move_log *log, const char *map,
+		const struct score *score, char to_move);
+
+uint32_t feed_head(const struct game_feed *f);
+
+ssize_t feed_peek(
+		const struct game_feed *f, uint32_t cursor, struct iovec iov[2]);
+
+int feed_overrun(const struct game_feed *f, uint32_t cursor);
+
+#endif
@@ -1,151 +1,900 @@
+#define _GNU_SOURCE
+
 #include "conf.h"
+#include "arena.h"
 #include "game_manager.h"
 #include "ipc_message.h"
+#include "record.h"
+#include "trace.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
 #include <sys/un.h>
-#include <sys/shm.h>
 #include <signal.h>
 #include <time.h>
+#include <unistd.h>
+
+/**
+ * Hash table mapping numeric ids to games, or other entries, with linear
+ * probing.  Empty slots have no entry.  The table doubles whenever it gets
+ * half full.
+ */
+struct game_index {
+	uint32_t *ids;
+	void **values;
+	unsigned int bits, count;
+};
 
-struct game *idle_games[MAX_GAMES];
-int idle_game_count;
+/* all games by key number, see encode_key() */
+struct game_index games_by_key;
+
+/* games by the session ids of their players */
+struct game_index games_by_pid;
+
+/* number of keys, 26^6 */
+#define KEY_SPACE 308915776u
+
+uint32_t key_counter;
+uint32_t key_secret[4];
+
+/*
+ * Eventfds of the players of the game in each arena slot, -1 if a player has
+ * none.  Forked sessions hand theirs over when they host or join.
+ */
+int (*poke_fds)[2];
+
+/*
+ * Process of the computer player and its eventfd, -1 without one, and the
+ * slots of the games it has been seated in but not yet told of
+ */
+pid_t bot_pid = -1;
+int bot_fd = -1;
+int *bot_pending;
+unsigned int bot_pending_count, bot_pending_size;
+
+/* counters reported by MSG_STATS */
+struct manager_stats stats;
 
 struct join_message {
 	struct message m;
 	char game_key[7];
 };
 
+static unsigned int index_slot(const struct game_index *ix, uint32_t id) {
+	return (id * 2654435769u) >> (32 - ix->bits);
+}
+
+void *index_get(const struct game_index *ix, uint32_t id) {
+	if (ix->count == 0)
+		return 0;
+	unsigned int mask = (1u << ix->bits) - 1, i;
+	for (i = index_slot(ix, id); ix->values[i]; i = (i + 1) & mask)
+		if (ix->ids[i] == id)
+			return ix->values[i];
+	return 0;
+}
+
+static int index_resize(struct game_index *ix, unsigned int bits) {
+	struct game_index n = { .bits = bits, .count = ix->count };
+	n.ids = malloc(sizeof(uint32_t) << bits);
+	n.values = calloc(1u << bits, sizeof(void*));
+	if (!n.ids || !n.values) {
+		free(n.ids);
+		free(n.values);
+		return -1;
+	}
+
+	unsigned int mask = (1u << bits) - 1, i, j;
+	for (i = 0; ix->count && i < (1u << ix->bits); i++) {
+		if (!ix->values[i])
+			continue;
+		for (j = index_slot(&n, ix->ids[i]); n.values[j]; j = (j + 1) & mask)
+			;
+		n.ids[j] = ix->ids[i];
+		n.values[j] = ix->values[i];
+	}
+	free(ix->ids);
+	free(ix->values);
+	*ix = n;
+	return 0;
+}
+
 /**
- * Returns ID of the game connected to the given PID,
- * -1 if not found.
+ * Maps the id to the entry, replacing any previous mapping.
+ * Returns 0 on success, -1 on failure.
  */
-int get_game_by_pid(pid_t pid) {
-	int i = -1;
-	for (i = 0; i < idle_game_count; i++)
-		if (idle_games[i]->sessions[0] == pid || 
-				idle_games[i]->sessions[1] == pid)
-			return i;
-	return -1;
+int index_put(struct game_index *ix, uint32_t id, void *v) {
+	if ((ix->count + 1) * 2 > (1u << ix->bits) &&
+			index_resize(ix, ix->bits ? ix->bits + 1 : 10) == -1)
+		return -1;
+
+	unsigned int mask = (1u << ix->bits) - 1, i;
+	for (i = index_slot(ix, id); ix->values[i]; i = (i + 1) & mask)
+		if (ix->ids[i] == id)
+			break;
+	if (!ix->values[i])
+		ix->count++;
+	ix->ids[i] = id;
+	ix->values[i] = v;
+	return 0;
 }
 
-int get_game_by_key(char *key) {
-	int i = -1;
-	for (i = 0; i < idle_game_count; i++)
-		if (!strcmp(idle_games[i]->key, key))
-			return i;
-	return -1;
+/**
+ * Removes the id, moving later entries of its probe sequence back so that no
+ * tombstones are needed.
+ */
+void index_remove(struct game_index *ix, uint32_t id) {
+	if (ix->count == 0)
+		return;
+	unsigned int mask = (1u << ix->bits) - 1, i, j;
+	for (i = index_slot(ix, id); ix->values[i]; i = (i + 1) & mask)
+		if (ix->ids[i] == id)
+			break;
+	if (!ix->values[i])
+		return;
+
+	for (j = (i + 1) & mask; ix->values[j]; j = (j + 1) & mask) {
+		unsigned int home = index_slot(ix, ix->ids[j]);
+		/* entry j may move to i unless its home lies cyclically in (i, j] */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			ix->ids[i] = ix->ids[j];
+			ix->values[i] = ix->values[j];
+			i = j;
+		}
+	}
+	ix->values[i] = 0;
+	ix->count--;
 }
 
-void random_string(char *c, int length) {
-	while(length--)
-		*(c++) = 'a' + (rand() % ('z' - 'a'));
-	*c = 0;
+/**
+ * Bijection on 30-bit numbers, a Feistel network with secret round keys
+ */
+static uint32_t key_permute(uint32_t v) {
+	uint32_t l = v >> 15, r = v & 0x7fff;
+	int i;
+	for (i = 0; i < 4; i++) {
+		uint32_t f = ((r ^ key_secret[i]) * 0x9e3779b1u) >> 17;
+		uint32_t t = l ^ f;
+		l = r;
+		r = t;
+	}
+	return (l << 15) | r;
 }
 
-void handle_idle_message(struct message *im, int socket) {
-	DBG(3, "Received idle notification from pid %d\n", im->pid);
-	if (idle_game_count >= MAX_GAMES) {
+/**
+ * Returns a key number for a new game.  The numbers are a permutation of a
+ * counter, mapped into the key space by cycle walking, so keys only repeat
+ * after all 26^6 of them have been used.
+ */
+static uint32_t next_game_key() {
+	uint32_t v = key_counter;
+	key_counter = (key_counter + 1) % KEY_SPACE;
+	do
+		v = key_permute(v);
+	while (v >= KEY_SPACE);
+	return v;
+}
+
+static void encode_key(uint32_t v, char *key) {
+	int i;
+	for (i = 5; i >= 0; i--) {
+		key[i] = 'a' + v % 26;
+		v /= 26;
+	}
+	key[6] = 0;
+}
+
+/**
+ * Returns the key number of a game key, -1 if it is not a valid key.
+ */
+static int64_t decode_key(const char *key) {
+	uint32_t v = 0;
+	int i;
+	for (i = 0; i < 6; i++) {
+		if (key[i] < 'a' || key[i] > 'z')
+			return -1;
+		v = v * 26 + key[i] - 'a';
+	}
+	return key[6] ? -1 : v;
+}
+
+struct game *get_game_by_pid(pid_t pid) {
+	return index_get(&games_by_pid, pid);
+}
+
+struct game *get_game_by_key(const char *key) {
+	int64_t v = decode_key(key);
+	return (v == -1) ? 0 : index_get(&games_by_key, v);
+}
+
+/**
+ * Sets up a game in a free arena slot, hosted by the session.  The poke_fd
+ * is kept as the host's eventfd.
+ * Returns the game, 0 if there is no room for it.
+ */
+static struct game *create_game(pid_t pid, int poke_fd) {
+	if (MAX_GAMES && games_by_key.count >= MAX_GAMES) {
 		DBG(1, "Too many sessions, rejecting request\n");
-		return;
+		stats.games_rejected++;
+		return 0;
 	}
 
 	/* Allocate a shared game structure */
-	int shmid = shmget(IPC_PRIVATE,
-			sizeof(struct game),
-			IPC_CREAT | 0600);
-	if (shmid == -1) { perror("session manager: shmid"); }
-	else {
-		struct game *g = (struct game*)shmat(shmid, 0, 0);
-		g->game_shm = shmid;
+	int slot = arena_alloc();
+	if (slot == -1) {
+		DBG(1, "Arena full, rejecting request\n");
+		stats.games_rejected++;
+		return 0;
+	}
+
+	struct game *g = arena_game(slot);
+	g->slot = slot;
+	poke_fds[slot][0] = poke_fd;
+	poke_fds[slot][1] = -1;
 
-		g->sessions[0] = im->pid;
-		g->sessions[1] = 0;
-		g->state = GAME_ACTIVE;
+	g->sessions[0] = pid;
+	g->sessions[1] = 0;
+	g->state = GAME_ACTIVE;
 
-		char new_key[7];
-		random_string(new_key, 6);
-		while (get_game_by_key(new_key) != -1)
-			random_string(new_key, 6);
-		strcpy(g->key, new_key);
+	/* a key can only be taken after wrapping around the key space */
+	uint32_t key = next_game_key();
+	while (index_get(&games_by_key, key))
+		key = next_game_key();
+	encode_key(key, g->key);
+	arena_seal(g);
 
-		memset(g->map, 0, MAP_WIDTH*MAP_HEIGHT*sizeof(char));
+	arena_clear(slot);
+	g->log.head = 0;
+	g->log.cells_head = 0;
+	memset(&g->feed, 0, FEED_HEADER_SIZE);
 
-		DBG(3, "Created map SHM with id %d\n", shmid);
-		idle_games[idle_game_count++] = g;
+	TRACE(TRACE_GAME_CREATE, slot, pid, 0);
+	if (index_put(&games_by_key, key, g) == -1 ||
+			index_put(&games_by_pid, pid, g) == -1) {
+		DBG(1, "Out of memory, rejecting request\n");
+		index_remove(&games_by_key, key);
+		poke_fds[slot][0] = -1;
+		g->state = GAME_IDLE;
+		arena_seal(g);
+		arena_free(slot);
+		stats.games_rejected++;
+		return 0;
 	}
+	stats.games_created++;
+	return g;
 }
 
-void handle_join_query(struct message *m, int socket) {
-	DBG(3, "Received join query from pid %d\n", m->pid);
+void handle_idle_message(struct message *im, struct ipc_conn *conn) {
+	int fd = ipc_take_fd(conn);
+	if (!create_game(im->pid, fd) && fd != -1)
+		close(fd);
+}
+
+void handle_join_query(struct message *m, struct ipc_conn *conn) {
 	struct join_message *jm = (struct join_message*)m;
 
-	int i = get_game_by_key(jm->game_key);
-	if (i != -1 && idle_games[i]->sessions[1] == 0)
-		idle_games[i]->sessions[1] = m->pid;
+	jm->game_key[6] = 0;
+	struct game *g = get_game_by_key(jm->game_key);
+	/* the host's seat is only free in a game recovered after a restart */
+	int seat = (g && g->sessions[0] == 0) ? 0 : 1;
+	if (g && g->state == GAME_ACTIVE && g->sessions[seat] == 0 &&
+			index_put(&games_by_pid, m->pid, g) == 0) {
+		g->sessions[seat] = m->pid;
+		arena_seal(g);
+		poke_fds[g->slot][seat] = ipc_take_fd(conn);
+		stats.joins++;
+		TRACE(TRACE_GAME_JOIN, g->slot, m->pid, 1);
+	} else {
+		stats.joins_failed++;
+		TRACE(TRACE_GAME_JOIN, g ? g->slot : -1, m->pid, 0);
+	}
+}
+
+/*
+ * Session waiting in the quick-match queue, with the eventfd it is poked on
+ * once it has got an opponent
+ */
+struct match_waiter {
+	pid_t pid;
+	int poke_fd;
+	struct match_waiter *prev, *next;
+};
+
+/* quick-match queue, oldest first */
+struct match_waiter *match_head, *match_tail;
+
+/* waiters by session id */
+struct game_index waiting_by_pid;
+
+/**
+ * Appends the session to the quick-match queue.
+ * Returns 0 on success, -1 on failure.
+ */
+static int match_enqueue(pid_t pid, int poke_fd) {
+	struct match_waiter *w = malloc(sizeof(*w));
+	if (!w || index_put(&waiting_by_pid, pid, w) == -1) {
+		free(w);
+		return -1;
+	}
+	w->pid = pid;
+	w->poke_fd = poke_fd;
+	w->next = 0;
+	w->prev = match_tail;
+	if (match_tail)
+		match_tail->next = w;
+	else
+		match_head = w;
+	match_tail = w;
+	return 0;
+}
+
+/**
+ * Takes the waiter out of the queue.  Its eventfd is left to the caller.
+ */
+static void match_remove(struct match_waiter *w) {
+	if (w->prev)
+		w->prev->next = w->next;
+	else
+		match_head = w->next;
+	if (w->next)
+		w->next->prev = w->prev;
+	else
+		match_tail = w->prev;
+	index_remove(&waiting_by_pid, w->pid);
+	free(w);
+}
+
+/**
+ * Pairs the session with the one that has waited longest for an opponent,
+ * in a new game hosted by the latter, which is poked.  With nobody waiting,
+ * the session joins the queue instead.  Neither takes an arena slot until
+ * both players are there.
+ * Replies with the slot of the new game, MATCH_WAITING or MATCH_FAILED.
+ */
+void handle_match_query(struct message *m, struct ipc_conn *conn) {
+	int fd = ipc_take_fd(conn), reply = MATCH_FAILED;
+	struct match_waiter *w = match_head;
+	if (index_get(&waiting_by_pid, m->pid) || get_game_by_pid(m->pid)) {
+		/* already waiting or playing */
+	} else if (!w) {
+		/* a waiter without an eventfd would never hear of its opponent */
+		if (fd != -1 && match_enqueue(m->pid, fd) == 0) {
+			fd = -1;
+			reply = MATCH_WAITING;
+		}
+	} else {
+		struct game *g = create_game(w->pid, w->poke_fd);
+		if (g) {
+			/* the waiter keeps the game even if the session cannot join
+			   it, as if it had hosted it */
+			pid_t host = w->pid;
+			match_remove(w);
+			if (index_put(&games_by_pid, m->pid, g) == 0) {
+				g->sessions[1] = m->pid;
+				arena_seal(g);
+				poke_fds[g->slot][1] = fd;
+				fd = -1;
+				reply = g->slot;
+				stats.matches++;
+			}
+			TRACE(TRACE_MATCH, g->slot, m->pid, host);
+
+			uint64_t one = 1;
+			TRACE(TRACE_POKE, host, 0, 0);
+			if (poke_fds[g->slot][0] != -1 &&
+					write(poke_fds[g->slot][0], &one, sizeof(one)) == -1)
+				perror("session manager: poke");
+		}
+	}
+	if (fd != -1)
+		close(fd);
+	ipc_reply(conn, &reply, sizeof(reply));
+}
+
+/**
+ * Takes the session out of the quick-match queue.  Replies with the slot of
+ * its game if it has been paired meanwhile, -1 otherwise.
+ */
+void handle_match_cancel_query(struct message *m, struct ipc_conn *conn) {
+	struct match_waiter *w = index_get(&waiting_by_pid, m->pid);
+	struct game *g = get_game_by_pid(m->pid);
+	int slot = g ? g->slot : -1;
+	if (w) {
+		if (w->poke_fd != -1)
+			close(w->poke_fd);
+		match_remove(w);
+	}
+	ipc_reply(conn, &slot, sizeof(slot));
+}
+
+/**
+ * Adds the game in the slot to those the computer player is told of.
+ * Returns 0 on success, -1 on failure.
+ */
+static int bot_queue(int slot) {
+	if (bot_pending_count == bot_pending_size) {
+		unsigned int size = bot_pending_size ? bot_pending_size * 2 : 64;
+		int *p = realloc(bot_pending, size * sizeof(int));
+		if (!p)
+			return -1;
+		bot_pending = p;
+		bot_pending_size = size;
+	}
+	bot_pending[bot_pending_count++] = slot;
+	return 0;
+}
+
+/**
+ * Seats the computer player opposite the session in the game it hosts, and
+ * pokes it.  Replies with the slot of the game, -1 if there is no computer
+ * player or the game has another opponent already.
+ */
+void handle_bot_query(struct message *m, struct ipc_conn *conn) {
+	struct game *g = get_game_by_pid(m->pid);
+	int slot = -1, fd = -1;
+	if (g && bot_fd != -1 && g->state == GAME_ACTIVE &&
+			g->sessions[0] == m->pid && g->sessions[1] == 0 &&
+			(fd = fcntl(bot_fd, F_DUPFD_CLOEXEC, 0)) != -1 &&
+			index_put(&games_by_pid, BOT_SESSION(g->slot), g) == 0) {
+		if (bot_queue(g->slot) == 0) {
+			g->sessions[1] = BOT_SESSION(g->slot);
+			arena_seal(g);
+			poke_fds[g->slot][1] = fd;
+			fd = -1;
+			slot = g->slot;
+
+			uint64_t one = 1;
+			TRACE(TRACE_POKE, g->sessions[1], 0, 0);
+			if (write(bot_fd, &one, sizeof(one)) == -1)
+				perror("session manager: poke");
+		} else
+			index_remove(&games_by_pid, BOT_SESSION(g->slot));
+	}
+	if (fd != -1)
+		close(fd);
+	TRACE(TRACE_GAME_JOIN, g ? g->slot : -1, g ? BOT_SESSION(g->slot) : 0,
+			slot != -1);
+	ipc_reply(conn, &slot, sizeof(slot));
 }
 
-void handle_session_quit_message(struct message *qm, int socket) {
-	DBG(3, "Session %d quitting\n", qm->pid);
-	int gid = get_game_by_pid(qm->pid);
-	struct game *g = idle_games[gid];
-	if (g->sessions[0] == qm->pid)
-		g->sessions[0] = 0;
-	else if (g->sessions[1] == qm->pid)
-		g->sessions[1] = 0;
-	
+/**
+ * Replies with the slot of a game the computer player has been seated in
+ * since it last asked, -1 if there is none
+ */
+void handle_bot_game_query(struct message *m, struct ipc_conn *conn) {
+	int slot = -1;
+	while (m->pid == bot_pid && bot_fd != -1 && bot_pending_count > 0) {
+		int next = bot_pending[--bot_pending_count];
+		struct game *g = arena_game(next);
+		if (!g || g->state == GAME_IDLE || g->sessions[1] != BOT_SESSION(next))
+			continue;
+		/* a game taken over may have come without the eventfd */
+		if (poke_fds[next][1] == -1)
+			poke_fds[next][1] = fcntl(bot_fd, F_DUPFD_CLOEXEC, 0);
+		slot = next;
+		break;
+	}
+	ipc_reply(conn, &slot, sizeof(slot));
+}
+
+struct bot_report_message {
+	struct message m;
+	uint64_t playouts;
+	uint64_t ns;
+};
+
+/**
+ * Counts a move of the computer player and the search behind it
+ */
+void handle_bot_report_message(struct message *m, struct ipc_conn *conn) {
+	struct bot_report_message *rm = (struct bot_report_message*)m;
+	stats.bot_moves++;
+	stats.bot_playouts += rm->playouts;
+	stats.bot_search_ns += rm->ns;
+}
+
+void handle_session_quit_message(struct message *qm, struct ipc_conn *conn) {
+	struct game *g = get_game_by_pid(qm->pid);
+	struct match_waiter *w = index_get(&waiting_by_pid, qm->pid);
+	TRACE(TRACE_SESSION_QUIT, g ? g->slot : -1, qm->pid, 0);
+	if (w) {
+		if (w->poke_fd != -1)
+			close(w->poke_fd);
+		match_remove(w);
+	}
+	if (!g)
+		return;
+	index_remove(&games_by_pid, qm->pid);
+	int player = (g->sessions[0] == qm->pid) ? 0 : 1;
+	g->sessions[player] = 0;
+	if (poke_fds[g->slot][player] != -1) {
+		close(poke_fds[g->slot][player]);
+		poke_fds[g->slot][player] = -1;
+	}
+
 	if (g->sessions[0] == 0 && g->sessions[1] == 0) {
-		int shm_id = g->game_shm;
-		DBG(3, "Destroying game #%d, SHM #%d\n", gid, g->game_shm);
-		idle_games[gid] = idle_games[--idle_game_count];
-		shmdt(g);
-		shmctl(shm_id, IPC_RMID, 0);
+		TRACE(TRACE_GAME_DESTROY, g->slot, 0, 0);
+		index_remove(&games_by_key, decode_key(g->key));
+		g->state = GAME_IDLE;
+		arena_seal(g);
+		arena_free(g->slot);
 	} else {
 		pid_t remaining_session =
 			(g->sessions[0] == 0) ? g->sessions[1] : g->sessions[0];
 		g->state = GAME_ORPHANED;
-		kill(remaining_session, SIGUSR1);
+		arena_seal(g);
+		int fd = poke_fds[g->slot][!player];
+		uint64_t one = 1;
+		TRACE(TRACE_POKE, remaining_session, 0, 0);
+		if (fd != -1 && write(fd, &one, sizeof(one)) == -1)
+			perror("session manager: poke");
 	}
 }
 
-void handle_map_shm_query(struct message *mq, int socket) {
-	DBG(3, "Received map SHM query from pid %d\n", mq->pid);
-	int i = get_game_by_pid(mq->pid);
-	if (i != -1) {
-		if (send(socket, &(idle_games[i]->game_shm), sizeof(int), 0) == -1)
-			perror("session manager: send\n");
-	} else {
-		if (send(socket, &i, sizeof(int), 0) == -1)
-			perror("session manager: send\n");
+/**
+ * Replies with the eventfd of the session's opponent, if it has one
+ */
+void handle_opponent_poke_query(struct message *m, struct ipc_conn *conn) {
+	struct game *g = get_game_by_pid(m->pid);
+	int found = -1;
+	if (g) {
+		int fd = poke_fds[g->slot][g->sessions[0] == m->pid];
+		if (fd != -1) {
+			found = 0;
+			ipc_reply_fd(conn, &found, sizeof(found), fd);
+			return;
+		}
 	}
+	ipc_reply(conn, &found, sizeof(found));
 }
 
 /**
- * Clean up at exit
+ * Pokes the session's opponent, for sessions that do not have its eventfd
+ */
+void handle_poke_message(struct message *m, struct ipc_conn *conn) {
+	struct game *g = get_game_by_pid(m->pid);
+	if (!g)
+		return;
+	int seat = g->sessions[0] == m->pid;
+	int fd = poke_fds[g->slot][seat];
+	uint64_t one = 1;
+	TRACE(TRACE_POKE, g->sessions[seat], 0, 0);
+	if (fd != -1 && write(fd, &one, sizeof(one)) == -1)
+		perror("session manager: poke");
+}
+
+void handle_game_slot_query(struct message *mq, struct ipc_conn *conn) {
+	struct game *g = get_game_by_pid(mq->pid);
+	int slot = g ? g->slot : -1;
+	TRACE(TRACE_GAME_SLOT, slot, mq->pid, 0);
+	ipc_reply(conn, &slot, sizeof(slot));
+}
+
+/**
+ * Replies with the arena slot of the game with the given key, -1 if there is
+ * none.  Spectators are not tracked, they tell a game that has ended by its
+ * state and key.
+ */
+void handle_spectate_query(struct message *m, struct ipc_conn *conn) {
+	struct join_message *jm = (struct join_message*)m;
+
+	jm->game_key[6] = 0;
+	struct game *g = get_game_by_key(jm->game_key);
+	int slot = (g && g->state != GAME_ORPHANED) ? g->slot : -1;
+	TRACE(TRACE_SPECTATE, slot, m->pid, 0);
+	ipc_reply(conn, &slot, sizeof(slot));
+}
+
+extern struct message_handler msg_handlers[];
+
+/**
+ * Rebuilds the indices from the games in the arena.  After a crash, games in
+ * progress keep their key, board and moves, their players are gone and may
+ * join again.  Taking over from a running manager, games keep their players
+ * as well.  Slots holding anything else, including records torn by a crash,
+ * are freed.
+ */
+static void recover_games(int keep_sessions) {
+	unsigned int n = arena_high_water(), recovered = 0, slot;
+	for (slot = 0; slot < n; slot++) {
+		struct game *g = arena_game(slot);
+		int64_t key = -1;
+		if (arena_valid(g) && (g->state == GAME_ACTIVE ||
+					(keep_sessions && g->state == GAME_ORPHANED)))
+			key = decode_key(g->key);
+		if (key != -1 && !index_get(&games_by_key, key) &&
+				index_put(&games_by_key, key, g) == 0) {
+			int i;
+			for (i = 0; i < 2; i++)
+				if (!keep_sessions)
+					g->sessions[i] = 0;
+				else if (g->sessions[i])
+					index_put(&games_by_pid, g->sessions[i], g);
+			arena_seal(g);
+			/* the new computer player takes over the last one's games,
+			   and the eventfd their players poke */
+			if (IS_BOT_SESSION(g->sessions[1])) {
+				if (bot_fd == -1 && poke_fds[slot][1] != -1)
+					bot_fd = fcntl(poke_fds[slot][1], F_DUPFD_CLOEXEC, 0);
+				bot_queue(slot);
+			}
+			if (!keep_sessions)
+				memset(&g->feed, 0, FEED_HEADER_SIZE);
+			recovered++;
+		} else {
+			g->state = GAME_IDLE;
+			g->slot = slot;
+			arena_seal(g);
+			arena_free(slot);
+		}
+	}
+	if (n) {
+		DBG(2, "Recovered %u games from %u slots\n", recovered, n);
+	}
+}
+
+/*
+ * What a manager hands over to its successor besides the arena.  The
+ * eventfds of the players, then those of the sessions in the quick-match
+ * queue, follow in batches.
+ */
+struct manager_handoff {
+	uint32_t size;
+	uint32_t arena_used;
+	uint32_t key_counter;
+	uint32_t key_secret[4];
+	struct manager_stats stats;
+	uint32_t poke_count;
+};
+
+/* seat of a session in the quick-match queue */
+#define SEAT_MATCHING UINT32_MAX
+
+#define POKE_BATCH 64
+
+struct poke_batch {
+	uint32_t count;
+
+	/* slot * 2 + seat of each descriptor, or SEAT_MATCHING */
+	uint32_t seats[POKE_BATCH];
+
+	/* session ids of those in the queue */
+	uint32_t pids[POKE_BATCH];
+};
+
+static int send_poke_batch(int sock, struct poke_batch *b, const int *fds) {
+	char cbuf[CMSG_SPACE(sizeof(int) * POKE_BATCH)];
+	struct iovec iov = { b, sizeof(*b) };
+	struct msghdr mh = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = CMSG_SPACE(sizeof(int) * b->count) };
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int) * b->count);
+	memcpy(CMSG_DATA(cm), fds, sizeof(int) * b->count);
+	return sendmsg(sock, &mh, MSG_NOSIGNAL) == sizeof(*b) ? 0 : -1;
+}
+
+/**
+ * Sends the state of the manager to its successor, once ipc_serve has
+ * drained the sessions' requests
+ */
+static int manager_handoff_send(int sock) {
+	struct manager_handoff h;
+	unsigned int slot, used = arena_high_water(), i;
+	memset(&h, 0, sizeof(h));
+	h.size = sizeof(h);
+	h.arena_used = used;
+	h.key_counter = key_counter;
+	memcpy(h.key_secret, key_secret, sizeof(key_secret));
+	h.stats = stats;
+	for (i = 0; i < MSG_TYPE_COUNT; i++)
+		h.stats.messages[i] = msg_handlers[i].stats;
+	for (slot = 0; slot < used; slot++)
+		h.poke_count += (poke_fds[slot][0] != -1) + (poke_fds[slot][1] != -1);
+	h.poke_count += waiting_by_pid.count;
+	if (send(sock, &h, sizeof(h), MSG_NOSIGNAL) != sizeof(h))
+		return -1;
+
+	struct poke_batch b = { 0 };
+	int fds[POKE_BATCH];
+	for (slot = 0; slot < used; slot++)
+		for (i = 0; i < 2; i++) {
+			if (poke_fds[slot][i] == -1)
+				continue;
+			b.seats[b.count] = slot * 2 + i;
+			fds[b.count++] = poke_fds[slot][i];
+			if (b.count == POKE_BATCH) {
+				if (send_poke_batch(sock, &b, fds) == -1)
+					return -1;
+				b.count = 0;
+			}
+		}
+	struct match_waiter *w;
+	for (w = match_head; w; w = w->next) {
+		b.seats[b.count] = SEAT_MATCHING;
+		b.pids[b.count] = w->pid;
+		fds[b.count++] = w->poke_fd;
+		if (b.count == POKE_BATCH) {
+			if (send_poke_batch(sock, &b, fds) == -1)
+				return -1;
+			b.count = 0;
+		}
+	}
+	if (b.count > 0 && send_poke_batch(sock, &b, fds) == -1)
+		return -1;
+	return 0;
+}
+
+/**
+ * Receives exactly size bytes, keeping the descriptors that come with them
+ * in fds, which has room for POKE_BATCH.  Returns the number of
+ * descriptors, -1 on failure.
+ */
+static int recv_handoff(int sock, void *buf, size_t size, int *fds) {
+	size_t got = 0;
+	int count = 0;
+	while (got < size) {
+		char cbuf[CMSG_SPACE(sizeof(int) * POKE_BATCH)];
+		struct iovec iov = { (char*)buf + got, size - got };
+		struct msghdr mh = {
+			.msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+		ssize_t r = recvmsg(sock, &mh, 0);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		got += r;
+
+		struct cmsghdr *cm;
+		for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+			if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+				continue;
+			int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int), i, fd;
+			for (i = 0; i < n; i++) {
+				memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+				if (fds && count < POKE_BATCH)
+					fds[count++] = fd;
+				else
+					close(fd);
+			}
+		}
+	}
+	return count;
+}
+
+/**
+ * Takes over from the manager running before an upgrade, which hands over
+ * its state and exits.  The games themselves are in the shared arena.
+ * Returns 0 on success, -1 on failure.
+ */
+static int manager_take_over() {
+	struct message m = { MSG_HANDOFF, getpid() };
+	struct manager_handoff h;
+	int sock = ipc_connect_send(&m, sizeof(m));
+	if (sock == -1 || recv_handoff(sock, &h, sizeof(h), 0) == -1 ||
+			h.size != sizeof(h)) {
+		if (sock != -1)
+			close(sock);
+		return -1;
+	}
+
+	arena_set_high_water(h.arena_used);
+	key_counter = h.key_counter;
+	memcpy(key_secret, h.key_secret, sizeof(key_secret));
+	stats = h.stats;
+	unsigned int i;
+	for (i = 0; i < MSG_TYPE_COUNT; i++)
+		msg_handlers[i].stats = h.stats.messages[i];
+
+	uint32_t received = 0;
+	while (received < h.poke_count) {
+		struct poke_batch b;
+		int fds[POKE_BATCH];
+		int n = recv_handoff(sock, &b, sizeof(b), fds);
+		if (n == -1 || n != b.count) {
+			close(sock);
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			unsigned int slot = b.seats[i] / 2;
+			if (b.seats[i] == SEAT_MATCHING) {
+				if (match_enqueue(b.pids[i], fds[i]) == -1)
+					close(fds[i]);
+			} else if (slot < ARENA_SLOTS)
+				poke_fds[slot][b.seats[i] % 2] = fds[i];
+			else
+				close(fds[i]);
+		}
+		received += n;
+	}
+	close(sock);
+	DBG(2, "Took over %u slots and %u eventfds\n", h.arena_used, received);
+	return 0;
+}
+
+/**
+ * Hands the manager's state over to the manager of an upgraded server, see
+ * manager_take_over().  Requests sent by the sessions so far are handled
+ * first, later ones go to the successor.
+ */
+void handle_handoff_query(struct message *m, struct ipc_conn *conn) {
+	DBG(2, "Handing over to manager %d\n", m->pid);
+	ipc_stop(conn);
+}
+
+/**
+ * Replies with struct manager_stats
+ */
+void handle_stats_query(struct message *m, struct ipc_conn *conn) {
+	unsigned int i;
+	stats.games_waiting = stats.games_active = stats.games_orphaned = 0;
+	stats.bot_games = 0;
+	for (i = 0; games_by_key.count && i < (1u << games_by_key.bits); i++) {
+		struct game *g = games_by_key.values[i];
+		if (!g)
+			continue;
+		if (IS_BOT_SESSION(g->sessions[1]))
+			stats.bot_games++;
+		if (g->state == GAME_ORPHANED)
+			stats.games_orphaned++;
+		else if (g->sessions[1] == 0)
+			stats.games_waiting++;
+		else
+			stats.games_active++;
+	}
+	stats.sessions = games_by_pid.count;
+	stats.sessions_matching = waiting_by_pid.count;
+	stats.arena_in_use = arena_in_use();
+	stats.arena_slots = ARENA_SLOTS;
+	for (i = 0; i < MSG_TYPE_COUNT; i++)
+		stats.messages[i] = msg_handlers[i].stats;
+	ipc_reply(conn, &stats, sizeof(stats));
+}
+
+/**
+ * Stops serving sessions on SIGTERM and SIGINT, see manager_exit()
  */
 void at_manager_exit(int sig) {
-	int i;
-	for (i = 0; i < idle_game_count; i++) {
-		struct game *g = idle_games[i];
-		DBG(2, "Active session #%d (%d, %d, shm %d)\n",
-				i, g->sessions[0], g->sessions[1], g->game_shm);
-		if (g->sessions[0] != 0)
+	ipc_interrupt();
+}
+
+/**
+ * Clean up at exit
+ */
+static void manager_exit() {
+	unsigned int i;
+	for (i = 0; games_by_key.count && i < (1u << games_by_key.bits); i++) {
+		struct game *g = games_by_key.values[i];
+		if (!g)
+			continue;
+		DBG(2, "Active session #%s (%d, %d, slot %d)\n",
+				g->key, g->sessions[0], g->sessions[1], g->slot);
+		if (IS_PROCESS_SESSION(g->sessions[0]))
 			kill(g->sessions[0], SIGTERM);
-		if (g->sessions[1] != 0)
+		if (IS_PROCESS_SESSION(g->sessions[1]))
 			kill(g->sessions[1], SIGTERM);
-		int shm_id = g->game_shm;
-		shmdt(g);
-		shmctl(shm_id, IPC_RMID, 0);
 	}
+	if (bot_pid > 0)
+		kill(bot_pid, SIGTERM);
+	record_stop();
+	arena_sync();
+	trace_dump();
 	write(0, "Session manager cleaned up\n", 27);
 	exit(0);
 }
 
 /**
- * Message handlers for use with ipc_receive_message.  Indices correspond to
+ * Message handlers for use with ipc_serve.  Indices correspond to
  * enum MESSAGE_TYPE.
  */
 struct message_handler msg_handlers[] =
@@ -153,83 +902,340 @@ struct message_handler msg_handlers[] =
 	[MSG_IDLE] = { 
 		.message_size = sizeof(struct message), 
 		.handler_func = handle_idle_message },
-	[MSG_MAP_SHM_QUERY] = {
+	[MSG_GAME_SLOT_QUERY] = {
 		.message_size = sizeof(struct message),
-		.handler_func = handle_map_shm_query },
+		.handler_func = handle_game_slot_query },
 	[MSG_SESSION_QUIT] = {
 		.message_size = sizeof(struct message),
 		.handler_func = handle_session_quit_message },
 	[MSG_JOIN] = {
 		.message_size = sizeof(struct join_message),
-		.handler_func = handle_join_query }
+		.handler_func = handle_join_query },
+	[MSG_OPPONENT_POKE_QUERY] = {
+		.message_size = sizeof(struct message),
+		.handler_func = handle_opponent_poke_query },
+	[MSG_STATS] = {
+		.message_size = sizeof(struct message),
+		.handler_func = handle_stats_query },
+	[MSG_SPECTATE] = {
+		.message_size = sizeof(struct join_message),
+		.handler_func = handle_spectate_query },
+	[MSG_HANDOFF] = {
+		.message_size = sizeof(struct message),
+		.handler_func = handle_handoff_query },
+	[MSG_MATCH] = {
+		.message_size = sizeof(struct message),
+		.handler_func = handle_match_query },
+	[MSG_MATCH_CANCEL] = {
+		.message_size = sizeof(struct message),
+		.handler_func = handle_match_cancel_query },
+	[MSG_BOT] = {
+		.message_size = sizeof(struct message),
+		.handler_func = handle_bot_query },
+	[MSG_BOT_GAME_QUERY] = {
+		.message_size = sizeof(struct message),
+		.handler_func = handle_bot_game_query },
+	[MSG_BOT_REPORT] = {
+		.message_size = sizeof(struct bot_report_message),
+		.handler_func = handle_bot_report_message },
+	[MSG_POKE] = {
+		.message_size = sizeof(struct message),
+		.handler_func = handle_poke_message }
 };
 
 /**
- * Start the game session manager process and return
+ * Starts the game session manager process serving on the listening socket,
+ * and returns its PID once it is ready.  With take_over, the manager first
+ * takes over from the one already running, for an upgrade.
+ * start_bot	starts the computer player from the manager process, waking
+ * 				it up on the given eventfd, and returns its PID.  0 to play
+ * 				without one.
+ * Returns -1 on failure.
  */
-int run_manager() {
+int run_manager(int listener_socket, int take_over,
+		pid_t (*start_bot)(int poke_fd))
+{
+	int ready[2];
+	if (pipe2(ready, O_CLOEXEC) == -1)
+		return -1;
+
 	int pid = fork();
 	if (pid == 0) {
-		memset(idle_games, 0, sizeof(idle_games));
-		idle_game_count = 0;
-		/* for key generation */
-		srand(time(0));
+		close(ready[0]);
+		signal(SIGHUP, SIG_IGN);
 
-		signal(SIGTERM, at_manager_exit);
-		signal(SIGINT, at_manager_exit);
+		/* for key generation, which is only as hard to predict as these */
+		uint32_t seed[5];
+		ssize_t r;
+		while ((r = getrandom(seed, sizeof(seed), 0)) == -1 && errno == EINTR)
+			;
+		if (r != sizeof(seed)) {
+			perror("session manager: getrandom");
+			exit(1);
+		}
+		memcpy(key_secret, seed, sizeof(key_secret));
+		key_counter = seed[4] % KEY_SPACE;
+		int i;
+
+		poke_fds = malloc(ARENA_SLOTS * sizeof(*poke_fds));
+		if (!poke_fds) {
+			perror("session manager: malloc");
+			exit(1);
+		}
+		for (i = 0; i < ARENA_SLOTS; i++)
+			poke_fds[i][0] = poke_fds[i][1] = -1;
 
-		int listener_socket = ipc_start_listener();
-		if (listener_socket == -1) {
-			perror("session manager: ipc_start_listener");
+		if (take_over && manager_take_over() == -1) {
+			fputs("session manager: could not take over\n", stderr);
 			exit(1);
 		}
-		// TODO: Initialise socket before forking? (Error handling)
+		recover_games(take_over);
+
+		/* exit signals are only taken while waiting in ipc_serve(), the
+		   threads started here block them for good */
+		sigset_t exit_signals, wait_mask;
+		sigemptyset(&exit_signals);
+		sigaddset(&exit_signals, SIGTERM);
+		sigaddset(&exit_signals, SIGINT);
+		sigprocmask(SIG_BLOCK, &exit_signals, &wait_mask);
+		if (arena_start_sync() == -1 || record_start() == -1)
+			exit(1);
+
+		signal(SIGTERM, at_manager_exit);
+		signal(SIGINT, at_manager_exit);
 
 		DBG(2, "Session manager is running\n");
-		for(;;) {
-			ipc_accept_message(
-					msg_handlers,
-					COUNT_HANDLERS(msg_handlers),
-					listener_socket);
+		char c = 1;
+		write(ready[1], &c, 1);
+		close(ready[1]);
+
+		if (start_bot) {
+			if (bot_fd == -1)
+				bot_fd = eventfd(0, EFD_CLOEXEC);
+			/* with the signals as the manager got them */
+			sigprocmask(SIG_SETMASK, &wait_mask, 0);
+			if (bot_fd != -1)
+				bot_pid = start_bot(bot_fd);
+			sigprocmask(SIG_BLOCK, &exit_signals, 0);
+			if (bot_fd == -1 || bot_pid == -1) {
+				perror("session manager: start_bot");
+				if (bot_fd != -1)
+					close(bot_fd);
+				bot_fd = -1;
+			} else if (bot_pending_count > 0) {
+				/* games taken over wait to be taken up */
+				uint64_t one = 1;
+				if (write(bot_fd, &one, sizeof(one)) == -1)
+					perror("session manager: poke");
+			}
 		}
-		exit(0);
-	} else
-		return pid;
+
+		int sock = ipc_serve(msg_handlers, COUNT_HANDLERS(msg_handlers),
+				listener_socket, &wait_mask);
+		if (sock == -1 && errno == EINTR)
+			manager_exit();
+		if (sock != -1) {
+			/* the sessions carry on with the successor */
+			record_stop();
+			int ret = manager_handoff_send(sock);
+			if (ret == -1)
+				perror("session manager: handoff");
+			trace_dump();
+			exit(ret == -1);
+		}
+		perror("session manager: ipc_serve");
+		exit(1);
+	}
+
+	close(ready[1]);
+	char c = 0;
+	ssize_t r;
+	while ((r = read(ready[0], &c, 1)) == -1 && errno == EINTR)
+		;
+	close(ready[0]);
+	if (pid == -1 || r != 1)
+		return -1;
+	return pid;
 }
 
 /**
  * Call this in the client when a session is created or becomes idle
+ * poke_fd	eventfd the opponent and the manager write to, -1 for none
  */
-void notify_idle_session(pid_t pid) {
-	DBG(3, "Sending idle session notification from pid %d\n", pid);
-	query(pid, MSG_IDLE, 0, 0);
+void notify_idle_session(pid_t pid, int poke_fd) {
+	struct message m;
+	m.mt = MSG_IDLE;
+	m.pid = pid;
+
+	/* the channel keeps order, so later queries see the game created */
+	ipc_send(&m, sizeof(m), poke_fd, 0);
 }
 
-void notify_join_game(pid_t pid, char key[]) {
-	DBG(3, "Sending join query from pid %d\n", pid);
-	/*query(pid, MSG_JOIN, 0, 0);*/
-	int sock = get_send_socket();
-	if (sock == -1) {
-		perror("client: get_send_socket");
-		return;
-	}
-	
+void notify_join_game(pid_t pid, char key[], int poke_fd) {
 	struct join_message m;
 	m.m.mt = MSG_JOIN;
 	m.m.pid = pid;
 	strcpy(m.game_key, key);
 
-	if (send(sock, &m, sizeof(m), 0) == -1)
-		perror("client: send\n");
+	/* the channel keeps order, so later queries see the join done */
+	ipc_send(&m.m, sizeof(m), poke_fd, 0);
+}
+
+/**
+ * Returns the eventfd of the session's opponent, -1 if it has none.  The
+ * caller gets its own descriptor and has to close it.
+ */
+int get_opponent_poke(pid_t pid) {
+	struct message m;
+	m.mt = MSG_OPPONENT_POKE_QUERY;
+	m.pid = pid;
+	int found, fd;
+	if (ipc_request_fd(&m, sizeof(m), -1, &found, sizeof(found), &fd) == -1)
+		return -1;
+	return fd;
+}
+
+/**
+ * Returns the arena slot of the session's game, -1 if it has none
+ */
+int get_game_slot(pid_t pid) {
+	int slot = -1;
+	if (query(pid, MSG_GAME_SLOT_QUERY, &slot, sizeof(slot)) == -1)
+		return -1;
+	return slot;
+}
+
+/**
+ * Returns the arena slot of the game with the given key, -1 if there is none
+ */
+int get_spectated_slot(pid_t pid, char key[]) {
+	struct join_message m;
+	int slot = -1;
+	m.m.mt = MSG_SPECTATE;
+	m.m.pid = pid;
+	strcpy(m.game_key, key);
+	if (ipc_request(&m.m, sizeof(m), &slot, sizeof(slot), 1) == -1)
+		return -1;
+	return slot;
+}
+
+/**
+ * Asks for an opponent from the quick-match queue.  The session is poked
+ * once it has one if it has to wait.
+ * poke_fd	eventfd the opponent and the manager write to, -1 for none
+ * Returns the arena slot of the game, MATCH_WAITING or MATCH_FAILED.
+ */
+int request_match(pid_t pid, int poke_fd) {
+	struct message m;
+	m.mt = MSG_MATCH;
+	m.pid = pid;
+	int reply = MATCH_FAILED, none;
+	if (ipc_request_fd(&m, sizeof(m), poke_fd, &reply, sizeof(reply),
+				&none) == -1)
+		return MATCH_FAILED;
+	return reply;
+}
+
+/**
+ * Leaves the quick-match queue.  Returns the arena slot of the session's
+ * game if it has got an opponent in the meantime, -1 otherwise.
+ */
+int cancel_match(pid_t pid) {
+	int slot = -1;
+	if (query(pid, MSG_MATCH_CANCEL, &slot, sizeof(slot)) == -1)
+		return -1;
+	return slot;
+}
+
+/**
+ * Seats the computer player opposite the session in the game it has just
+ * hosted.  Returns the arena slot of the game, -1 on failure.
+ */
+int request_bot(pid_t pid) {
+	int slot = -1;
+	if (query(pid, MSG_BOT, &slot, sizeof(slot)) == -1)
+		return -1;
+	return slot;
 }
 
-int get_map_shm(pid_t pid) {
-	DBG(3, "Requesting map SHM from pid %d\n", pid);
-	int map_shm = -1;
-	if (query(pid, MSG_MAP_SHM_QUERY, &map_shm, sizeof(map_shm)) == -1)
+/**
+ * Returns the arena slot of a game the computer player has been seated in
+ * since it last asked, -1 if there is none
+ */
+int get_bot_game() {
+	int slot = -1;
+	if (query(getpid(), MSG_BOT_GAME_QUERY, &slot, sizeof(slot)) == -1)
 		return -1;
+	return slot;
+}
 
-	DBG(3, "Obtained map SHM id: %d\n", map_shm);
-	return map_shm;
+/**
+ * Lets the manager count a move of the computer player
+ * sid		id of the computer player's seat
+ * playouts	playouts of the search for the move, which took ns
+ */
+void report_bot_move(pid_t sid, uint64_t playouts, uint64_t ns) {
+	struct bot_report_message m;
+	m.m.mt = MSG_BOT_REPORT;
+	m.m.pid = sid;
+	m.playouts = playouts;
+	m.ns = ns;
+	ipc_request(&m.m, sizeof(m), 0, 0, 0);
+}
+
+/**
+ * Has the manager poke the session's opponent
+ */
+void relay_poke(pid_t pid) {
+	notify(pid, MSG_POKE);
+}
+
+/*
+ * Counterparts of the queries above that return as soon as the request has
+ * been sent, with its id, or 0 on failure.  The caller reads the reply with
+ * ipc_read_reply(): an int as returned by the query, and for
+ * send_opponent_poke_query() the eventfd.
+ */
+
+static uint32_t send_query(pid_t pid, int message_type, int send_fd) {
+	struct message m;
+	m.mt = message_type;
+	m.pid = pid;
+	return ipc_send(&m, sizeof(m), send_fd, 1);
 }
 
+uint32_t send_game_slot_query(pid_t pid) {
+	return send_query(pid, MSG_GAME_SLOT_QUERY, -1);
+}
+
+uint32_t send_opponent_poke_query(pid_t pid) {
+	return send_query(pid, MSG_OPPONENT_POKE_QUERY, -1);
+}
+
+uint32_t send_spectate_query(pid_t pid, char key[]) {
+	struct join_message m;
+	m.m.mt = MSG_SPECTATE;
+	m.m.pid = pid;
+	strcpy(m.game_key, key);
+	return ipc_send(&m.m, sizeof(m), -1, 1);
+}
+
+uint32_t send_match_request(pid_t pid, int poke_fd) {
+	return send_query(pid, MSG_MATCH, poke_fd);
+}
+
+uint32_t send_match_cancel(pid_t pid) {
+	return send_query(pid, MSG_MATCH_CANCEL, -1);
+}
+
+uint32_t send_bot_request(pid_t pid) {
+	return send_query(pid, MSG_BOT, -1);
+}
+
+/**
+ * Fills in the manager's statistics.  Returns 0 on success, -1 on failure.
+ */
+int get_manager_stats(struct manager_stats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	return query(getpid(), MSG_STATS, stats, sizeof(*stats));
+}
@@ -1,8 +1,16 @@
+#ifndef GAME_MANAGER_H
+#define GAME_MANAGER_H
+
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 
 #include "conf.h"
+#include "feed.h"
+#include "ipc_message.h"
+#include "move_log.h"
+#include "rules.h"
 
 enum GAME_STATE {
 	GAME_IDLE,
@@ -14,26 +22,128 @@ struct game {
 	/* PIDs of participating telnet sessions */
 	pid_t sessions[2];
 
-	/* SHM id of this struct */
-	int game_shm;
-
-	/* game map */
-	char map[MAP_WIDTH * MAP_HEIGHT];
+	/* index of this struct in the arena */
+	int slot;
 
 	enum GAME_STATE state;
 
 	/* null-terminated string containing a random key */
 	char key[7];
+
+	/* of the fields above, which only the manager writes, see arena_seal() */
+	uint32_t checksum;
+
+	/* game map, laid out as in board.h.  Tiles of a large map start on a
+	   page each. */
+#if TILES_X * TILES_Y > 1
+	char map[MAP_CELLS] __attribute__((aligned(TILE_CELLS)));
+#else
+	char map[MAP_CELLS];
+#endif
+
+	/* connected dots of each player, see place_dot() */
+	struct dot_sets dots;
+
+	/* dots and fields of each player, kept by place_dot() */
+	struct score score;
+
+	/* moves made so far */
+	struct move_log log;
+
+	/* output for spectators */
+	struct game_feed feed;
 };
 
+/*
+ * Session ids at or above EVENT_SESSION_BASE do not name a process, they are
+ * handed out by the event server to the connections it multiplexes.  Every
+ * event server process running at the same time has its own instance number
+ * and range of EVENT_INSTANCE_SESSIONS ids.
+ */
+#define EVENT_SESSION_BASE (1 << 24)
+#define EVENT_INSTANCE_SESSIONS (1 << 20)
+#define EVENT_INSTANCES 1024
+#define IS_PROCESS_SESSION(id) ((id) > 0 && (id) < EVENT_SESSION_BASE)
+
+/*
+ * The computer player sits in the second seat of its games, under an id of
+ * its own for each arena slot, above those of the event servers
+ */
+#define BOT_SESSION_BASE \
+	(EVENT_SESSION_BASE + EVENT_INSTANCES * EVENT_INSTANCE_SESSIONS)
+#define BOT_SESSION(slot) (BOT_SESSION_BASE + (slot))
+#define IS_BOT_SESSION(id) ((id) >= BOT_SESSION_BASE)
+
 enum MESSAGE_TYPE {
 	MSG_IDLE,
-	MSG_MAP_SHM_QUERY,
+	MSG_GAME_SLOT_QUERY,
 	MSG_SESSION_QUIT,
-	MSG_JOIN
+	MSG_JOIN,
+	MSG_OPPONENT_POKE_QUERY,
+	MSG_STATS,
+	MSG_SPECTATE,
+	MSG_HANDOFF,
+	MSG_MATCH,
+	MSG_MATCH_CANCEL,
+	MSG_BOT,
+	MSG_BOT_GAME_QUERY,
+	MSG_BOT_REPORT,
+	MSG_POKE,
+
+	/* keep last */
+	MSG_TYPE_COUNT
 };
 
-int run_manager();
-void notify_idle_session(pid_t pid);
-int get_map_shm(pid_t pid);
-void notify_join_game(pid_t pid, char key[]);
+/**
+ * Reply to MSG_STATS.  Counts of games and sessions are taken when the
+ * request is handled, the others count up from the start of the manager.
+ */
+struct manager_stats {
+	/* games by state, waiting ones have not been joined yet */
+	uint32_t games_waiting, games_active, games_orphaned;
+	uint32_t sessions;
+	/* sessions in the quick-match queue */
+	uint32_t sessions_matching;
+	uint32_t arena_in_use, arena_slots;
+
+	uint64_t games_created, games_rejected;
+	uint64_t joins, joins_failed;
+	uint64_t matches;
+
+	/* games against the computer player, and its moves and the playouts and
+	   time of their searches */
+	uint32_t bot_games;
+	uint64_t bot_moves, bot_playouts, bot_search_ns;
+
+	/* by message type */
+	struct handler_stats messages[MSG_TYPE_COUNT];
+};
+
+int run_manager(int listener_socket, int take_over,
+		pid_t (*start_bot)(int poke_fd));
+void notify_idle_session(pid_t pid, int poke_fd);
+int get_game_slot(pid_t pid);
+void notify_join_game(pid_t pid, char key[], int poke_fd);
+int get_opponent_poke(pid_t pid);
+int get_manager_stats(struct manager_stats *stats);
+int get_spectated_slot(pid_t pid, char key[]);
+int request_match(pid_t pid, int poke_fd);
+int cancel_match(pid_t pid);
+int request_bot(pid_t pid);
+int get_bot_game();
+void report_bot_move(pid_t sid, uint64_t playouts, uint64_t ns);
+void relay_poke(pid_t pid);
+
+/* requests whose int reply, and descriptor, are read with ipc_read_reply() */
+uint32_t send_game_slot_query(pid_t pid);
+uint32_t send_opponent_poke_query(pid_t pid);
+uint32_t send_spectate_query(pid_t pid, char key[]);
+uint32_t send_match_request(pid_t pid, int poke_fd);
+uint32_t send_match_cancel(pid_t pid);
+uint32_t send_bot_request(pid_t pid);
+
+/* replies to MSG_MATCH other than a slot */
+#define MATCH_WAITING -1
+#define MATCH_FAILED -2
+
+#endif
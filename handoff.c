@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+
+#include "conf.h"
+#include "arena.h"
+#include "handoff.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+/* names the descriptor the upgraded server receives the handoff on */
+#define HANDOFF_ENV "KROPKID_HANDOFF"
+
+extern char **environ;
+
+/*
+ * An upgrade runs the binary at the path the server was started from, with
+ * the same arguments, so the new build serves in the same mode.
+ */
+static char **root_argv;
+static int root_manager_sock = -1;
+
+/* in the upgraded server, the connection to its predecessor until it has
+   taken over */
+static int handoff_sock = -1;
+
+static unsigned char reserved[EVENT_INSTANCES / 8];
+
+int handed_off = 0;
+
+void handoff_init(char *argv[], int manager_sock) {
+	root_argv = argv;
+	root_manager_sock = manager_sock;
+}
+
+void handoff_reserve(int instance) {
+	reserved[instance / 8] |= 1 << (instance % 8);
+}
+
+/**
+ * Returns 1 if an event server of an earlier server may still use the
+ * instance number
+ */
+int handoff_reserved(int instance) {
+	return (reserved[instance / 8] >> (instance % 8)) & 1;
+}
+
+/**
+ * Starts the binary the server was started from, and hands it the arena, the
+ * manager's socket and the listening sockets.  Its manager takes over from
+ * ours.  The new server is detached, so it outlives this one.
+ * Returns 0 once it has taken over and this server should stop accepting,
+ * -1 if it failed to, in which case this server carries on.
+ */
+int handoff_start(const int *listeners, int listener_count) {
+	int pair[2];
+	if (listener_count > HANDOFF_MAX_FDS - 2) {
+		/* the new server would accept on fewer sockets than this one */
+		fprintf(stderr, "handoff: %d listening sockets, at most %d can be "
+				"handed over\n", listener_count, HANDOFF_MAX_FDS - 2);
+		return -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+		perror("handoff: socketpair");
+		return -1;
+	}
+
+	/* built before forking, a threaded process may not allocate after */
+	size_t n = 0, i, j = 0;
+	while (environ[n])
+		n++;
+	char **env = malloc((n + 2) * sizeof(char*));
+	char var[sizeof(HANDOFF_ENV) + 16];
+	if (!env) {
+		close(pair[0]);
+		close(pair[1]);
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		if (strncmp(environ[i], HANDOFF_ENV "=", sizeof(HANDOFF_ENV)) != 0)
+			env[j++] = environ[i];
+	snprintf(var, sizeof(var), HANDOFF_ENV "=%d", pair[1]);
+	env[j++] = var;
+	env[j] = 0;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (fork() == 0) {
+			fcntl(pair[1], F_SETFD, 0);
+			execvpe(root_argv[0], root_argv, env);
+		}
+		_exit(0);
+	}
+	free(env);
+	close(pair[1]);
+	if (pid == -1) {
+		perror("handoff: fork");
+		close(pair[0]);
+		return -1;
+	}
+	while (waitpid(pid, 0, 0) == -1 && errno == EINTR)
+		;
+
+	struct handoff h;
+	memset(&h, 0, sizeof(h));
+	h.version = HANDOFF_VERSION;
+	h.game_size = sizeof(struct game);
+	h.arena_slots = arena_slots;
+	h.arena_in_file = arena_in_file();
+	h.listener_count = listener_count;
+	memcpy(h.instances, reserved, sizeof(reserved));
+
+	int fds[HANDOFF_MAX_FDS];
+	fds[0] = arena_fd;
+	fds[1] = root_manager_sock;
+	memcpy(fds + 2, listeners, listener_count * sizeof(int));
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { &h, sizeof(h) };
+	struct msghdr mh = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = CMSG_SPACE((2 + listener_count) * sizeof(int)) };
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN((2 + listener_count) * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, (2 + listener_count) * sizeof(int));
+	if (sendmsg(pair[0], &mh, MSG_NOSIGNAL) != sizeof(h)) {
+		perror("handoff: sendmsg");
+		close(pair[0]);
+		return -1;
+	}
+
+	/* a byte once the new manager has taken over, nothing if it failed */
+	struct pollfd pfd = { .fd = pair[0], .events = POLLIN };
+	char ack = 0;
+	int r;
+	while ((r = poll(&pfd, 1, HANDOFF_TIMEOUT)) == -1 && errno == EINTR)
+		;
+	if (r == 1 && read(pair[0], &ack, 1) == 1 && ack == 1) {
+		close(pair[0]);
+		handed_off = 1;
+		DBG(2, "Upgraded server has taken over\n");
+		return 0;
+	}
+	close(pair[0]);
+	DBG(1, "Upgrade failed, carrying on\n");
+	return -1;
+}
+
+/**
+ * Receives what a server being upgraded hands over, if it has started this
+ * one.  fds must have room for HANDOFF_MAX_FDS descriptors.
+ * Returns the number of descriptors, 0 if this server was not started for an
+ * upgrade, -1 on failure.
+ */
+int handoff_receive(struct handoff *h, int *fds) {
+	const char *var = getenv(HANDOFF_ENV);
+	if (!var)
+		return 0;
+	int sock = atoi(var);
+	unsetenv(HANDOFF_ENV);
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+	char cbuf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+	struct iovec iov = { h, sizeof(*h) };
+	struct msghdr mh = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	ssize_t r;
+	while ((r = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+		;
+	int count = 0;
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	if (r > 0 && cm && cm->cmsg_level == SOL_SOCKET &&
+			cm->cmsg_type == SCM_RIGHTS) {
+		count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cm), count * sizeof(int));
+	}
+
+	if (r != sizeof(*h) || h->version != HANDOFF_VERSION ||
+			h->game_size != sizeof(struct game) ||
+			h->arena_slots != ARENA_SLOTS ||
+			count != 2 + h->listener_count) {
+		fputs("handoff: the running server is not compatible\n", stderr);
+		close(sock);
+		return -1;
+	}
+
+	memcpy(reserved, h->instances, sizeof(reserved));
+	handoff_sock = sock;
+	return count;
+}
+
+/**
+ * Tells the server being upgraded that this one has taken over
+ */
+void handoff_done() {
+	char ack = 1;
+	if (handoff_sock == -1)
+		return;
+	if (write(handoff_sock, &ack, 1) != 1)
+		perror("handoff: write");
+	close(handoff_sock);
+	handoff_sock = -1;
+}
@@ -0,0 +1,45 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+#include "game_manager.h"
+
+/**
+ * Sent by a server to the upgraded one it starts on SIGHUP, together with
+ * the arena, the manager's listening socket and the telnet listening
+ * sockets, in that order.
+ */
+struct handoff {
+	uint32_t version;
+	uint32_t game_size;
+	uint32_t arena_slots;
+	uint32_t arena_in_file;
+	uint32_t listener_count;
+
+	/* event server instances that may still be serving sessions, so their
+	   session ids are not handed out again */
+	unsigned char instances[EVENT_INSTANCES / 8];
+};
+
+#define HANDOFF_VERSION 2
+
+/* at most as many as one SCM_RIGHTS message can carry */
+#define HANDOFF_MAX_FDS 253
+
+/* set once an upgraded server has taken over */
+extern int handed_off;
+
+void handoff_init(char *argv[], int manager_sock);
+
+void handoff_reserve(int instance);
+
+int handoff_reserved(int instance);
+
+int handoff_start(const int *listeners, int listener_count);
+
+int handoff_receive(struct handoff *h, int *fds);
+
+void handoff_done();
+
+#endif
@@ -1,60 +1,315 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "conf.h"
 #include "ipc_message.h"
+#include "trace.h"
 
-#define MESSAGE_TAIL(m) ((void*)(m) + sizeof(m->mt))
+#define IPC_BATCH 64
+
+/* descriptors received ahead of the frames they belong to */
+#define IPC_MAX_FDS 8
 
 /**
- * Receives the incoming message and calls apropriate handler
- * handlers		array mapping message types to struct message_handler
- * rsock		socket connected to the incoming connection
+ * A session's connection to the host.  Requests are handled as soon as their
+ * frames are complete, and the replies to everything read at once go out in
+ * one send.
+ */
+struct ipc_conn {
+	int sock;
+	int closing;
+
+	/* received data, starting at a frame boundary */
+	char in[2 * IPC_MAX_FRAME];
+	size_t in_len;
+
+	/* replies not sent yet */
+	char *out;
+	size_t out_len, out_size, out_sent;
+	int want_write;
+
+	/* descriptors received, in the order of their frames */
+	int fds[IPC_MAX_FDS];
+	int fd_count;
+
+	/* request being handled */
+	uint32_t cur_id;
+	int cur_replied;
+	int cur_fd;
+
+	/* all open connections, for handing over */
+	struct ipc_conn *next, *prev;
+};
+
+/* connections open in ipc_serve */
+static struct ipc_conn *conns = 0;
+
+/* set by ipc_stop() */
+static struct ipc_conn *stop_conn = 0;
+
+/* set by ipc_interrupt() */
+static volatile sig_atomic_t interrupted = 0;
+
+/*
+ * The calling thread's connection to the host, opened on first use.  Each
+ * session process, or event server worker thread, keeps one for its lifetime.
  */
-int ipc_receive_message(
-		struct message_handler handlers[], 
-		unsigned int handler_count, int rsock)
+static __thread int channel = -1;
+static __thread uint32_t channel_next_id = 1;
+
+/* reply being read by ipc_read_reply(), and the descriptor that came with it */
+static __thread char reply_frame[IPC_MAX_FRAME];
+static __thread size_t reply_len = 0;
+static __thread int reply_fd = -1;
+
+static void ipc_queue_reply(
+		struct ipc_conn *c, const void *data, size_t size, uint32_t flags)
 {
-	int message_type;
-	recv(rsock, &message_type, sizeof(message_type), 0);
-	
-	if (message_type >= handler_count) {
-		fprintf(stderr, "Invalid message type %d\n", message_type);
-		return -1;
+	struct ipc_header h = { sizeof(h) + size, c->cur_id, flags };
+	size_t need = c->out_len + h.len;
+	c->cur_replied = 1;
+
+	if (need > c->out_size) {
+		size_t new_size = c->out_size ? c->out_size * 2 : 1024;
+		while (new_size < need)
+			new_size *= 2;
+		char *p = realloc(c->out, new_size);
+		if (!p) {
+			perror("ipc_reply: realloc");
+			c->closing = 1;
+			return;
+		}
+		c->out = p;
+		c->out_size = new_size;
 	}
+	memcpy(c->out + c->out_len, &h, sizeof(h));
+	memcpy(c->out + c->out_len + sizeof(h), data, size);
+	c->out_len += h.len;
+}
 
-	struct message *message_data =
-		malloc(handlers[message_type].message_size);
-	if (message_data == 0) {
-		perror("ipc_receive_message: malloc");
-		return -1;
+/**
+ * Queues the reply to the request being handled.  Requests that wait for a
+ * reply and have not got one when their handler returns are answered with an
+ * empty payload.
+ */
+void ipc_reply(struct ipc_conn *c, const void *data, size_t size) {
+	ipc_queue_reply(c, data, size, 0);
+}
+
+/**
+ * Sends the reply to the request being handled right away, together with a
+ * file descriptor.  Replies queued before it are sent first.  The descriptor
+ * stays open in the caller.
+ */
+void ipc_reply_fd(struct ipc_conn *c, const void *data, size_t size, int fd) {
+	struct ipc_header h = { sizeof(h) + size, c->cur_id, IPC_HAS_FD };
+	c->cur_replied = 1;
+
+	while (c->out_sent < c->out_len) {
+		ssize_t r = send(c->sock, c->out + c->out_sent,
+				c->out_len - c->out_sent, MSG_NOSIGNAL);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1) {
+			c->closing = 1;
+			return;
+		}
+		c->out_sent += r;
 	}
+	c->out_sent = c->out_len = 0;
 
-	if (recv(
-			rsock, MESSAGE_TAIL(message_data),
-			handlers[message_type].message_size - sizeof(message_type),
-			0) == -1) {
-		perror("ipc_receive_message: recv");
-		return -1;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov[2] = { { &h, sizeof(h) }, { (void*)data, size } };
+	struct msghdr mh = {
+		.msg_iov = iov, .msg_iovlen = 2,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+	/* replies are small, a short send only happens on a broken socket */
+	ssize_t r;
+	while ((r = sendmsg(c->sock, &mh, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+		;
+	if (r != h.len)
+		c->closing = 1;
+}
+
+/**
+ * Returns the file descriptor that came with the request being handled, -1 if
+ * there is none.  The caller becomes responsible for closing it.
+ */
+int ipc_take_fd(struct ipc_conn *c) {
+	int fd = c->cur_fd;
+	c->cur_fd = -1;
+	return fd;
+}
+
+static void handler_stats_add(struct handler_stats *s, long long nsec) {
+	long long usec = nsec / 1000;
+	int bucket = 0;
+	while (usec && bucket < IPC_LATENCY_BUCKETS - 1) {
+		usec >>= 1;
+		bucket++;
 	}
-	message_data->mt = message_type;
+	s->calls++;
+	s->nsec += nsec;
+	s->latency[bucket]++;
+}
+
+/**
+ * Calls the handler of every complete frame in the input buffer.  Returns -1
+ * if the peer has sent something invalid.
+ */
+static int ipc_dispatch(
+		struct message_handler handlers[],
+		unsigned int handler_count, struct ipc_conn *c)
+{
+	/* aligned copy of the message, which handlers may modify */
+	union {
+		struct message m;
+		char data[IPC_MAX_FRAME];
+	} msg;
+	size_t pos = 0;
 
-	handlers[message_type].handler_func(message_data, rsock);
+	while (c->in_len - pos >= sizeof(struct ipc_header)) {
+		struct ipc_header h;
+		memcpy(&h, c->in + pos, sizeof(h));
+		if (h.len < sizeof(h) + sizeof(int) || h.len > IPC_MAX_FRAME) {
+			fprintf(stderr, "Invalid frame length %u\n", h.len);
+			return -1;
+		}
+		if (c->in_len - pos < h.len)
+			break;
 
-	free(message_data);
+		size_t size = h.len - sizeof(h);
+		memcpy(&msg, c->in + pos + sizeof(h), size);
+		pos += h.len;
+		if (msg.m.mt < 0 || msg.m.mt >= handler_count ||
+				handlers[msg.m.mt].message_size != size) {
+			fprintf(stderr, "Invalid message type %d\n", msg.m.mt);
+			return -1;
+		}
+
+		c->cur_id = h.id;
+		c->cur_replied = 0;
+		c->cur_fd = -1;
+		if (h.flags & IPC_HAS_FD) {
+			if (c->fd_count == 0) {
+				fprintf(stderr, "Missing descriptor in frame %u\n", h.id);
+				return -1;
+			}
+			c->cur_fd = c->fds[0];
+			memmove(c->fds, c->fds + 1, --c->fd_count * sizeof(int));
+			if (c->cur_fd == -1) {
+				/* lost on the way in, the request fails on its own */
+				fprintf(stderr, "Descriptor of frame %u not received\n",
+						h.id);
+				if (h.flags & IPC_WANT_REPLY)
+					ipc_queue_reply(c, 0, 0, IPC_FAILED);
+				continue;
+			}
+		}
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		handlers[msg.m.mt].handler_func(&msg.m, c);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		long long nsec = (end.tv_sec - start.tv_sec) * 1000000000ll +
+			end.tv_nsec - start.tv_nsec;
+		handler_stats_add(&handlers[msg.m.mt].stats, nsec);
+		TRACE(TRACE_IPC_HANDLE, msg.m.mt, msg.m.pid, nsec);
+
+		if ((h.flags & IPC_WANT_REPLY) && !c->cur_replied)
+			ipc_reply(c, 0, 0);
+		if (c->cur_fd != -1)
+			close(c->cur_fd);
+	}
+
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
 	return 0;
 }
 
 /**
- * Accepts incoming connections and handles messages
+ * Sends queued replies, waiting for EPOLLOUT if the socket is full
  */
-int ipc_accept_message(
+static void ipc_conn_flush(int epfd, struct ipc_conn *c) {
+	while (c->out_sent < c->out_len) {
+		ssize_t r = send(c->sock, c->out + c->out_sent,
+				c->out_len - c->out_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				c->closing = 1;
+			break;
+		}
+		c->out_sent += r;
+	}
+	if (c->out_sent == c->out_len)
+		c->out_sent = c->out_len = 0;
+
+	int want_write = c->out_len > 0;
+	if (want_write != c->want_write && !c->closing) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+		ev.data.ptr = c;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev);
+		c->want_write = want_write;
+	}
+}
+
+static void ipc_conn_read(
 		struct message_handler handlers[],
-		unsigned int handler_count, int listener_socket)
+		unsigned int handler_count, struct ipc_conn *c)
 {
+	char cbuf[CMSG_SPACE(sizeof(int) * IPC_MAX_FDS)];
+	struct iovec iov = { c->in + c->in_len, sizeof(c->in) - c->in_len };
+	struct msghdr mh = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	ssize_t r = recvmsg(c->sock, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR)) {
+		c->closing = 1;
+		return;
+	}
+
+	struct cmsghdr *cm;
+	for (cm = CMSG_FIRSTHDR(&mh); r > 0 && cm; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int), i, fd;
+		for (i = 0; i < n; i++) {
+			memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+			if (c->fd_count < IPC_MAX_FDS)
+				c->fds[c->fd_count++] = fd;
+			else
+				close(fd);
+		}
+	}
+	/* descriptors could not be received, most likely for want of room in
+	   the file table.  A frame brings one along with its first byte, and a
+	   read takes no more than one frame's, so this stands in for it. */
+	if (r > 0 && (mh.msg_flags & MSG_CTRUNC) && c->fd_count < IPC_MAX_FDS)
+		c->fds[c->fd_count++] = -1;
+	if (r > 0) {
+		c->in_len += r;
+		if (ipc_dispatch(handlers, handler_count, c) == -1)
+			c->closing = 1;
+	}
+}
+
+static void ipc_accept(int epfd, int listener_socket) {
 	struct sockaddr_un remote;
 	socklen_t desclen = sizeof(remote);
 	int rsock = accept(
@@ -62,14 +317,165 @@ int ipc_accept_message(
 			(struct sockaddr*)&remote,
 			&desclen);
 	if (rsock == -1) {
-		perror("ipc_accept_message: accept");
-		return -1;
+		perror("ipc_accept: accept");
+		return;
+	}
+
+	struct ipc_conn *c = calloc(1, sizeof(struct ipc_conn));
+	if (!c) {
+		perror("ipc_accept: calloc");
+		close(rsock);
+		return;
+	}
+	c->sock = rsock;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, rsock, &ev) == -1) {
+		perror("ipc_accept: epoll_ctl");
+		close(rsock);
+		free(c);
+		return;
+	}
+	c->next = conns;
+	if (conns)
+		conns->prev = c;
+	conns = c;
+}
+
+static void ipc_conn_free(struct ipc_conn *c) {
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		conns = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	if (c->sock != -1)
+		close(c->sock);
+	while (c->fd_count > 0)
+		close(c->fds[--c->fd_count]);
+	free(c->out);
+	free(c);
+}
+
+/**
+ * Makes ipc_serve return once the handler has finished, handing over the
+ * connection of the request being handled.  The other connections are
+ * drained and closed first, see ipc_drain().
+ */
+void ipc_stop(struct ipc_conn *c) {
+	if (!stop_conn)
+		stop_conn = c;
+}
+
+/**
+ * Handles whatever the sessions have sent so far and closes their
+ * connections.  Reading is shut down first, so a session sending later gets
+ * an error and reconnects, to whoever listens on the socket by then, rather
+ * than losing its request.
+ */
+static void ipc_drain(struct message_handler handlers[],
+		unsigned int handler_count)
+{
+	struct ipc_conn *c, *next;
+	for (c = conns; c; c = c->next)
+		if (c != stop_conn)
+			shutdown(c->sock, SHUT_RD);
+
+	for (c = conns; c; c = next) {
+		next = c->next;
+		if (c == stop_conn)
+			continue;
+		/* reads end at the shutdown rather than block */
+		while (!c->closing)
+			ipc_conn_read(handlers, handler_count, c);
+		while (c->out_sent < c->out_len) {
+			ssize_t r = send(c->sock, c->out + c->out_sent,
+					c->out_len - c->out_sent, MSG_NOSIGNAL);
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r == -1)
+				break;
+			c->out_sent += r;
+		}
+		ipc_conn_free(c);
 	}
+}
+
+/**
+ * Makes ipc_serve() return, for use in signal handlers.  Those signals have
+ * to be blocked while ipc_serve() is not waiting, see wait_mask.
+ */
+void ipc_interrupt() {
+	interrupted = 1;
+}
+
+/**
+ * Accepts incoming connections and handles messages from all of them.
+ * Returns the socket of the connection passed to ipc_stop() once the others
+ * have been drained, -1 on failure, and -1 with errno set to EINTR once
+ * ipc_interrupt() has been called.
+ * handlers		array mapping message types to struct message_handler
+ * wait_mask	signal mask while waiting for messages, which unblocks the
+ * 				signals calling ipc_interrupt()
+ */
+int ipc_serve(
+		struct message_handler handlers[],
+		unsigned int handler_count, int listener_socket,
+		const sigset_t *wait_mask)
+{
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		return -1;
 
-	int r = ipc_receive_message(handlers, handler_count, rsock);
+	struct epoll_event ev, events[IPC_BATCH];
+	ev.events = EPOLLIN;
+	ev.data.ptr = 0;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listener_socket, &ev) == -1)
+		return -1;
 
-	close(rsock);
-	return r;
+	for (;;) {
+		if (interrupted) {
+			close(epfd);
+			errno = EINTR;
+			return -1;
+		}
+		int n = epoll_pwait(epfd, events, IPC_BATCH, -1, wait_mask);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		int i;
+		for (i = 0; i < n; i++) {
+			struct ipc_conn *c = events[i].data.ptr;
+			if (!c) {
+				ipc_accept(epfd, listener_socket);
+				continue;
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				ipc_conn_read(handlers, handler_count, c);
+			ipc_conn_flush(epfd, c);
+
+			if (c->closing && c != stop_conn) {
+				epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, 0);
+				ipc_conn_free(c);
+			}
+		}
+
+		if (stop_conn) {
+			close(epfd);
+			ipc_drain(handlers, handler_count);
+			int sock = stop_conn->sock;
+			stop_conn->sock = -1;
+			ipc_conn_free(stop_conn);
+			stop_conn = 0;
+			return sock;
+		}
+	}
 }
 
 /**
@@ -77,7 +483,7 @@ int ipc_accept_message(
  * MGR_SOCKET must be defined in conf.h.
  */
 int ipc_start_listener() {
-	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (sock == -1)
 		return -1;
 
@@ -93,7 +499,7 @@ int ipc_start_listener() {
 		return -1;
 	}
 
-	if (listen(sock, 10) == -1)
+	if (listen(sock, SOMAXCONN) == -1)
 		return -1;
 
 	return sock;
@@ -105,7 +511,9 @@ int ipc_start_listener() {
  */
 int get_send_socket() {
 	struct sockaddr_un remote;
-	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -1;
 	remote.sun_family = AF_UNIX;
 	strcpy(remote.sun_path, MGR_SOCKET);
 
@@ -119,21 +527,311 @@ int get_send_socket() {
 	return sock;
 }
 
+/**
+ * Sends the message on a connection of its own rather than on the channel,
+ * for exchanges that continue outside of frames.
+ * Returns the connected socket, -1 on failure.
+ */
+int ipc_connect_send(struct message *m, size_t message_size) {
+	struct ipc_header h = { sizeof(h) + message_size, 0, 0 };
+	char frame[IPC_MAX_FRAME];
+	int sock = get_send_socket();
+	if (sock == -1)
+		return -1;
+
+	memcpy(frame, &h, sizeof(h));
+	memcpy(frame + sizeof(h), m, message_size);
+	if (send(sock, frame, h.len, MSG_NOSIGNAL) != h.len) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static void channel_close() {
+	close(channel);
+	channel = -1;
+	reply_len = 0;
+	if (reply_fd != -1) {
+		close(reply_fd);
+		reply_fd = -1;
+	}
+}
+
+/**
+ * Receives exactly size bytes, resuming after signals.  A descriptor that
+ * comes with them is stored in fd if given, closed otherwise.
+ */
+static int channel_recv(void *buf, size_t size, int *fd) {
+	size_t got = 0;
+	while (got < size) {
+		char cbuf[CMSG_SPACE(sizeof(int))];
+		struct iovec iov = { (char*)buf + got, size - got };
+		struct msghdr mh = {
+			.msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+		ssize_t r = recvmsg(channel, &mh, MSG_CMSG_CLOEXEC);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		got += r;
+
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		if (cm && cm->cmsg_level == SOL_SOCKET &&
+				cm->cmsg_type == SCM_RIGHTS) {
+			int received;
+			memcpy(&received, CMSG_DATA(cm), sizeof(int));
+			if (fd && *fd == -1)
+				*fd = received;
+			else
+				close(received);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Sends a request frame on the channel, reconnecting once if the connection
+ * has gone away.  fd, unless -1, is passed along with the first byte.
+ */
+static int channel_send(
+		struct ipc_header *h, struct message *m, size_t size, int fd)
+{
+	int attempt;
+	for (attempt = 0; attempt < 2; attempt++) {
+		if (channel == -1 && (channel = get_send_socket()) == -1)
+			return -1;
+
+		char cbuf[CMSG_SPACE(sizeof(int))];
+		struct iovec iov[2] = { { h, sizeof(*h) }, { m, size } };
+		struct msghdr mh = { .msg_iov = iov, .msg_iovlen = 2 };
+		if (fd != -1) {
+			mh.msg_control = cbuf;
+			mh.msg_controllen = sizeof(cbuf);
+			struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_RIGHTS;
+			cm->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+		}
+
+		size_t sent = 0;
+		while (sent < h->len) {
+			ssize_t r = sendmsg(channel, &mh, MSG_NOSIGNAL);
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r == -1)
+				break;
+			sent += r;
+			mh.msg_control = 0;
+			mh.msg_controllen = 0;
+			/* skip what has been sent */
+			while (mh.msg_iovlen && r >= mh.msg_iov->iov_len) {
+				r -= mh.msg_iov->iov_len;
+				mh.msg_iov++;
+				mh.msg_iovlen--;
+			}
+			if (mh.msg_iovlen) {
+				mh.msg_iov->iov_base = (char*)mh.msg_iov->iov_base + r;
+				mh.msg_iov->iov_len -= r;
+			}
+		}
+		if (sent == h->len)
+			return 0;
+
+		/* a partly sent frame would confuse the host, start over */
+		channel_close();
+		if (sent > 0)
+			return -1;
+	}
+	return -1;
+}
+
+static int channel_request(
+		struct message *m, size_t message_size, int send_fd,
+		void *response_buffer, size_t response_size, int *recv_fd, int wait)
+{
+	struct ipc_header h = {
+		sizeof(h) + message_size,
+		channel_next_id++,
+		(wait ? IPC_WANT_REPLY : 0) | (send_fd != -1 ? IPC_HAS_FD : 0) };
+
+	TRACE(TRACE_IPC_SEND, m->mt, m->pid, wait);
+	if (channel_send(&h, m, message_size, send_fd) == -1) {
+		perror("client: channel_send");
+		return -1;
+	}
+	if (!wait)
+		return 0;
+
+	/* requests are answered in order, so this is the reply to h */
+	struct ipc_header rh;
+	if (channel_recv(&rh, sizeof(rh), recv_fd) == -1 || rh.id != h.id) {
+		fprintf(stderr, "client: bad reply to request %u\n", h.id);
+		channel_close();
+		return -1;
+	}
+	if ((rh.flags & IPC_FAILED) && rh.len == sizeof(rh))
+		return -1;
+	if (rh.len != sizeof(rh) + response_size ||
+			channel_recv(response_buffer, response_size, 0) == -1) {
+		fprintf(stderr, "client: bad reply to request %u\n", h.id);
+		channel_close();
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Returns the calling thread's channel to the host, connecting it if needed,
+ * -1 if it cannot be.  Replies to ipc_send() are read from it with
+ * ipc_read_reply() once it is readable.
+ */
+int ipc_channel() {
+	if (channel == -1)
+		channel = get_send_socket();
+	return channel;
+}
+
+/**
+ * Sends a request on the calling thread's channel without waiting for the
+ * reply.  Replies come in the order of their requests.
+ * send_fd			descriptor to pass to the host, -1 for none
+ * want_reply		whether the host replies
+ * Returns the id of the request, 0 on failure.
+ */
+uint32_t ipc_send(
+		struct message *m, size_t message_size, int send_fd, int want_reply)
+{
+	struct ipc_header h = {
+		sizeof(h) + message_size,
+		channel_next_id++,
+		(want_reply ? IPC_WANT_REPLY : 0) |
+			(send_fd != -1 ? IPC_HAS_FD : 0) };
+	if (h.id == 0)
+		h.id = channel_next_id++;
+
+	TRACE(TRACE_IPC_SEND, m->mt, m->pid, 0);
+	if (channel_send(&h, m, message_size, send_fd) == -1) {
+		perror("client: channel_send");
+		return 0;
+	}
+	return h.id;
+}
+
+/**
+ * Reads a reply to ipc_send() from the calling thread's channel, without
+ * blocking.  Frames are read up to their end only, so that a descriptor is
+ * received with the frame it belongs to.
+ * id				set to the id of the request replied to
+ * buf				buffer for the payload, which is cut to size bytes
+ * recv_fd			set to the descriptor that came with the reply, or to -1
+ * Returns the size of the payload, -1 with errno set to EAGAIN if no reply
+ * is complete yet, or -1 if the channel has failed and has been closed.
+ */
+ssize_t ipc_read_reply(uint32_t *id, void *buf, size_t size, int *recv_fd) {
+	for (;;) {
+		size_t want = sizeof(struct ipc_header);
+		if (reply_len >= want) {
+			struct ipc_header h;
+			memcpy(&h, reply_frame, sizeof(h));
+			if (h.len < sizeof(h) || h.len > IPC_MAX_FRAME) {
+				fprintf(stderr, "client: bad reply length %u\n", h.len);
+				channel_close();
+				errno = EPROTO;
+				return -1;
+			}
+			want = h.len;
+			if (reply_len == want) {
+				size_t payload = h.len - sizeof(h);
+				memcpy(buf, reply_frame + sizeof(h),
+						payload < size ? payload : size);
+				*id = h.id;
+				*recv_fd = reply_fd;
+				reply_fd = -1;
+				reply_len = 0;
+				return payload;
+			}
+		}
+
+		if (channel == -1) {
+			errno = ENOTCONN;
+			return -1;
+		}
+		char cbuf[CMSG_SPACE(sizeof(int))];
+		struct iovec iov = { reply_frame + reply_len, want - reply_len };
+		struct msghdr mh = {
+			.msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+		ssize_t r = recvmsg(channel, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (r <= 0) {
+			channel_close();
+			errno = ECONNRESET;
+			return -1;
+		}
+		reply_len += r;
+
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		if (cm && cm->cmsg_level == SOL_SOCKET &&
+				cm->cmsg_type == SCM_RIGHTS) {
+			int received;
+			memcpy(&received, CMSG_DATA(cm), sizeof(int));
+			if (reply_fd == -1)
+				reply_fd = received;
+			else
+				close(received);
+		}
+	}
+}
+
+/**
+ * Sends a message to the host on the calling thread's channel
+ * m				message, starting with struct message
+ * message_size		size of the whole message
+ * response_buffer	buffer for the response or NULL if response_size is 0
+ * response_size	bytes expected in the response
+ * wait				wait for the response.  If response_size is 0, this waits
+ * 					for the message to be processed.
+ * Returns 0 on success, -1 on failure.
+ */
+int ipc_request(
+		struct message *m, size_t message_size,
+		void *response_buffer, size_t response_size, int wait)
+{
+	return channel_request(m, message_size, -1,
+			response_buffer, response_size, 0, wait);
+}
+
+/**
+ * Like ipc_request, but passes file descriptors and always waits for the
+ * response
+ * send_fd			descriptor to pass to the host, -1 for none
+ * recv_fd			set to the descriptor passed back, or to -1
+ */
+int ipc_request_fd(
+		struct message *m, size_t message_size, int send_fd,
+		void *response_buffer, size_t response_size, int *recv_fd)
+{
+	*recv_fd = -1;
+	return channel_request(m, message_size, send_fd,
+			response_buffer, response_size, recv_fd, 1);
+}
+
 /**
  * Send a message without waiting for response
  */
 void notify(pid_t pid, int message_type) {
-	/* TODO: better error handling */
-	DBG(3, "Sending notification from pid %d\n", pid);
-	int sock = get_send_socket();
-	if (sock == -1) perror("client: get_send_socket");
-	
 	struct message m;
 	m.mt = message_type;
 	m.pid = pid;
-
-	if (send(sock, &m, sizeof(m), 0) == -1)
-		perror("client: send\n");
+	ipc_request(&m, sizeof(m), 0, 0, 0);
 }
 
 /**
@@ -144,34 +842,8 @@ void notify(pid_t pid, int message_type) {
  * response_size	bytes to receive. if 0, wait for the message to be processed
  */
 int query(pid_t pid, int message_type, void *response_buffer, size_t response_size) {
-	int sock = get_send_socket();
-	if (sock == -1) {
-		perror("client: get_send_socket");
-		return -1;
-	}
-	
 	struct message mq;
 	mq.mt = message_type;
 	mq.pid = pid;
-
-	if (send(sock, &mq, sizeof(mq), 0) == -1) {
-		perror("client: send");
-		return -1;
-	}
-
-	if (response_size > 0) {
-		if (recv(sock, response_buffer, response_size, MSG_WAITALL) != response_size)
-		{
-			perror("client: recv");
-			return -1;
-		}
-	} else {
-		/* better way to wait for the connection to close? */
-		int dummy;
-		while (recv(sock, &dummy, sizeof(dummy), MSG_WAITALL) > 0);
-	}
-
-	close(sock);
-	return 0;
+	return ipc_request(&mq, sizeof(mq), response_buffer, response_size, 1);
 }
-
@@ -1,3 +1,9 @@
+#ifndef IPC_MESSAGE_H
+#define IPC_MESSAGE_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 struct message {
 	/* Message type */
@@ -7,33 +13,99 @@ struct message {
 	pid_t pid;
 };
 
+/**
+ * Every message travels in a frame starting with this header.  Replies carry
+ * the id of their request and the response as payload.
+ */
+struct ipc_header {
+	/* size of the whole frame, header included */
+	uint32_t len;
+
+	/* request id, echoed in the reply */
+	uint32_t id;
+
+	/* IPC_WANT_REPLY, IPC_HAS_FD, IPC_FAILED */
+	uint32_t flags;
+};
+
+#define IPC_WANT_REPLY 1
+
+/* a file descriptor travels with the frame as SCM_RIGHTS */
+#define IPC_HAS_FD 2
+
+/* reply without payload to a request the host could not handle */
+#define IPC_FAILED 4
+
+/* largest frame accepted in either direction */
+#define IPC_MAX_FRAME 4096
+
+/* manager side of a session's connection */
+struct ipc_conn;
+
+#define IPC_LATENCY_BUCKETS 16
+
+/* handling times of one message type, kept by ipc_serve */
+struct handler_stats {
+	uint64_t calls;
+	uint64_t nsec;
+
+	/* bucket i counts calls taking less than 2^i microseconds, the last one
+	   also all slower calls */
+	uint64_t latency[IPC_LATENCY_BUCKETS];
+};
+
 struct message_handler {
 	size_t message_size;
-	void (*handler_func) (struct message*, int);
+	void (*handler_func) (struct message*, struct ipc_conn*);
+	struct handler_stats stats;
 };
 
 /* host */
 #define COUNT_HANDLERS(h_array) \
 	(sizeof(h_array) / sizeof(struct message_handler))
 
-int ipc_receive_message(
+int ipc_serve(
 		struct message_handler handlers[],
 		unsigned int handler_count,
-		int rsock);
+		int listener_socket,
+		const sigset_t *wait_mask);
 
-int ipc_accept_message(
-		struct message_handler handlers[], 
-		unsigned int handler_count,
-		int listener_socket);
+void ipc_interrupt();
+
+void ipc_reply(struct ipc_conn *c, const void *data, size_t size);
+
+void ipc_reply_fd(struct ipc_conn *c, const void *data, size_t size, int fd);
+
+int ipc_take_fd(struct ipc_conn *c);
+
+void ipc_stop(struct ipc_conn *c);
 
 int ipc_start_listener();
 
 /* client */
 int get_send_socket();
 
+int ipc_connect_send(struct message *m, size_t message_size);
+
+int ipc_request(
+		struct message *m, size_t message_size,
+		void *response_buffer, size_t response_size, int wait);
+
+int ipc_request_fd(
+		struct message *m, size_t message_size, int send_fd,
+		void *response_buffer, size_t response_size, int *recv_fd);
+
+int ipc_channel();
+
+uint32_t ipc_send(
+		struct message *m, size_t message_size, int send_fd, int want_reply);
+
+ssize_t ipc_read_reply(uint32_t *id, void *buf, size_t size, int *recv_fd);
+
 void notify(pid_t pid, int message_type);
 
 int query(
 		pid_t pid, int message_type, 
 		void *response_buffer, size_t response_size);
 
+#endif
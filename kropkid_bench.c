@@ -0,0 +1,512 @@
+#define _GNU_SOURCE
+
+#include "conf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * Headless load generator.  Opens pairs of telnet connections to a running
+ * kropkid, pairs them up through the host and join menus, plays random legal
+ * moves and reports connect, join and move latencies.
+ */
+
+/* a pair making no progress for this long counts as failed */
+#define BENCH_STALL_MS 10000
+
+enum BOT_STATE {
+	BOT_CONNECTING,
+	BOT_MENU,		/* waiting for the menu prompt */
+	BOT_READY,		/* at the menu, joiner waiting for the host's key */
+	BOT_HOSTING,	/* waiting for the status line with the key */
+	BOT_KEY_PROMPT,	/* waiting for the key prompt */
+	BOT_JOINING,	/* waiting for the status line */
+	BOT_PLAYING
+};
+
+struct bot {
+	int sock;
+	enum BOT_STATE state;
+	struct pair *pair;
+	int cur_y, cur_x;
+
+	/* the opponent has moved and this bot waits for the redraw */
+	int awaiting_redraw;
+
+	double connect_start;
+
+	/* recent input, searched for prompts */
+	char in[1024];
+	int in_len;
+};
+
+struct pair {
+	struct bot bots[2];	/* host, joiner */
+	int active;
+	char key[7];
+	int turn;			/* bot to move next */
+	int moves;
+	double next_move;	/* 0 while the bot to move awaits a redraw */
+	double move_sent, join_sent, progress;
+	char taken[MAP_WIDTH * MAP_HEIGHT];
+};
+
+struct samples {
+	double *v;
+	int count, size;
+};
+
+/* settings */
+const char *host = "127.0.0.1";
+int port = SRV_PORT;
+int concurrency = 50;
+int total_games = 500;
+int game_moves = 40;
+double move_rate = 0;
+
+int epfd;
+struct pair *pairs;
+int games_started = 0, games_done = 0, games_failed = 0;
+int connects = 0;
+struct samples connect_lat, join_lat, move_lat;
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void sample_add(struct samples *s, double v) {
+	if (s->count == s->size) {
+		int new_size = s->size ? s->size * 2 : 1024;
+		double *p = realloc(s->v, new_size * sizeof(double));
+		if (!p)
+			return;
+		s->v = p;
+		s->size = new_size;
+	}
+	s->v[s->count++] = v;
+}
+
+int compare_doubles(const void *a, const void *b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+void sample_report(const char *name, struct samples *s) {
+	if (!s->count) {
+		printf("%-14s no samples\n", name);
+		return;
+	}
+	qsort(s->v, s->count, sizeof(double), compare_doubles);
+	printf("%-14s n=%-7d p50 %8.3f ms  p90 %8.3f ms  p99 %8.3f ms  "
+			"max %8.3f ms\n", name, s->count,
+			s->v[s->count / 2] * 1e3,
+			s->v[(int)(s->count * 0.9)] * 1e3,
+			s->v[(int)(s->count * 0.99)] * 1e3,
+			s->v[s->count - 1] * 1e3);
+}
+
+int bot_send(struct bot *b, const char *s, size_t len) {
+	while (len > 0) {
+		ssize_t r = send(b->sock, s, len, MSG_NOSIGNAL);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		s += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/**
+ * Looks for text in the input received so far and drops the input up to its
+ * end.  Returns a pointer to the text following it, NULL if not found.
+ */
+char *bot_expect(struct bot *b, const char *text) {
+	char *p = memmem(b->in, b->in_len, text, strlen(text));
+	if (!p)
+		return 0;
+	p += strlen(text);
+	int left = b->in + b->in_len - p;
+	memmove(b->in, p, left);
+	b->in_len = left;
+	return b->in;
+}
+
+/**
+ * Looks for a status line without "Waiting for" after it, shown once it is
+ * the bot's turn, in the input received so far.  The input is dropped up to
+ * the status lines looked at.  Returns 1 if one was found, 0 otherwise.
+ */
+int bot_turn_shown(struct bot *b) {
+	/* the waiting message goes after the status line, the cursor never
+	   goes to that row */
+	static const char waiting[] = "\e[24;64H";
+	const int waiting_len = sizeof(waiting) - 1;
+	char *p;
+	while ((p = memmem(b->in, b->in_len, "r:Redraw ", 9))) {
+		char *end = b->in + b->in_len;
+		/* cursor position on large boards */
+		for (p += 9; p < end && ((*p >= '0' && *p <= '9') || *p == ','); p++)
+			;
+		int n = end - p < waiting_len ? end - p : waiting_len;
+		if (memcmp(p, waiting, n) == 0 && n < waiting_len)
+			/* the rest is still to come */
+			return 0;
+		int turn = memcmp(p, waiting, n) != 0;
+		memmove(b->in, p, end - p);
+		b->in_len = end - p;
+		if (turn)
+			return 1;
+	}
+	return 0;
+}
+
+int bot_connect(struct bot *b) {
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+		fprintf(stderr, "bench: bad address %s\n", host);
+		exit(1);
+	}
+
+	b->sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	if (b->sock == -1)
+		return -1;
+	int yes = 1;
+	setsockopt(b->sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	b->state = BOT_CONNECTING;
+	b->in_len = 0;
+	b->awaiting_redraw = 0;
+	b->connect_start = now();
+	if (connect(b->sock, (struct sockaddr*)&sa, sizeof(sa)) == -1 &&
+			errno != EINPROGRESS) {
+		close(b->sock);
+		b->sock = -1;
+		return -1;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = b;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, b->sock, &ev);
+}
+
+void pair_close(struct pair *p, int failed) {
+	int i;
+	for (i = 0; i < 2; i++)
+		if (p->bots[i].sock != -1) {
+			close(p->bots[i].sock);
+			p->bots[i].sock = -1;
+		}
+	p->active = 0;
+	if (failed)
+		games_failed++;
+	else
+		games_done++;
+}
+
+void pair_start(struct pair *p) {
+	memset(p, 0, sizeof(*p));
+	p->bots[0].sock = p->bots[1].sock = -1;
+	p->bots[0].pair = p->bots[1].pair = p;
+	p->active = 1;
+	p->progress = now();
+	games_started++;
+	if (bot_connect(&p->bots[0]) == -1 || bot_connect(&p->bots[1]) == -1)
+		pair_close(p, 1);
+}
+
+/**
+ * Moves the cursor of the bot to a random free field and places a dot.
+ * The joiner plays O and moves first.
+ */
+int pair_move(struct pair *p) {
+	struct bot *b = &p->bots[p->turn];
+	char keys[MAP_WIDTH + MAP_HEIGHT + 1];
+	int len = 0, cell, tries;
+
+	for (tries = 0; tries < 64; tries++) {
+		cell = rand() % (MAP_WIDTH * MAP_HEIGHT);
+		if (!p->taken[cell])
+			break;
+	}
+	if (tries == 64)
+		return -1;
+	p->taken[cell] = 1;
+
+	int y = cell / MAP_WIDTH, x = cell % MAP_WIDTH;
+	for (; b->cur_x < x; b->cur_x++) keys[len++] = 'l';
+	for (; b->cur_x > x; b->cur_x--) keys[len++] = 'h';
+	for (; b->cur_y < y; b->cur_y++) keys[len++] = 'j';
+	for (; b->cur_y > y; b->cur_y--) keys[len++] = 'k';
+	keys[len++] = ' ';
+
+	/* input so far is from before the move, it cannot be its redraw */
+	p->bots[0].in_len = p->bots[1].in_len = 0;
+
+	p->moves++;
+	p->turn = !p->turn;
+	p->next_move = 0;
+	p->bots[p->turn].awaiting_redraw = 1;
+	p->move_sent = now();
+	return bot_send(b, keys, len);
+}
+
+/**
+ * Advances the bot on new input.  Returns -1 if the pair has failed.
+ */
+int bot_input(struct bot *b) {
+	struct pair *p = b->pair;
+	struct bot *joiner = &p->bots[1];
+	int is_host = b == &p->bots[0];
+
+	switch (b->state) {
+		case BOT_MENU:
+			if (!bot_expect(b, "[q]uit? "))
+				return 0;
+			if (is_host) {
+				b->state = BOT_HOSTING;
+				return bot_send(b, "h", 1);
+			}
+			b->state = BOT_READY;
+			if (!p->key[0])
+				return 0;
+			/* the host's key is known already */
+		case BOT_READY:
+			if (!p->key[0])
+				return 0;
+			b->state = BOT_KEY_PROMPT;
+			return bot_send(b, "j", 1);
+		case BOT_HOSTING: {
+			char *key = bot_expect(b, "Game #");
+			if (!key || b->in_len < 6)
+				return 0;
+			memcpy(p->key, key, 6);
+			p->key[6] = 0;
+			b->state = BOT_PLAYING;
+			b->cur_y = MAP_HEIGHT / 2;
+			b->cur_x = MAP_WIDTH / 2;
+			if (joiner->state == BOT_READY)
+				return bot_input(joiner);
+			return 0;
+		}
+		case BOT_KEY_PROMPT:
+			if (!bot_expect(b, "game key: "))
+				return 0;
+			b->state = BOT_JOINING;
+			p->join_sent = now();
+			return bot_send(b, p->key, 6);
+		case BOT_JOINING:
+			if (!bot_expect(b, "Game #"))
+				return 0;
+			sample_add(&join_lat, now() - p->join_sent);
+			b->state = BOT_PLAYING;
+			b->cur_y = MAP_HEIGHT / 2;
+			b->cur_x = MAP_WIDTH / 2;
+			p->turn = 1;
+			p->next_move = now();
+			return 0;
+		case BOT_PLAYING:
+			if (!b->awaiting_redraw) {
+				b->in_len = 0;
+				return 0;
+			}
+			/* the bot's own frame may still arrive after the opponent's
+			   move, only the status line of its turn is the redraw */
+			if (bot_turn_shown(b)) {
+				double t = now();
+				b->awaiting_redraw = 0;
+				sample_add(&move_lat, t - p->move_sent);
+				p->next_move = t + (move_rate > 0 ? 1 / move_rate : 0);
+			}
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+void bot_event(struct bot *b, unsigned int events) {
+	struct pair *p = b->pair;
+	if (b->state == BOT_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(b->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err) {
+			pair_close(p, 1);
+			return;
+		}
+		sample_add(&connect_lat, now() - b->connect_start);
+		connects++;
+		b->state = BOT_MENU;
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = b;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, b->sock, &ev);
+		return;
+	}
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+
+	ssize_t r = recv(b->sock, b->in + b->in_len,
+			sizeof(b->in) - b->in_len, MSG_DONTWAIT);
+	if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR)) {
+		pair_close(p, 1);
+		return;
+	}
+	if (r > 0) {
+		b->in_len += r;
+		p->progress = now();
+	}
+	if (bot_input(b) == -1) {
+		pair_close(p, 1);
+		return;
+	}
+	/* keep the tail, a prompt may be split across reads */
+	if (b->in_len > (int)sizeof(b->in) / 2) {
+		memmove(b->in, b->in + b->in_len - 64, 64);
+		b->in_len = 64;
+	}
+}
+
+/**
+ * Waits for the server to accept connections, for up to 5 seconds
+ */
+int wait_for_server() {
+	int i;
+	for (i = 0; i < 50; i++) {
+		struct sockaddr_in sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(port);
+		inet_pton(AF_INET, host, &sa.sin_addr);
+		int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (sock == -1)
+			return -1;
+		int r = connect(sock, (struct sockaddr*)&sa, sizeof(sa));
+		close(sock);
+		if (r == 0)
+			return 0;
+		usleep(100000);
+	}
+	return -1;
+}
+
+void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [-H host] [-p port] [-c pairs] [-g games] [-m moves] "
+			"[-r rate]\n"
+			"  -H host   server address, default 127.0.0.1\n"
+			"  -p port   server port, default %d\n"
+			"  -c pairs  games played at the same time, default 50\n"
+			"  -g games  games to play in total, default 500\n"
+			"  -m moves  moves per game, default 40\n"
+			"  -r rate   moves per second of each player, 0 for no pause\n",
+			name, SRV_PORT);
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "H:p:c:g:m:r:")) != -1) {
+		switch (opt) {
+			case 'H': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'c': concurrency = atoi(optarg); break;
+			case 'g': total_games = atoi(optarg); break;
+			case 'm': game_moves = atoi(optarg); break;
+			case 'r': move_rate = atof(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (concurrency <= 0 || total_games <= 0 || game_moves <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (concurrency > total_games)
+		concurrency = total_games;
+
+	if (wait_for_server() == -1) {
+		fprintf(stderr, "bench: no server on %s:%d\n", host, port);
+		return 1;
+	}
+
+	epfd = epoll_create1(0);
+	pairs = calloc(concurrency, sizeof(struct pair));
+	if (epfd == -1 || !pairs) {
+		perror("bench");
+		return 1;
+	}
+	srand(time(0));
+
+	double start = now();
+	int i;
+	for (i = 0; i < concurrency; i++)
+		pair_start(&pairs[i]);
+
+	struct epoll_event events[64];
+	while (games_done + games_failed < total_games) {
+		/* sleep until the earliest scheduled move */
+		double t = now(), wake = t + 0.1;
+		for (i = 0; i < concurrency; i++)
+			if (pairs[i].active && pairs[i].next_move &&
+					pairs[i].next_move < wake)
+				wake = pairs[i].next_move;
+		int timeout = (wake - t) * 1000;
+		if (timeout < 0)
+			timeout = 0;
+
+		int n = epoll_wait(epfd, events, 64, timeout);
+		if (n == -1 && errno != EINTR) {
+			perror("bench: epoll_wait");
+			return 1;
+		}
+		for (i = 0; i < n; i++) {
+			struct bot *b = events[i].data.ptr;
+			if (b->pair->active && b->sock != -1)
+				bot_event(b, events[i].events);
+		}
+
+		t = now();
+		for (i = 0; i < concurrency; i++) {
+			struct pair *p = &pairs[i];
+			if (p->active && p->next_move && p->next_move <= t) {
+				if (p->moves >= game_moves)
+					pair_close(p, 0);
+				else if (pair_move(p) == -1)
+					pair_close(p, 1);
+				else
+					p->progress = t;
+			}
+			if (p->active && t - p->progress > BENCH_STALL_MS / 1000.0)
+				pair_close(p, 1);
+			if (!p->active && games_started < total_games)
+				pair_start(p);
+		}
+	}
+	double elapsed = now() - start;
+
+	printf("games          %d played, %d failed in %.2f s\n",
+			games_done, games_failed, elapsed);
+	printf("connects/sec   %.1f\n", connects / elapsed);
+	printf("moves/sec      %.1f\n", move_lat.count / elapsed);
+	sample_report("connect", &connect_lat);
+	sample_report("join", &join_lat);
+	sample_report("move->redraw", &move_lat);
+	return games_failed ? 1 : 0;
+}
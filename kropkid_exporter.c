@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+
+#include "conf.h"
+#include "game_manager.h"
+#include "ipc_message.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * Serves the statistics of a running manager in the Prometheus text format.
+ * Every HTTP request on the port gets the current values, whatever its path.
+ */
+
+/* label values of the message types, by enum MESSAGE_TYPE */
+static const char *message_names[MSG_TYPE_COUNT] = {
+	[MSG_IDLE] = "idle",
+	[MSG_GAME_SLOT_QUERY] = "game_slot_query",
+	[MSG_SESSION_QUIT] = "session_quit",
+	[MSG_JOIN] = "join",
+	[MSG_OPPONENT_POKE_QUERY] = "opponent_poke_query",
+	[MSG_STATS] = "stats",
+	[MSG_SPECTATE] = "spectate",
+	[MSG_HANDOFF] = "handoff",
+	[MSG_MATCH] = "match",
+	[MSG_MATCH_CANCEL] = "match_cancel",
+	[MSG_BOT] = "bot",
+	[MSG_BOT_GAME_QUERY] = "bot_game_query",
+	[MSG_BOT_REPORT] = "bot_report"
+};
+
+void write_metric(FILE *out, const char *name, const char *type,
+		const char *help)
+{
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Writes the statistics as metrics
+ */
+void write_stats(FILE *out, const struct manager_stats *s) {
+	write_metric(out, "kropkid_up", "gauge",
+			"Whether the manager answered");
+	fputs("kropkid_up 1\n", out);
+
+	write_metric(out, "kropkid_games", "gauge", "Games by state");
+	fprintf(out, "kropkid_games{state=\"waiting\"} %u\n", s->games_waiting);
+	fprintf(out, "kropkid_games{state=\"active\"} %u\n", s->games_active);
+	fprintf(out, "kropkid_games{state=\"orphaned\"} %u\n", s->games_orphaned);
+
+	write_metric(out, "kropkid_sessions", "gauge", "Sessions in a game");
+	fprintf(out, "kropkid_sessions %u\n", s->sessions);
+
+	write_metric(out, "kropkid_sessions_matching", "gauge",
+			"Sessions waiting in the quick-match queue");
+	fprintf(out, "kropkid_sessions_matching %u\n", s->sessions_matching);
+
+	write_metric(out, "kropkid_arena_slots_used", "gauge",
+			"Arena slots holding a game");
+	fprintf(out, "kropkid_arena_slots_used %u\n", s->arena_in_use);
+	write_metric(out, "kropkid_arena_slots", "gauge", "Arena slots in total");
+	fprintf(out, "kropkid_arena_slots %u\n", s->arena_slots);
+
+	write_metric(out, "kropkid_games_created_total", "counter",
+			"Games hosted");
+	fprintf(out, "kropkid_games_created_total %llu\n",
+			(unsigned long long)s->games_created);
+	write_metric(out, "kropkid_games_rejected_total", "counter",
+			"Games refused for lack of room");
+	fprintf(out, "kropkid_games_rejected_total %llu\n",
+			(unsigned long long)s->games_rejected);
+
+	write_metric(out, "kropkid_joins_total", "counter",
+			"Join attempts by result");
+	fprintf(out, "kropkid_joins_total{result=\"ok\"} %llu\n",
+			(unsigned long long)s->joins);
+	fprintf(out, "kropkid_joins_total{result=\"failed\"} %llu\n",
+			(unsigned long long)s->joins_failed);
+
+	write_metric(out, "kropkid_matches_total", "counter",
+			"Games started from the quick-match queue");
+	fprintf(out, "kropkid_matches_total %llu\n",
+			(unsigned long long)s->matches);
+
+	write_metric(out, "kropkid_bot_games", "gauge",
+			"Games against the computer player");
+	fprintf(out, "kropkid_bot_games %u\n", s->bot_games);
+	write_metric(out, "kropkid_bot_moves_total", "counter",
+			"Moves made by the computer player");
+	fprintf(out, "kropkid_bot_moves_total %llu\n",
+			(unsigned long long)s->bot_moves);
+	write_metric(out, "kropkid_bot_playouts_total", "counter",
+			"Playouts of the computer player's searches");
+	fprintf(out, "kropkid_bot_playouts_total %llu\n",
+			(unsigned long long)s->bot_playouts);
+	write_metric(out, "kropkid_bot_search_seconds_total", "counter",
+			"Time the computer player has spent searching");
+	fprintf(out, "kropkid_bot_search_seconds_total %.9f\n",
+			s->bot_search_ns / 1e9);
+
+	write_metric(out, "kropkid_ipc_handler_seconds", "histogram",
+			"Time the manager took to handle a message, by type");
+	int i, b;
+	for (i = 0; i < MSG_TYPE_COUNT; i++) {
+		const struct handler_stats *h = &s->messages[i];
+		unsigned long long cumulative = 0;
+		for (b = 0; b < IPC_LATENCY_BUCKETS - 1; b++) {
+			cumulative += h->latency[b];
+			fprintf(out, "kropkid_ipc_handler_seconds_bucket"
+					"{type=\"%s\",le=\"%g\"} %llu\n", message_names[i],
+					(1 << b) / 1e6, cumulative);
+		}
+		fprintf(out, "kropkid_ipc_handler_seconds_bucket"
+				"{type=\"%s\",le=\"+Inf\"} %llu\n", message_names[i],
+				(unsigned long long)h->calls);
+		fprintf(out, "kropkid_ipc_handler_seconds_sum{type=\"%s\"} %.9f\n",
+				message_names[i], h->nsec / 1e9);
+		fprintf(out, "kropkid_ipc_handler_seconds_count{type=\"%s\"} %llu\n",
+				message_names[i], (unsigned long long)h->calls);
+	}
+}
+
+/**
+ * Answers one HTTP request with the current statistics
+ */
+void serve_client(int sock) {
+	/* the request itself does not matter, read its head and go on */
+	char req[1024];
+	size_t len = 0;
+	while (len < sizeof(req) - 1) {
+		ssize_t r = recv(sock, req + len, sizeof(req) - 1 - len, 0);
+		if (r <= 0)
+			break;
+		len += r;
+		req[len] = 0;
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+
+	char *body = 0, *head = 0;
+	size_t body_len = 0, head_len = 0;
+	FILE *out = open_memstream(&body, &body_len);
+	if (!out)
+		return;
+	struct manager_stats s;
+	if (get_manager_stats(&s) == -1) {
+		write_metric(out, "kropkid_up", "gauge",
+				"Whether the manager answered");
+		fputs("kropkid_up 0\n", out);
+	} else
+		write_stats(out, &s);
+	fclose(out);
+
+	out = open_memstream(&head, &head_len);
+	if (out) {
+		fprintf(out, "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %zu\r\n"
+				"Connection: close\r\n\r\n", body_len);
+		fclose(out);
+		if (send(sock, head, head_len, MSG_NOSIGNAL) == head_len)
+			send(sock, body, body_len, MSG_NOSIGNAL);
+	}
+	free(head);
+	free(body);
+}
+
+void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [-p port]\n"
+			"  -p port  port to serve on at 127.0.0.1, default %d\n",
+			name, EXPORTER_PORT);
+}
+
+int main(int argc, char *argv[]) {
+	int port = EXPORTER_PORT, opt;
+	while ((opt = getopt(argc, argv, "p:")) != -1) {
+		switch (opt) {
+			case 'p': port = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock == -1) {
+		perror("exporter: socket");
+		return 1;
+	}
+	int yes = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sock, (struct sockaddr*)&sa, sizeof(sa)) == -1 ||
+			listen(sock, 16) == -1) {
+		perror("exporter: bind");
+		return 1;
+	}
+	DBG(2, "Exporting statistics on port %d\n", port);
+
+	for (;;) {
+		int client = accept(sock, 0, 0);
+		if (client == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("exporter: accept");
+			return 1;
+		}
+		/* a stalled scraper must not hold up the others for long */
+		struct timeval timeout = { 1, 0 };
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		serve_client(client);
+		close(client);
+	}
+}
@@ -0,0 +1,137 @@
+#include "conf.h"
+#include "record.h"
+#include "rules.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Reads a game record written by kropkid -g, prints what it holds and the
+ * board at a move, and times seeking in it.
+ */
+
+/* seeks timed with -s */
+#define REPLAY_SEEKS 1000
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Prints the part of the board holding dots, X and O for dots, x and o for
+ * captured ones, - for enclosed empty fields
+ */
+static void print_board(const struct record_board *b) {
+	int top = MAP_HEIGHT, left = MAP_WIDTH, bottom = 0, right = 0, y, x, i;
+	for (i = 0; i < 2; i++) {
+		if (b->bounds[i].bottom <= b->bounds[i].top)
+			continue;
+		top = b->bounds[i].top < top ? b->bounds[i].top : top;
+		left = b->bounds[i].left < left ? b->bounds[i].left : left;
+		bottom = b->bounds[i].bottom > bottom ? b->bounds[i].bottom : bottom;
+		right = b->bounds[i].right > right ? b->bounds[i].right : right;
+	}
+	if (bottom <= top) {
+		puts("(empty board)");
+		return;
+	}
+	printf("rows %d-%d, columns %d-%d\n", top, bottom - 1, left, right - 1);
+	for (y = top; y < bottom; y++) {
+		for (x = left; x < right; x++) {
+			char field = b->map[CELL(y, x)];
+			if ((field & PLAYER) == 0)
+				putchar(field & DISABLED ? '-' : '.');
+			else if (field & DISABLED)
+				putchar((field & PLAYER) == 1 ? 'x' : 'o');
+			else
+				putchar((field & PLAYER) == 1 ? 'X' : 'O');
+		}
+		putchar('\n');
+	}
+}
+
+void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [-m move] [-q] [-s] file\n"
+			"  -m move  show the board after this many moves, default the last\n"
+			"  -q       do not print the board\n"
+			"  -s       time %d seeks to random moves\n",
+			name, REPLAY_SEEKS);
+}
+
+int main(int argc, char *argv[]) {
+	long move = -1;
+	int quiet = 0, seeks = 0, opt;
+	while ((opt = getopt(argc, argv, "m:qs")) != -1) {
+		switch (opt) {
+			case 'm': move = atol(optarg); break;
+			case 'q': quiet = 1; break;
+			case 's': seeks = REPLAY_SEEKS; break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	uint64_t start = now_ns();
+	struct replay *r = replay_open(argv[optind]);
+	if (!r) {
+		fprintf(stderr, "%s: not a record of a %dx%d board\n",
+				argv[optind], MAP_WIDTH, MAP_HEIGHT);
+		return 1;
+	}
+	uint64_t opened = now_ns();
+
+	struct record_header h;
+	memcpy(&h, r->data, sizeof(h));
+	time_t started = h.started;
+	printf("Game #%s, recorded from %s", r->key, ctime(&started));
+	printf("Moves %u-%u, %u checkpoints, %zu bytes",
+			r->first, r->moves, r->checkpoint_count, r->size);
+	if (r->moves > r->first)
+		printf(", %.1f bytes/move",
+				(double)(r->size - sizeof(h)) / (r->moves - r->first));
+	printf("\nOpened in %.3f ms\n", (opened - start) / 1e6);
+
+	if (move < 0)
+		move = r->moves;
+	start = now_ns();
+	if (replay_seek(r, move) == -1) {
+		fprintf(stderr, "%s: damaged record\n", argv[optind]);
+		return 1;
+	}
+	printf("Seek to move %u in %.3f ms\n", r->board.moves,
+			(now_ns() - start) / 1e6);
+	printf("Score X %u/%u/%u, O %u/%u/%u dots/captured/enclosed\n",
+			r->board.score.dots[0], r->board.score.captured[0],
+			r->board.score.enclosed[0], r->board.score.dots[1],
+			r->board.score.captured[1], r->board.score.enclosed[1]);
+	if (!quiet)
+		print_board(&r->board);
+
+	if (seeks > 0) {
+		int i;
+		uint64_t worst = 0;
+		srand(1);
+		start = now_ns();
+		for (i = 0; i < seeks; i++) {
+			uint64_t t = now_ns();
+			replay_seek(r, r->first + rand() % (r->moves - r->first + 1));
+			t = now_ns() - t;
+			worst = t > worst ? t : worst;
+		}
+		printf("%d random seeks: %.3f ms on average, %.3f ms at most\n",
+				seeks, (now_ns() - start) / 1e6 / seeks, worst / 1e6);
+	}
+	replay_close(r);
+	return 0;
+}
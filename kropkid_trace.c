@@ -0,0 +1,80 @@
+#include "conf.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Decodes trace dumps written by trace_dump into one line per record:
+ * seconds since the first record, thread, event and its arguments.
+ */
+
+int decode(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	struct trace_file_header h;
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+			memcmp(h.magic, TRACE_MAGIC, 4) != 0 ||
+			h.version != TRACE_VERSION ||
+			h.record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s: not a trace dump of this version\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	time_t start = 0;
+	uint64_t first_ns = 0;
+	uint32_t expected = 0, i;
+	printf("# pid %u, %u records\n", h.pid, h.count);
+	for (i = 0; i < h.count; i++) {
+		struct trace_record r;
+		if (fread(&r, sizeof(r), 1, f) != 1) {
+			fprintf(stderr, "%s: truncated\n", path);
+			break;
+		}
+		if (i == 0) {
+			first_ns = r.ns;
+			start = (r.ns + h.realtime_offset_ns) / 1000000000ull;
+			printf("# first record at %s", ctime(&start));
+		}
+
+		/* records overwritten or half written while the ring was dumped */
+		if (i > 0 && r.seq != expected)
+			printf("# sequence gap, %u -> %u\n", expected, r.seq);
+		expected = r.seq + 1;
+		if (r.seq == 0 || r.event >= TRACE_EVENT_COUNT) {
+			printf("# incomplete record\n");
+			continue;
+		}
+
+		const struct trace_event_info *e = &trace_events[r.event];
+		printf("%12.6f t%-3u %-20s", (r.ns - first_ns) / 1e9,
+				r.thread, e->name);
+		int a;
+		for (a = 0; a < 3; a++)
+			if (e->args[a])
+				printf(" %s=%d", e->args[a], r.args[a]);
+		printf("\n");
+	}
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s dump...\n"
+				"Dumps are written to %s.<pid> on SIGUSR2 and when the "
+				"manager or listener exits.\n", argv[0], TRACE_PATH);
+		return 1;
+	}
+	int i, ret = 0;
+	for (i = 1; i < argc; i++)
+		if (decode(argv[i]) == -1)
+			ret = 1;
+	return ret;
+}
@@ -1,5 +1,15 @@
 #include "conf.h"
+#include "arena.h"
+#include "bitboard.h"
+#include "bot.h"
+#include "event_server.h"
 #include "game_manager.h"
+#include "handoff.h"
+#include "mcts.h"
+#include "prefork.h"
+#include "record.h"
+#include "rules.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +17,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -19,27 +30,148 @@ void telnet_session(int sock);
 
 pid_t manager_pid;
 
+/* telnet listening socket of the fork and event modes */
+int listen_sock = -1;
+int event_instance;
+
+volatile sig_atomic_t hangup = 0;
+
 void at_listener_exit() {
 	int manager_ret_val;
+	/* the manager and its socket belong to the upgraded server */
+	if (handed_off)
+		exit(0);
 	kill(manager_pid, SIGTERM);
 	waitpid(manager_pid, &manager_ret_val, 0);
 	unlink(MGR_SOCKET);
+	trace_dump();
 	write(0, "Session manager terminated. Listener terminating.\n", 50);
 	exit(0);
 }
 
+void at_hangup(int sig) {
+	hangup = 1;
+}
+
+/**
+ * Upgrades an event mode server on SIGHUP, see handoff_start()
+ */
+int event_hangup() {
+	handoff_reserve(event_instance);
+	return handoff_start(&listen_sock, 1);
+}
+
+/**
+ * Raises the limit on open files as far as allowed.  The manager holds the
+ * eventfds of both players of every game, and a channel to every session
+ * process or event server worker, which soon exceeds the usual soft limit.
+ */
+void raise_file_limit() {
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return;
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+			perror("setrlimit");
+	}
+	if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < 2 * ARENA_SLOTS)
+		DBG(1, "Open files limited to %lu, games may fail to start\n",
+				(unsigned long)rl.rlim_cur);
+}
+
+void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [-b threads] [-c engine] [-e] [-f file] [-g dir] "
+			"[-p processes] [-r sessions] [-w workers]\n"
+			"  -b threads    search threads of the computer player, 0 for half\n"
+			"                the cores, -1 to play without it\n"
+			"  -c engine     capture engine, search or bitboard (boards of one\n"
+			"                tile up to 128 wide), default %s\n"
+			"  -e            serve all connections from one event-driven process\n"
+			"  -f file       keep games in this file, so they survive a restart\n"
+			"  -g dir        record every game to a file in this directory, to\n"
+			"                be replayed from the menu or with kropkid_replay\n"
+			"  -p processes  serve connections from a pool of event-driven\n"
+			"                processes, 0 for one per core\n"
+			"  -r sessions   replace a pool process after this many sessions,\n"
+			"                0 for never, default %d\n"
+			"  -w workers    worker threads of each event-driven process, default\n"
+			"                one per core in event mode and one in a pool\n"
+			"Send SIGHUP to the first process to upgrade to the binary at the\n"
+			"same path without dropping games.\n",
+			name, rules_engine ? "bitboard" : "search", PREFORK_MAX_SESSIONS);
+}
+
 /**
  * The root process spawns the game manager process and listens for telnet
- * connections.
+ * connections.  By default every connection gets its own session process, in
+ * event mode they are multiplexed over a fixed set of worker threads.  In
+ * prefork mode a pool of event-driven processes accepts on its own sockets.
+ * On SIGHUP it hands everything over to a new instance of its binary and
+ * exits once its sessions have.
  */
-int main() {
+int main(int argc, char *argv[]) {
+	int event_mode = 0, event_workers = -1;
+	int prefork_workers = -1, prefork_sessions = PREFORK_MAX_SESSIONS;
+	const char *arena_path = 0;
+	int opt;
+#if BITBOARD_FITS
+	/* before -c, and before any thread places dots */
+	bb_init();
+#endif
+	while ((opt = getopt(argc, argv, "b:c:ef:g:p:r:w:")) != -1) {
+		switch (opt) {
+			case 'b':
+				bot_threads = atoi(optarg); break;
+			case 'c':
+				if (rules_use_engine(optarg) == -1) {
+					fprintf(stderr, "Unknown capture engine %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'e':
+				event_mode = 1; break;
+			case 'f':
+				arena_path = optarg; break;
+			case 'g':
+				record_dir = optarg; break;
+			case 'p':
+				prefork_workers = atoi(optarg); break;
+			case 'r':
+				prefork_sessions = atoi(optarg); break;
+			case 'w':
+				event_workers = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	raise_file_limit();
+
+	/* started by a server being upgraded, see handoff_start() */
+	struct handoff handoff;
+	int handoff_fds[HANDOFF_MAX_FDS];
+	int handed_over = handoff_receive(&handoff, handoff_fds);
+	if (handed_over == -1)
+		return 1;
+
 	struct stat usock_stat;
-	if (stat(MGR_SOCKET, &usock_stat) != -1) {
-		if (S_ISSOCK(usock_stat.st_mode))
-			fputs("kropkid is already running\n", stderr);
-		else
+	if (!handed_over && stat(MGR_SOCKET, &usock_stat) != -1) {
+		int sock = -1;
+		if (!S_ISSOCK(usock_stat.st_mode)) {
 			fputs("socket file exists\n", stderr);
-		return 1;
+			return 1;
+		} else if ((sock = get_send_socket()) != -1 || errno != ECONNREFUSED) {
+			fputs("kropkid is already running\n", stderr);
+			if (sock != -1)
+				close(sock);
+			return 1;
+		}
+		/* left behind by a server that crashed */
+		DBG(1, "Removing stale socket %s\n", MGR_SOCKET);
+		unlink(MGR_SOCKET);
 	}
 
 	DBG(2, "Root PID: %d\n", getpid());
@@ -47,33 +179,104 @@ int main() {
 	signal(SIGINT, at_listener_exit);
 	signal(SIGTERM, at_listener_exit);
 
-	manager_pid = run_manager();
+	trace_init();
+
+	/* shared by the manager and all sessions, and handed over on upgrades */
+	int manager_sock;
+	if (handed_over) {
+		if (arena_attach(handoff_fds[0], handoff.arena_slots,
+					handoff.arena_in_file) == -1)
+			return 1;
+		manager_sock = handoff_fds[1];
+	} else {
+		if (arena_init(ARENA_SLOTS, arena_path) == -1)
+			return 1;
+		manager_sock = ipc_start_listener();
+		if (manager_sock == -1) {
+			perror("session manager: ipc_start_listener");
+			return 1;
+		}
+	}
+	handoff_init(argv, manager_sock);
+
+	/* the computer player copies the board for every playout, which only
+	   pays off on small ones */
+	manager_pid = run_manager(manager_sock, handed_over,
+			(MCTS_FITS && bot_threads >= 0) ? start_bot : 0);
 	if (manager_pid == -1) {
-		perror("manager fork");
+		fputs("session manager did not start\n", stderr);
 		return 1;
 	}
+	handoff_done();
+
+	if (prefork_workers >= 0) {
+		if (run_prefork(prefork_workers,
+					event_workers >= 0 ? event_workers : 1,
+					prefork_sessions > 0 ? prefork_sessions : 0,
+					handoff_fds + 2,
+					handed_over ? handoff.listener_count : 0) == -1)
+			perror("prefork");
+		at_listener_exit();
+	}
 
 	struct sockaddr_in sa, sr;
 	socklen_t addrsize = sizeof(sr);
-	memset(&sa, 0, sizeof(sa));
-	int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sock == -1) return 1;
-	int yes = 1;
-	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-		perror("listener: setsockopt"); return 1; }
-	sa.sin_family = AF_INET;
-	sa.sin_port = htons(SRV_PORT);
-	sa.sin_addr.s_addr = INADDR_ANY;
-	if (bind(sock, (struct sockaddr*)&sa, sizeof(sa)) == -1) { perror("listener: bind"); return 1; }
-	if (listen(sock, 5) == -1) return 1;
+	int sock;
+	if (handed_over && handoff.listener_count > 0)
+		sock = handoff_fds[2];
+	else {
+		memset(&sa, 0, sizeof(sa));
+		sock = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+		if (sock == -1) return 1;
+		int yes = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+			perror("listener: setsockopt"); return 1; }
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(SRV_PORT);
+		sa.sin_addr.s_addr = INADDR_ANY;
+		if (bind(sock, (struct sockaddr*)&sa, sizeof(sa)) == -1) { perror("listener: bind"); return 1; }
+		if (listen(sock, event_mode ? SOMAXCONN : 5) == -1) return 1;
+	}
+	listen_sock = sock;
+
+	if (event_mode) {
+		struct event_server_options opt;
+		opt.workers = event_workers >= 0 ? event_workers : EVENT_WORKERS;
+		/* sessions of an earlier server may still be using an instance */
+		for (opt.instance = 0; opt.instance < EVENT_INSTANCES - 1 &&
+				handoff_reserved(opt.instance); opt.instance++)
+			;
+		event_instance = opt.instance;
+		opt.max_sessions = 0;
+		opt.retire = 0;
+		opt.hangup = event_hangup;
+		if (run_event_server(sock, &opt) == -1)
+			perror("event server");
+		at_listener_exit();
+	}
+
+	struct sigaction hup;
+	memset(&hup, 0, sizeof(hup));
+	hup.sa_handler = at_hangup;
+	sigaction(SIGHUP, &hup, 0);
+
 	// signal(SIGCHLD, SIG_IGN);
 	for(;;) {
 		int in_sock = accept(sock, (struct sockaddr*)&sr, &addrsize);
-		if (in_sock == -1) { perror("listener: accept"); return 1; }
+		if (in_sock == -1) {
+			if (errno != EINTR) { perror("listener: accept"); return 1; }
+			if (hangup) {
+				hangup = 0;
+				if (handoff_start(&sock, 1) == 0)
+					break;
+			}
+			continue;
+		}
 		int pid = fork();
 		if (pid == 0) {
 			signal(SIGINT, SIG_DFL);
 			signal(SIGTERM, SIG_DFL);
+			signal(SIGHUP, SIG_DFL);
 			telnet_session(in_sock);
 			close(in_sock);
 			return 0;
@@ -82,6 +285,8 @@ int main() {
 	}
 	close(sock);
 
-	at_listener_exit();
+	/* the upgraded server accepts from now on, sessions finish here */
+	while (wait(0) != -1 || errno == EINTR)
+		;
 	return 0;
 }
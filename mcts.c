@@ -0,0 +1,401 @@
+#include "conf.h"
+#include "mcts.h"
+#include "trace.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Monte Carlo tree search for the computer player.  Every thread grows a tree
+ * of its own from the same position until the time is up, and the move
+ * played is the one the threads have visited most together.  Playouts go on
+ * from the leaves of the tree with random moves near the dots, and are won by
+ * the player who has captured more dots by their end.
+ */
+
+/* candidate moves are the free fields at most this far from a dot */
+#define MCTS_REACH 2
+
+/* random moves of a playout after leaving the tree */
+#define MCTS_PLAYOUT_MOVES 24
+
+/* nodes in the tree of each thread */
+#define MCTS_NODES (1 << 18)
+
+/* exploration constant of UCT, results being between 0 and 1 */
+#define MCTS_EXPLORE 0.7
+
+/* playouts between looks at the clock */
+#define MCTS_CLOCK_EVERY 32
+
+#define IS_WALL(v, own_player) \
+	((((v) & PLAYER) == (own_player)) && !((v) & DISABLED))
+
+/**
+ * Private copy of the board a playout is run on.  Only the map and the
+ * bounds of the dots are kept, so copying a position costs little more than
+ * copying the map.
+ */
+struct position {
+	char map[MAP_CELLS];
+	struct dot_bounds bounds[2];
+
+	/* dots captured by each player since the start of the search */
+	int captured[2];
+};
+
+struct mcts_node {
+	/* field of the move leading here */
+	int cell;
+
+	/* first child and number of children, none until expanded */
+	int children, child_count;
+
+	uint32_t visits;
+
+	/* sum of the results for the player who made the move */
+	float wins;
+};
+
+struct mcts_thread {
+	pthread_t thread;
+	int started;
+
+	/* shared by all threads, read only */
+	const struct position *root;
+	const int *candidates;
+	int candidate_count;
+	char player;
+	uint64_t deadline;
+
+	struct mcts_node *nodes;
+	int node_count;
+	uint32_t rng;
+	uint64_t playouts;
+};
+
+/*
+ * Fields seen by the fills of a thread are marked with a stamp instead of
+ * being flagged on the map, so nothing needs clearing between moves.  Each
+ * fill takes a new stamp.
+ */
+static __thread uint32_t fill_mark[MAP_CELLS];
+static __thread uint32_t fill_stamp;
+static __thread int fill_stack[MAP_CELLS];
+static __thread int fill_area[MAP_CELLS];
+
+static uint64_t mcts_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t mcts_random(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/**
+ * Counterpart of process_neighbour() in rules.c on a private position.
+ * Disables the area of the field unless it reaches the edge of the player's
+ * bounds or an area found open since the stamp first, which the other fills
+ * of the same move have taken.
+ */
+static void mcts_fill(struct position *p, int y, int x, char player,
+		uint32_t first)
+{
+	static const int dy[4] = { 0, 0, -1, 1 };
+	static const int dx[4] = { -1, 1, 0, 0 };
+	const struct dot_bounds *b = &p->bounds[player - 1];
+	int cell = CELL(y, x), top = 0, count = 0, i;
+
+	if (IS_WALL(p->map[cell], player) || fill_mark[cell] >= first)
+		return;
+
+	uint32_t stamp = ++fill_stamp;
+	fill_mark[cell] = stamp;
+	fill_stack[top++] = cell;
+	fill_area[count++] = cell;
+	while (top > 0) {
+		int cur = fill_stack[--top], cy = CELL_Y(cur), cx = CELL_X(cur);
+		if (cy <= b->top || cy >= b->bottom - 1 ||
+				cx <= b->left || cx >= b->right - 1)
+			return;
+
+		for (i = 0; i < 4; i++) {
+			int next = CELL(cy + dy[i], cx + dx[i]);
+			if (IS_WALL(p->map[next], player) || fill_mark[next] == stamp)
+				continue;
+			if (fill_mark[next] >= first)
+				return;
+			fill_mark[next] = stamp;
+			fill_stack[top++] = next;
+			fill_area[count++] = next;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		char v = p->map[fill_area[i]];
+		if (v & DISABLED)
+			continue;
+		if (v & PLAYER)
+			p->captured[player - 1]++;
+		p->map[fill_area[i]] = (v & PLAYER) | DISABLED;
+	}
+}
+
+/**
+ * Places a dot on the position and disables the areas it closes
+ */
+static void mcts_play(struct position *p, int cell, char player) {
+	int y = CELL_Y(cell), x = CELL_X(cell);
+
+	/* keep the stamps of a move from wrapping around */
+	if (fill_stamp > UINT32_MAX - 8) {
+		memset(fill_mark, 0, sizeof(fill_mark));
+		fill_stamp = 0;
+	}
+	uint32_t first = fill_stamp + 1;
+
+	p->map[cell] = player;
+	dot_bounds_add(&p->bounds[player - 1], y, x);
+	if (x > 0)
+		mcts_fill(p, y, x - 1, player, first);
+	if (x < MAP_WIDTH - 1)
+		mcts_fill(p, y, x + 1, player, first);
+	if (y > 0)
+		mcts_fill(p, y - 1, x, player, first);
+	if (y < MAP_HEIGHT - 1)
+		mcts_fill(p, y + 1, x, player, first);
+}
+
+/**
+ * Lists the free fields near the dots in cand, which must have room for
+ * MAP_CELLS fields.  On a board without dots that is the centre.
+ * Returns the number of fields listed.
+ */
+static int mcts_candidates(const char *map, int *cand) {
+	static __thread char near[MAP_CELLS];
+	int y, x, i, j, count = 0;
+
+	memset(near, 0, sizeof(near));
+	for (y = 0; y < MAP_HEIGHT; y++)
+		for (x = 0; x < MAP_WIDTH; x++) {
+			if (!(map[CELL(y, x)] & PLAYER))
+				continue;
+			for (i = y - MCTS_REACH; i <= y + MCTS_REACH; i++)
+				for (j = x - MCTS_REACH; j <= x + MCTS_REACH; j++)
+					if (i >= 0 && i < MAP_HEIGHT && j >= 0 && j < MAP_WIDTH)
+						near[CELL(i, j)] = 1;
+		}
+
+	for (y = 0; y < MAP_HEIGHT; y++)
+		for (x = 0; x < MAP_WIDTH; x++)
+			if (near[CELL(y, x)] && map[CELL(y, x)] == 0)
+				cand[count++] = CELL(y, x);
+
+	if (count == 0 && map[CELL(MAP_HEIGHT / 2, MAP_WIDTH / 2)] == 0)
+		cand[count++] = CELL(MAP_HEIGHT / 2, MAP_WIDTH / 2);
+	return count;
+}
+
+/**
+ * Adds a child for every candidate move still free on the position.
+ * Returns the number of children, 0 if the tree is full.
+ */
+static int mcts_expand(struct mcts_thread *t, int node,
+		const struct position *p)
+{
+	int i, first = t->node_count;
+	if (t->node_count + t->candidate_count > MCTS_NODES)
+		return 0;
+	for (i = 0; i < t->candidate_count; i++) {
+		int cell = t->candidates[i];
+		if (p->map[cell] != 0)
+			continue;
+		struct mcts_node *n = &t->nodes[t->node_count++];
+		n->cell = cell;
+		n->children = n->child_count = 0;
+		n->visits = 0;
+		n->wins = 0;
+	}
+	t->nodes[node].children = first;
+	t->nodes[node].child_count = t->node_count - first;
+	return t->nodes[node].child_count;
+}
+
+/**
+ * Returns the child to descend to, by UCT.  Children not visited yet go
+ * first.
+ */
+static int mcts_select(const struct mcts_thread *t, int node) {
+	const struct mcts_node *parent = &t->nodes[node];
+	double log_visits = log(parent->visits + 1), best_value = -1;
+	int best = parent->children, i;
+	for (i = 0; i < parent->child_count; i++) {
+		const struct mcts_node *n = &t->nodes[parent->children + i];
+		if (n->visits == 0)
+			return parent->children + i;
+		double value = n->wins / n->visits +
+			MCTS_EXPLORE * sqrt(log_visits / n->visits);
+		if (value > best_value) {
+			best_value = value;
+			best = parent->children + i;
+		}
+	}
+	return best;
+}
+
+/**
+ * Plays random candidate moves on the position
+ */
+static void mcts_playout(struct mcts_thread *t, struct position *p,
+		char to_move)
+{
+	static __thread int moves[MAP_CELLS];
+	int n = t->candidate_count, played = 0;
+	memcpy(moves, t->candidates, n * sizeof(int));
+	while (played < MCTS_PLAYOUT_MOVES && n > 0) {
+		int k = mcts_random(&t->rng) % n, cell = moves[k];
+		moves[k] = moves[--n];
+		if (p->map[cell] != 0)
+			continue;
+		mcts_play(p, cell, to_move);
+		to_move = 3 - to_move;
+		played++;
+	}
+}
+
+static void *mcts_thread_main(void *arg) {
+	struct mcts_thread *t = arg;
+	static __thread struct position pos;
+	static __thread int path[MAP_CELLS + 2];
+
+	t->nodes[0].cell = -1;
+	t->nodes[0].visits = 0;
+	t->nodes[0].wins = 0;
+	t->node_count = 1;
+	mcts_expand(t, 0, t->root);
+
+	while (t->playouts % MCTS_CLOCK_EVERY || mcts_clock() < t->deadline) {
+		char to_move = t->player;
+		int node = 0, depth = 0, i;
+		memcpy(&pos, t->root, sizeof(pos));
+		path[depth++] = 0;
+
+		while (t->nodes[node].child_count > 0) {
+			node = mcts_select(t, node);
+			mcts_play(&pos, t->nodes[node].cell, to_move);
+			to_move = 3 - to_move;
+			path[depth++] = node;
+		}
+		if (t->nodes[node].visits > 0 && mcts_expand(t, node, &pos) > 0) {
+			node = t->nodes[node].children;
+			mcts_play(&pos, t->nodes[node].cell, to_move);
+			to_move = 3 - to_move;
+			path[depth++] = node;
+		}
+		mcts_playout(t, &pos, to_move);
+
+		int diff = pos.captured[t->player - 1] - pos.captured[2 - t->player];
+		float result = diff > 0 ? 1 : diff < 0 ? 0 : 0.5;
+		t->nodes[0].visits++;
+		/* moves at odd depths are the searching player's */
+		for (i = 1; i < depth; i++) {
+			struct mcts_node *n = &t->nodes[path[i]];
+			n->visits++;
+			n->wins += (i & 1) ? result : 1 - result;
+		}
+		t->playouts++;
+	}
+	return 0;
+}
+
+/**
+ * Chooses a move for the player on the map, searching with the given number
+ * of threads, 0 for one per core, for budget_ms milliseconds.  The map is
+ * copied first and not changed.  bounds are those of the dots of both
+ * players, as in struct dot_sets.
+ * Returns the field of the move, -1 if there is no free field to play.
+ */
+int mcts_search(
+		const char *map, const struct dot_bounds *bounds, char player,
+		int threads, int budget_ms, struct mcts_result *result)
+{
+	uint64_t start = mcts_clock();
+	int i, j;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	memset(result, 0, sizeof(*result));
+	result->cell = -1;
+
+	struct position *root = malloc(sizeof(*root));
+	int *candidates = malloc(MAP_CELLS * sizeof(int));
+	struct mcts_thread *t = calloc(threads, sizeof(*t));
+	if (!root || !candidates || !t)
+		goto out;
+
+	for (i = 0; i < MAP_CELLS; i++)
+		root->map[i] = map[i] & (PLAYER | DISABLED);
+	root->bounds[0] = bounds[0];
+	root->bounds[1] = bounds[1];
+	root->captured[0] = root->captured[1] = 0;
+
+	int count = mcts_candidates(root->map, candidates);
+	if (count <= 1) {
+		result->cell = count ? candidates[0] : -1;
+		goto out;
+	}
+
+	for (i = 0; i < threads; i++) {
+		t[i].root = root;
+		t[i].candidates = candidates;
+		t[i].candidate_count = count;
+		t[i].player = player;
+		t[i].deadline = start + budget_ms * 1000000ull;
+		t[i].rng = (start ^ (i + 1) * 2654435769u) | 1;
+		t[i].nodes = malloc(MCTS_NODES * sizeof(struct mcts_node));
+		t[i].started = t[i].nodes &&
+			pthread_create(&t[i].thread, 0, mcts_thread_main, &t[i]) == 0;
+	}
+
+	/* every root has a child per candidate, in the same order */
+	uint64_t best_visits = 0;
+	for (j = 0; j < count; j++) {
+		uint64_t visits = 0;
+		for (i = 0; i < threads; i++) {
+			if (t[i].started && j == 0)
+				pthread_join(t[i].thread, 0);
+			if (t[i].started)
+				visits += t[i].nodes[t[i].nodes[0].children + j].visits;
+		}
+		if (result->cell == -1 || visits > best_visits) {
+			best_visits = visits;
+			result->cell = candidates[j];
+		}
+	}
+	for (i = 0; i < threads; i++) {
+		result->playouts += t[i].playouts;
+		free(t[i].nodes);
+	}
+
+out:
+	result->ns = mcts_clock() - start;
+	TRACE(TRACE_MCTS_SEARCH, result->cell, result->playouts,
+			result->ns / 1000000);
+	free(root);
+	free(candidates);
+	free(t);
+	return result->cell;
+}
@@ -0,0 +1,33 @@
+#ifndef MCTS_H
+#define MCTS_H
+
+#include <stdint.h>
+
+#include "conf.h"
+#include "board.h"
+#include "rules.h"
+
+/* positions are copied for every playout, so only small boards are played */
+#if TILES_X == 1 && TILES_Y == 1
+	#define MCTS_FITS 1
+#else
+	#define MCTS_FITS 0
+#endif
+
+/**
+ * Outcome of a search
+ */
+struct mcts_result {
+	/* field of the chosen move, -1 if there is none */
+	int cell;
+
+	/* playouts run by all threads, and the time they took */
+	uint64_t playouts;
+	uint64_t ns;
+};
+
+int mcts_search(
+		const char *map, const struct dot_bounds *bounds, char player,
+		int threads, int budget_ms, struct mcts_result *result);
+
+#endif
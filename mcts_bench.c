@@ -0,0 +1,91 @@
+#include "conf.h"
+#include "mcts.h"
+#include "rules.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Throughput of the computer player's search.  Plays a fixed opening of
+ * random moves and searches the position with 1, 2, 4... threads up to one
+ * per core, reporting the playouts per second of each.
+ */
+
+/* default search time and opening length */
+#define BENCH_MOVE_TIME 1000
+#define BENCH_OPENING 40
+
+/**
+ * Plays random moves around the centre of the board, the same ones on every
+ * run
+ */
+void play_opening(char *map, struct dot_sets *sets, int moves) {
+	static int captured[MAP_CELLS];
+	int i;
+	srand(1);
+	for (i = 0; i < moves; i++) {
+		int y = MAP_HEIGHT / 2 + rand() % 9 - 4;
+		int x = MAP_WIDTH / 2 + rand() % 13 - 6;
+		if (y < 0 || y >= MAP_HEIGHT || x < 0 || x >= MAP_WIDTH ||
+				map[CELL(y, x)] != 0)
+			continue;
+		place_dot(map, sets, y, x, 2 - i % 2, captured, 0);
+	}
+}
+
+void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [-m moves] [-t ms] [-w threads]\n"
+			"  -m moves    random moves played before searching, default %d\n"
+			"  -t ms       time of each search, default %d\n"
+			"  -w threads  most threads to search with, default one per core\n",
+			name, BENCH_OPENING, BENCH_MOVE_TIME);
+}
+
+int main(int argc, char *argv[]) {
+	int moves = BENCH_OPENING, budget = BENCH_MOVE_TIME, max_threads = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "m:t:w:")) != -1) {
+		switch (opt) {
+			case 'm': moves = atoi(optarg); break;
+			case 't': budget = atoi(optarg); break;
+			case 'w': max_threads = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (max_threads <= 0)
+		max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_threads <= 0)
+		max_threads = 1;
+
+	static char map[MAP_CELLS];
+	static struct dot_sets sets;
+	play_opening(map, &sets, moves);
+
+	printf("%8s %12s %14s %8s %6s\n", "threads", "playouts", "playouts/s",
+			"speedup", "move");
+	double single = 0;
+	int threads = 1;
+	while (1) {
+		struct mcts_result r;
+		if (mcts_search(map, sets.bounds, 2, threads, budget, &r) == -1) {
+			fputs("No move to search for\n", stderr);
+			return 1;
+		}
+		double rate = r.ns ? r.playouts * 1e9 / r.ns : 0;
+		if (threads == 1)
+			single = rate;
+		printf("%8d %12llu %14.0f %7.2fx %3d,%-3d\n", threads,
+				(unsigned long long)r.playouts, rate,
+				single > 0 ? rate / single : 0,
+				CELL_Y(r.cell), CELL_X(r.cell));
+		if (threads == max_threads)
+			break;
+		threads = threads * 2 < max_threads ? threads * 2 : max_threads;
+	}
+	return 0;
+}
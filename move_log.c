@@ -0,0 +1,83 @@
+#include "move_log.h"
+
+/**
+ * Publishes a move.  Room for the captured fields is reserved by moving
+ * cells_head before they are written, so readers can tell which fields may be
+ * changing under them.  The record and the new head come last.
+ */
+void move_log_append(
+		struct move_log *log, int cell, char player,
+		const int *captured, int count)
+{
+	uint32_t head = log->head, first = log->cells_head;
+	int i;
+
+	__atomic_store_n(&log->cells_head, first + count, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (i = 0; i < count; i++)
+		log->cells[(first + i) % MOVE_LOG_CELLS] = captured[i];
+
+	struct move_record *rec = &log->moves[head % MOVE_LOG_SIZE];
+	rec->cell = cell;
+	rec->player = player;
+	rec->captured_count = count;
+	rec->first_captured = first;
+	__atomic_store_n(&log->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the number of moves published so far
+ */
+uint32_t move_log_head(const struct move_log *log) {
+	return __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Returns the player who made the last move, 0 before the first one
+ */
+char move_log_last_player(const struct move_log *log) {
+	uint32_t head = move_log_head(log);
+	return head ? log->moves[(head - 1) % MOVE_LOG_SIZE].player : 0;
+}
+
+/**
+ * Reads the move at the cursor and advances it.  captured must have room for
+ * MOVE_LOG_CELLS fields, moves capturing more are reported as missed.
+ * Returns 1 if a move was read, 0 if there are no new moves, and -1 if the
+ * reader has fallen behind and missed moves.  In that case the cursor is
+ * moved to the head, and the caller has to resynchronise from the map.
+ */
+int move_log_read(
+		const struct move_log *log, uint32_t *cursor,
+		struct move_record *rec, int *captured)
+{
+	uint32_t head = move_log_head(log);
+	int i;
+
+	if (*cursor == head)
+		return 0;
+	if (head - *cursor >= MOVE_LOG_SIZE)
+		goto overrun;
+
+	*rec = log->moves[*cursor % MOVE_LOG_SIZE];
+	if (rec->captured_count > MOVE_LOG_CELLS)
+		goto overrun;
+	for (i = 0; i < rec->captured_count; i++)
+		captured[i] = log->cells[(rec->first_captured + i) % MOVE_LOG_CELLS];
+
+	/* the writer may have been overwriting what was just copied, but only
+	   fields it has reserved below cells_head */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+	uint32_t cells_head = __atomic_load_n(&log->cells_head, __ATOMIC_RELAXED);
+	if (head - *cursor >= MOVE_LOG_SIZE ||
+			cells_head - rec->first_captured > MOVE_LOG_CELLS)
+		goto overrun;
+
+	(*cursor)++;
+	return 1;
+
+overrun:
+	*cursor = move_log_head(log);
+	return -1;
+}
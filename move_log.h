@@ -0,0 +1,55 @@
+#ifndef MOVE_LOG_H
+#define MOVE_LOG_H
+
+#include <stdint.h>
+
+#include "conf.h"
+#include "board.h"
+
+/* fields stored in the log, wide enough for any field of the map */
+#if MAP_CELLS > 65536
+	typedef uint32_t log_cell_t;
+#else
+	typedef uint16_t log_cell_t;
+#endif
+
+struct move_record {
+	/* field of the new dot */
+	uint32_t cell;
+	char player;
+
+	/* fields disabled by the move, stored in the log's cells from
+	   first_captured on */
+	uint32_t captured_count;
+	uint32_t first_captured;
+};
+
+/**
+ * Ring of committed moves in the shared game state.  Players take turns, so
+ * there is only ever one writer.  Readers keep their own cursor and detect
+ * records overwritten while they were reading them.
+ */
+struct move_log {
+	/* number of moves ever written */
+	uint32_t head;
+
+	/* number of captured fields ever written */
+	uint32_t cells_head;
+
+	struct move_record moves[MOVE_LOG_SIZE];
+	log_cell_t cells[MOVE_LOG_CELLS];
+};
+
+void move_log_append(
+		struct move_log *log, int cell, char player,
+		const int *captured, int count);
+
+uint32_t move_log_head(const struct move_log *log);
+
+char move_log_last_player(const struct move_log *log);
+
+int move_log_read(
+		const struct move_log *log, uint32_t *cursor,
+		struct move_record *rec, int *captured);
+
+#endif
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+
+#include "conf.h"
+#include "event_server.h"
+#include "game_manager.h"
+#include "handoff.h"
+#include "prefork.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+/* sent by a worker to the root process once it has stopped accepting */
+#define PREFORK_RETIRE_SIGNAL SIGRTMIN
+
+/*
+ * Worker processes by event server instance.  A retiring worker keeps its
+ * instance until it exits, while its replacement already takes new
+ * connections.
+ */
+struct prefork_child {
+	pid_t pid;
+	int slot;
+	int retiring;
+};
+
+struct prefork_child children[EVENT_INSTANCES];
+
+/* listening socket of each slot and the instance currently accepting on it,
+   -1 if there is none */
+int *slot_socks;
+int *slot_instances;
+int slot_count;
+
+pid_t prefork_root;
+sigset_t prefork_signals;
+int prefork_sigfd;
+
+/**
+ * Opens a listening socket on SRV_PORT that shares the port with the other
+ * slots.  The kernel spreads incoming connections among them.
+ * Returns the socket, -1 on failure.
+ */
+int prefork_listener() {
+	int sock = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (sock == -1) {
+		perror("prefork: socket");
+		return -1;
+	}
+	int yes = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1 ||
+			setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+		perror("prefork: setsockopt");
+		close(sock);
+		return -1;
+	}
+
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(SRV_PORT);
+	sa.sin_addr.s_addr = INADDR_ANY;
+	if (bind(sock, (struct sockaddr*)&sa, sizeof(sa)) == -1 ||
+			listen(sock, SOMAXCONN) == -1) {
+		perror("prefork: bind");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+void notify_retiring() {
+	if (getppid() == prefork_root)
+		kill(prefork_root, PREFORK_RETIRE_SIGNAL);
+}
+
+/**
+ * Starts a worker accepting on the given slot under a free instance number.
+ * The listening sockets stay open in the root process, so connections queued
+ * on a slot are kept while its worker is being replaced.
+ * Returns 0 on success, -1 on failure.
+ */
+int spawn_worker(int slot, int threads, unsigned int max_sessions) {
+	int instance;
+	for (instance = 0; instance < EVENT_INSTANCES; instance++)
+		if (!children[instance].pid && !handoff_reserved(instance))
+			break;
+	if (instance == EVENT_INSTANCES) {
+		DBG(1, "prefork: no free instance for slot %d\n", slot);
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("prefork: fork");
+		return -1;
+	}
+	if (pid == 0) {
+		/* do not outlive the root process */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (getppid() != prefork_root)
+			exit(0);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		/* SIGHUP stays blocked for the event server, it retires on it */
+		sigset_t unblock = prefork_signals;
+		sigdelset(&unblock, SIGHUP);
+		sigprocmask(SIG_UNBLOCK, &unblock, 0);
+		close(prefork_sigfd);
+
+		int i;
+		for (i = 0; i < slot_count; i++)
+			if (i != slot)
+				close(slot_socks[i]);
+
+		struct event_server_options opt;
+		opt.workers = threads;
+		opt.instance = instance;
+		opt.max_sessions = max_sessions;
+		opt.retire = notify_retiring;
+		opt.hangup = 0;
+		if (run_event_server(slot_socks[slot], &opt) == -1)
+			perror("prefork: event server");
+		exit(1);
+	}
+
+	children[instance].pid = pid;
+	children[instance].slot = slot;
+	children[instance].retiring = 0;
+	slot_instances[slot] = instance;
+	DBG(2, "Worker %d serving slot %d as instance %d\n", pid, slot, instance);
+	return 0;
+}
+
+int find_child(pid_t pid) {
+	int i;
+	for (i = 0; i < EVENT_INSTANCES; i++)
+		if (children[i].pid == pid)
+			return i;
+	return -1;
+}
+
+/**
+ * Hands the pool over to an upgraded server on SIGHUP, see handoff_start().
+ * The workers retire, and are not replaced.
+ */
+static void prefork_upgrade() {
+	int i;
+	for (i = 0; i < EVENT_INSTANCES; i++)
+		if (children[i].pid)
+			handoff_reserve(i);
+	if (handoff_start(slot_socks, slot_count) == -1)
+		return;
+	for (i = 0; i < EVENT_INSTANCES; i++)
+		if (children[i].pid)
+			kill(children[i].pid, SIGHUP);
+}
+
+/**
+ * Serves telnet connections from a pool of worker processes, each running the
+ * event server on its own SO_REUSEPORT listening socket.  A worker is replaced
+ * when it retires after max_sessions connections, or when it dies.
+ * Returns only if the pool cannot be started or another child process of the
+ * root, the manager, has exited.  Exits once the pool has been handed over
+ * and its workers have finished.
+ * worker_count	number of worker processes, 0 for one per core
+ * threads	event server threads in each worker
+ * max_sessions	connections served by a worker before it is replaced, 0 for
+ *		no limit
+ * socks	listening sockets handed over by an upgraded server, used for the
+ *		first sock_count slots
+ */
+int run_prefork(int worker_count, int threads, unsigned int max_sessions,
+		const int *socks, int sock_count)
+{
+	if (worker_count <= 0)
+		worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (worker_count <= 0)
+		worker_count = 1;
+	if (worker_count > EVENT_INSTANCES / 2)
+		worker_count = EVENT_INSTANCES / 2;
+
+	prefork_root = getpid();
+	slot_count = worker_count;
+	slot_socks = malloc(slot_count * sizeof(int));
+	slot_instances = malloc(slot_count * sizeof(int));
+	if (!slot_socks || !slot_instances)
+		return -1;
+
+	int i;
+	for (i = 0; i < slot_count; i++) {
+		slot_socks[i] = i < sock_count ? socks[i] : prefork_listener();
+		if (slot_socks[i] == -1)
+			return -1;
+		slot_instances[i] = -1;
+	}
+	/* a pool that has shrunk drops the connections queued on the rest */
+	for (; i < sock_count; i++)
+		close(socks[i]);
+
+	/* retire signals are queued, so none is lost when workers retire
+	   together */
+	sigemptyset(&prefork_signals);
+	sigaddset(&prefork_signals, SIGCHLD);
+	sigaddset(&prefork_signals, PREFORK_RETIRE_SIGNAL);
+	sigaddset(&prefork_signals, SIGHUP);
+	if (sigprocmask(SIG_BLOCK, &prefork_signals, 0) == -1)
+		return -1;
+	prefork_sigfd = signalfd(-1, &prefork_signals, SFD_CLOEXEC);
+	if (prefork_sigfd == -1)
+		return -1;
+
+	for (i = 0; i < slot_count; i++)
+		spawn_worker(i, threads, max_sessions);
+	DBG(2, "Prefork pool running with %d workers\n", slot_count);
+
+	for (;;) {
+		struct signalfd_siginfo si;
+		if (read(prefork_sigfd, &si, sizeof(si)) != sizeof(si)) {
+			if (errno == EINTR)
+				continue;
+			perror("prefork: read");
+			return -1;
+		}
+
+		if ((int)si.ssi_signo == SIGHUP) {
+			if (!handed_off)
+				prefork_upgrade();
+		} else if ((int)si.ssi_signo == PREFORK_RETIRE_SIGNAL) {
+			int instance = find_child(si.ssi_pid);
+			if (instance != -1 && !children[instance].retiring &&
+					!handed_off) {
+				struct prefork_child *child = &children[instance];
+				child->retiring = 1;
+				slot_instances[child->slot] = -1;
+				spawn_worker(child->slot, threads, max_sessions);
+			}
+		} else {
+			pid_t pid;
+			int status;
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				int instance = find_child(pid);
+				/* the manager, which exits after a handoff */
+				if (instance == -1 && handed_off)
+					continue;
+				if (instance == -1) {
+					DBG(1, "prefork: process %d exited\n", pid);
+					return -1;
+				}
+				struct prefork_child *child = &children[instance];
+				/* a worker with no open connections may exit before its
+				   retire signal is read */
+				if (!child->retiring) {
+					if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+						DBG(2, "Worker %d retired\n", pid);
+					} else
+						DBG(1, "Worker %d died, replacing it\n", pid);
+					slot_instances[child->slot] = -1;
+				}
+				child->pid = 0;
+			}
+		}
+
+		if (handed_off) {
+			for (i = 0; i < EVENT_INSTANCES && !children[i].pid; i++)
+				;
+			if (i == EVENT_INSTANCES)
+				exit(0);
+			continue;
+		}
+
+		/* slots left without a worker, after it died or no instance was
+		   free */
+		for (i = 0; i < slot_count; i++)
+			if (slot_instances[i] == -1)
+				spawn_worker(i, threads, max_sessions);
+	}
+}
@@ -0,0 +1,7 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+int run_prefork(int worker_count, int threads, unsigned int max_sessions,
+		const int *socks, int sock_count);
+
+#endif
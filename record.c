@@ -0,0 +1,725 @@
+#include "conf.h"
+#include "arena.h"
+#include "game_manager.h"
+#include "move_log.h"
+#include "record.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+const char *record_dir = 0;
+
+/* longest checkpoint entry, every field in a run of its own */
+#define CHECKPOINT_MAX (2 * MAP_CELLS + 128)
+
+/* fields kept in records */
+#define RECORD_FIELD (PLAYER | DISABLED)
+
+static size_t put_varint(unsigned char *p, uint32_t v) {
+	size_t n = 0;
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+/**
+ * Reads a varint at pos, which is advanced past it.
+ * Returns 0 on success, -1 if the data ends first.
+ */
+static int get_varint(
+		const unsigned char *data, size_t size, size_t *pos, uint32_t *v)
+{
+	uint32_t r = 0;
+	int shift;
+	for (shift = 0; shift < 35 && *pos < size; shift += 7) {
+		unsigned char c = data[(*pos)++];
+		r |= (uint32_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			*v = r;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int record_board_init(struct record_board *b) {
+	memset(b, 0, sizeof(*b));
+	b->last_cell = -1;
+	b->map = calloc(MAP_CELLS, 1);
+	return b->map ? 0 : -1;
+}
+
+void record_board_free(struct record_board *b) {
+	free(b->map);
+	b->map = 0;
+}
+
+static void record_board_clear(struct record_board *b) {
+	memset(b->map, 0, MAP_CELLS);
+	memset(b->bounds, 0, sizeof(b->bounds));
+	memset(&b->score, 0, sizeof(b->score));
+	b->moves = 0;
+	b->last_cell = -1;
+}
+
+/**
+ * Makes a move on the board as place_dot() does, except that process_map()
+ * runs for every move, which finds nothing where place_dot() skips it
+ */
+void record_board_apply(struct record_board *b, int cell, char player) {
+	int y = CELL_Y(cell), x = CELL_X(cell);
+	b->map[cell] = player;
+	b->score.dots[player - 1]++;
+	dot_bounds_add(&b->bounds[player - 1], y, x);
+	process_map(b->map, y, x, &b->bounds[player - 1], 0, &b->score);
+	b->moves++;
+	b->last_cell = cell;
+}
+
+/**
+ * Encodes a checkpoint entry of the board into buf, which must have room for
+ * CHECKPOINT_MAX bytes.  Returns the size of the entry.
+ */
+static size_t encode_checkpoint(const struct record_board *b, unsigned char *buf) {
+	/* the body goes after room for the marker and its length */
+	unsigned char *body = buf + 6, head[6];
+	size_t n = 0, h = 0;
+	int i, c;
+
+	n += put_varint(body + n, b->moves);
+	for (i = 0; i < 2; i++) {
+		n += put_varint(body + n, b->bounds[i].top);
+		n += put_varint(body + n, b->bounds[i].left);
+		n += put_varint(body + n, b->bounds[i].bottom);
+		n += put_varint(body + n, b->bounds[i].right);
+	}
+	for (i = 0; i < 2; i++) {
+		n += put_varint(body + n, b->score.dots[i]);
+		n += put_varint(body + n, b->score.captured[i]);
+		n += put_varint(body + n, b->score.enclosed[i]);
+	}
+	for (c = 0; c < MAP_CELLS; ) {
+		char v = b->map[c] & RECORD_FIELD;
+		int run = 1;
+		while (c + run < MAP_CELLS && (b->map[c + run] & RECORD_FIELD) == v)
+			run++;
+		n += put_varint(body + n, run);
+		body[n++] = v;
+		c += run;
+	}
+
+	head[h++] = 0;
+	h += put_varint(head + h, n);
+	memmove(buf + h, body, n);
+	memcpy(buf, head, h);
+	return h + n;
+}
+
+/**
+ * Loads the checkpoint entry at the offset onto the replay's board.
+ * Returns 0 on success, -1 if the entry is damaged.
+ */
+static int load_checkpoint(struct replay *r, size_t offset) {
+	struct record_board *b = &r->board;
+	size_t pos = offset + 1;
+	uint32_t len, v[15], run;
+	int i, c;
+
+	if (get_varint(r->data, r->size, &pos, &len) == -1 ||
+			len > r->size - pos)
+		return -1;
+	size_t end = pos + len;
+	for (i = 0; i < 15; i++)
+		if (get_varint(r->data, end, &pos, &v[i]) == -1)
+			return -1;
+	for (c = 0; c < MAP_CELLS; c += run) {
+		if (get_varint(r->data, end, &pos, &run) == -1 || pos >= end ||
+				run == 0 || run > MAP_CELLS - c)
+			return -1;
+		memset(b->map + c, r->data[pos++], run);
+	}
+
+	b->moves = v[0];
+	for (i = 0; i < 2; i++) {
+		b->bounds[i].top = v[1 + i * 4];
+		b->bounds[i].left = v[2 + i * 4];
+		b->bounds[i].bottom = v[3 + i * 4];
+		b->bounds[i].right = v[4 + i * 4];
+		b->score.dots[i] = v[9 + i * 3];
+		b->score.captured[i] = v[10 + i * 3];
+		b->score.enclosed[i] = v[11 + i * 3];
+	}
+	b->last_cell = -1;
+	r->pos = end;
+	return 0;
+}
+
+/**
+ * Returns the move number stored in the checkpoint entry at the offset, -1
+ * if the entry is damaged
+ */
+static int64_t checkpoint_move(const struct replay *r, size_t offset) {
+	size_t pos = offset + 1;
+	uint32_t len, move;
+	if (get_varint(r->data, r->size, &pos, &len) == -1 ||
+			len > r->size - pos ||
+			get_varint(r->data, pos + len, &pos, &move) == -1)
+		return -1;
+	return move;
+}
+
+/**
+ * Reads a whole record and indexes its checkpoints.  An entry torn by a
+ * crash at the end of the file is left out.  The replay starts at the
+ * first move of the record.
+ * Returns the replay, 0 if the file is not a record of this board.
+ */
+struct replay *replay_open(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return 0;
+	struct replay *r = calloc(1, sizeof(*r));
+	long size = -1;
+	if (r && fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0)
+		rewind(f);
+	if (!r || size < (long)sizeof(struct record_header) ||
+			!(r->data = malloc(size)) ||
+			fread(r->data, 1, size, f) != size ||
+			record_board_init(&r->board) == -1) {
+		fclose(f);
+		replay_close(r);
+		return 0;
+	}
+	fclose(f);
+	r->size = size;
+
+	struct record_header h;
+	memcpy(&h, r->data, sizeof(h));
+	if (memcmp(h.magic, RECORD_MAGIC, 4) != 0 ||
+			h.version != RECORD_VERSION || h.width != MAP_WIDTH ||
+			h.height != MAP_HEIGHT || h.cells != MAP_CELLS) {
+		replay_close(r);
+		return 0;
+	}
+	memcpy(r->key, h.key, 6);
+	r->key[6] = 0;
+
+	/* a record starting with moves starts on an empty board */
+	size_t pos = sizeof(h), end = pos;
+	unsigned int size_index = 0;
+	uint32_t moves = 0;
+	while (1) {
+		size_t entry = pos;
+		uint32_t v, len;
+		int64_t move = 0;
+		if (get_varint(r->data, r->size, &pos, &v) == -1)
+			break;
+		if (v > 0 && (v - 1) / 2 >= MAP_CELLS)
+			break;
+		if (v == 0 && ((move = checkpoint_move(r, entry)) < moves ||
+					get_varint(r->data, r->size, &pos, &len) == -1))
+			break;
+
+		if (v == 0 || entry == sizeof(h)) {
+			if (r->checkpoint_count == size_index) {
+				size_index = size_index ? size_index * 2 : 16;
+				struct record_checkpoint *p = realloc(r->checkpoints,
+						size_index * sizeof(*p));
+				if (!p) {
+					replay_close(r);
+					return 0;
+				}
+				r->checkpoints = p;
+			}
+			struct record_checkpoint *cp =
+				&r->checkpoints[r->checkpoint_count++];
+			cp->move = move;
+			cp->offset = v == 0 ? entry : 0;
+		}
+		if (v == 0) {
+			pos += len;
+			moves = move;
+			if (entry == sizeof(h))
+				r->first = move;
+		} else
+			moves++;
+		end = pos;
+	}
+	r->size = end;
+	if (r->checkpoint_count == 0) {
+		/* an empty record */
+		r->checkpoints = malloc(sizeof(*r->checkpoints));
+		if (!r->checkpoints) {
+			replay_close(r);
+			return 0;
+		}
+		r->checkpoints[0].move = 0;
+		r->checkpoints[0].offset = 0;
+		r->checkpoint_count = 1;
+	}
+	r->moves = moves;
+	r->pos = sizeof(h);
+	if (r->checkpoints[0].offset && load_checkpoint(r, r->checkpoints[0].offset)
+			== -1) {
+		replay_close(r);
+		return 0;
+	}
+	return r;
+}
+
+/**
+ * Opens the record of the game with the given key in record_dir.
+ * Returns the replay, 0 if there is none.
+ */
+struct replay *replay_open_game(const char *key) {
+	char path[PATH_MAX];
+	int i;
+	if (!record_dir)
+		return 0;
+	for (i = 0; i < 6; i++)
+		if (key[i] < 'a' || key[i] > 'z')
+			return 0;
+	if (key[6] != 0)
+		return 0;
+	snprintf(path, sizeof(path), "%s/%s" RECORD_SUFFIX, record_dir, key);
+	return replay_open(path);
+}
+
+void replay_close(struct replay *r) {
+	if (!r)
+		return;
+	record_board_free(&r->board);
+	free(r->checkpoints);
+	free(r->data);
+	free(r);
+}
+
+/**
+ * Rebuilds the board as it was after the given number of moves, from the
+ * last checkpoint before them, or going on from the current move if that is
+ * nearer.  Moves before the start of the record, or after its end, go to
+ * the start or the end.  Where moves have been missed, the board stops
+ * before them.
+ * Returns 0 on success, -1 if the record is damaged.
+ */
+int replay_seek(struct replay *r, uint32_t move) {
+	struct record_board *b = &r->board;
+	unsigned int lo = 0, hi = r->checkpoint_count;
+
+	if (move < r->first)
+		move = r->first;
+	if (move > r->moves)
+		move = r->moves;
+
+	/* last checkpoint at or before the move */
+	while (hi - lo > 1) {
+		unsigned int mid = (lo + hi) / 2;
+		if (r->checkpoints[mid].move <= move)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	const struct record_checkpoint *cp = &r->checkpoints[lo];
+	if (move < b->moves || cp->move > b->moves) {
+		if (cp->offset == 0) {
+			record_board_clear(b);
+			r->pos = sizeof(struct record_header);
+		} else if (load_checkpoint(r, cp->offset) == -1)
+			return -1;
+	}
+
+	while (b->moves < move && r->pos < r->size) {
+		size_t entry = r->pos;
+		uint32_t v;
+		if (get_varint(r->data, r->size, &r->pos, &v) == -1)
+			return -1;
+		if (v > 0) {
+			record_board_apply(b, (v - 1) / 2, (v - 1) % 2 + 1);
+			continue;
+		}
+
+		int64_t at = checkpoint_move(r, entry);
+		if (at == -1)
+			return -1;
+		if (at > move) {
+			/* moves missed before the checkpoint */
+			r->pos = entry;
+			break;
+		}
+		if (at == b->moves) {
+			uint32_t len;
+			get_varint(r->data, r->size, &r->pos, &len);
+			r->pos += len;
+		} else if (load_checkpoint(r, entry) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Moves the replay on a key of the viewer: h and l step a move back and
+ * forth, H and L ten moves, 0 and $ go to the start and the end.  Stepping
+ * forth into missed moves skips them.
+ * Returns 1 if the board has changed, 0 otherwise.
+ */
+int replay_input(struct replay *r, char input) {
+	uint32_t at = r->board.moves, to;
+	switch (input) {
+		case 'h': to = at > 0 ? at - 1 : 0; break;
+		case 'l': to = at + 1; break;
+		case 'H': to = at > 10 ? at - 10 : 0; break;
+		case 'L': to = at + 10; break;
+		case '0': to = 0; break;
+		case '$': to = r->moves; break;
+		default: return 0;
+	}
+	if (replay_seek(r, to) == -1)
+		return 0;
+	if (to > at && r->board.moves <= at) {
+		/* moves have been missed, go on where the record does */
+		unsigned int i = 0;
+		while (i < r->checkpoint_count && r->checkpoints[i].move <= at)
+			i++;
+		if (i < r->checkpoint_count &&
+				replay_seek(r, r->checkpoints[i].move) == -1)
+			return 0;
+	}
+	return r->board.moves != at;
+}
+
+/*
+ * Recording, done by a thread of the manager.  It follows the move log of
+ * every game every RECORD_INTERVAL ms, so players never wait for it, and
+ * keeps a copy of each board to checkpoint.  Records go out through stdio
+ * buffers, flushed every RECORD_FLUSH_INTERVAL ms and when a game ends.
+ * Records are closed in between unless moves keep coming, and reopened for
+ * appending.
+ */
+
+/**
+ * Game being recorded
+ */
+struct recording {
+	char key[7];
+	/* 0 while the record is closed */
+	FILE *f;
+	struct record_board board;
+
+	/* moves read from the game's log */
+	uint32_t cursor;
+
+	/* written to since the last flush */
+	int written;
+	/* the record could not be written, the game goes unrecorded */
+	int failed;
+
+	/* open records, the most recently written first */
+	struct recording *prev_open, *next_open;
+};
+
+/* by arena slot */
+static struct recording **recordings;
+
+static struct recording *open_head, *open_tail;
+static unsigned int open_count;
+
+static unsigned char *checkpoint_buf;
+
+static pthread_t record_thread;
+static int record_running;
+static volatile int record_stopping;
+
+static void record_path(const char *key, char *path) {
+	snprintf(path, PATH_MAX, "%s/%s" RECORD_SUFFIX, record_dir, key);
+}
+
+static void record_unlink_open(struct recording *rec) {
+	if (rec->prev_open)
+		rec->prev_open->next_open = rec->next_open;
+	else
+		open_head = rec->next_open;
+	if (rec->next_open)
+		rec->next_open->prev_open = rec->prev_open;
+	else
+		open_tail = rec->prev_open;
+	open_count--;
+}
+
+static void record_link_open(struct recording *rec) {
+	rec->prev_open = 0;
+	rec->next_open = open_head;
+	if (open_head)
+		open_head->prev_open = rec;
+	else
+		open_tail = rec;
+	open_head = rec;
+	open_count++;
+}
+
+static void record_close(struct recording *rec) {
+	record_unlink_open(rec);
+	if (fclose(rec->f) == EOF)
+		perror("record: fclose");
+	rec->f = 0;
+	rec->written = 0;
+}
+
+/**
+ * Opens the game's record, closing the one written longest ago if
+ * RECORD_OPEN_FILES are open.  A record that cannot be opened is given up,
+ * as it would fail again on every tick.
+ * Returns 0 on success, -1 on failure.
+ */
+static int record_fopen(struct recording *rec, const char *mode) {
+	char path[PATH_MAX];
+	if (open_count >= RECORD_OPEN_FILES)
+		record_close(open_tail);
+	record_path(rec->key, path);
+	rec->f = fopen(path, mode);
+	if (!rec->f) {
+		fprintf(stderr, "record: %s: %s, not recording the game\n",
+				path, strerror(errno));
+		rec->failed = 1;
+		return -1;
+	}
+	record_link_open(rec);
+	return 0;
+}
+
+/**
+ * Makes the record ready to be written, reopening it if needed
+ * Returns 0 on success, -1 on failure.
+ */
+static int record_open(struct recording *rec) {
+	rec->written = 1;
+	if (!rec->f)
+		return record_fopen(rec, "a");
+	if (rec != open_head) {
+		record_unlink_open(rec);
+		record_link_open(rec);
+	}
+	return 0;
+}
+
+static void record_checkpoint(struct recording *rec) {
+	size_t len = encode_checkpoint(&rec->board, checkpoint_buf);
+	fwrite(checkpoint_buf, 1, len, rec->f);
+}
+
+static void record_move(struct recording *rec, int cell, char player) {
+	unsigned char buf[8];
+	record_board_apply(&rec->board, cell, player);
+	fwrite(buf, 1, put_varint(buf, cell * 2 + player), rec->f);
+	if (rec->board.moves % RECORD_CHECKPOINT == 0)
+		record_checkpoint(rec);
+}
+
+/**
+ * Copies the board from the game after moves have been missed, and
+ * checkpoints it.  A move being made meanwhile may be counted twice in the
+ * score.
+ */
+static void record_resync(struct recording *rec, const struct game *g) {
+	int i;
+	for (i = 0; i < MAP_CELLS; i++)
+		rec->board.map[i] = g->map[i] & RECORD_FIELD;
+	memcpy(rec->board.bounds, g->dots.bounds, sizeof(rec->board.bounds));
+	rec->board.score = g->score;
+	rec->board.moves = rec->cursor;
+	rec->board.last_cell = -1;
+	record_checkpoint(rec);
+}
+
+/**
+ * Starts recording the game.  A game taken over from another manager goes on
+ * in its record, if that ends at a move still in the log.  A recording that
+ * has failed stays in place until the game ends, marked as such.
+ * Returns the recording, 0 if there is no memory for it.
+ */
+static struct recording *record_begin(int slot, const struct game *g) {
+	char path[PATH_MAX];
+	struct recording *rec = calloc(1, sizeof(*rec));
+	if (!rec || record_board_init(&rec->board) == -1) {
+		free(rec);
+		return 0;
+	}
+	memcpy(rec->key, g->key, 6);
+	rec->key[6] = 0;
+	record_path(rec->key, path);
+	recordings[slot] = rec;
+
+	uint32_t head = move_log_head(&g->log);
+	struct replay *r = head ? replay_open(path) : 0;
+	if (r && strcmp(r->key, rec->key) == 0 && r->moves <= head &&
+			head - r->moves < MOVE_LOG_SIZE &&
+			replay_seek(r, r->moves) == 0 && r->board.moves == r->moves &&
+			truncate(path, r->size) == 0) {
+		struct record_board b = rec->board;
+		rec->board = r->board;
+		r->board = b;
+		rec->cursor = r->moves;
+		record_fopen(rec, "a");
+	}
+	replay_close(r);
+
+	if (!rec->f) {
+		rec->cursor = 0;
+		rec->failed = 0;
+		record_board_clear(&rec->board);
+		if (record_fopen(rec, "w") == 0) {
+			struct record_header h;
+			memset(&h, 0, sizeof(h));
+			memcpy(h.magic, RECORD_MAGIC, 4);
+			h.version = RECORD_VERSION;
+			h.width = MAP_WIDTH;
+			h.height = MAP_HEIGHT;
+			h.cells = MAP_CELLS;
+			memcpy(h.key, rec->key, 7);
+			h.started = time(0);
+			fwrite(&h, sizeof(h), 1, rec->f);
+			rec->written = 1;
+		}
+	}
+	if (rec->failed)
+		record_board_free(&rec->board);
+	return rec;
+}
+
+/**
+ * Records the moves made since the last call
+ */
+static void record_drain(struct recording *rec, const struct game *g) {
+	static int captured[MOVE_LOG_CELLS];
+	struct move_record m;
+	int got;
+	if (rec->failed || move_log_head(&g->log) == rec->cursor ||
+			record_open(rec) == -1)
+		return;
+	while ((got = move_log_read(&g->log, &rec->cursor, &m, captured)) != 0) {
+		if (got == -1)
+			record_resync(rec, g);
+		else if (m.cell < MAP_CELLS && (m.player == 1 || m.player == 2))
+			record_move(rec, m.cell, m.player);
+	}
+}
+
+static void record_finish(int slot) {
+	struct recording *rec = recordings[slot];
+	if (rec->f)
+		record_close(rec);
+	record_board_free(&rec->board);
+	free(rec);
+	recordings[slot] = 0;
+}
+
+/**
+ * Records the moves of all games, starting and finishing records as games
+ * come and go
+ */
+static void record_tick() {
+	unsigned int n = arena_high_water(), slot;
+	for (slot = 0; slot < n; slot++) {
+		struct game *g = arena_game(slot);
+		struct recording *rec = recordings[slot];
+		/* being changed by the manager, look again next time */
+		if (!g || !arena_valid(g))
+			continue;
+
+		if (rec && (g->state == GAME_IDLE || strcmp(rec->key, g->key) != 0)) {
+			/* the last moves are still in the log unless the slot has
+			   been reused */
+			if (strcmp(rec->key, g->key) == 0)
+				record_drain(rec, g);
+			record_finish(slot);
+			rec = 0;
+		}
+		if (!rec && g->state != GAME_IDLE)
+			rec = record_begin(slot, g);
+		if (rec)
+			record_drain(rec, g);
+	}
+}
+
+/**
+ * Flushes the records written since the last flush, and closes the others
+ */
+static void record_flush() {
+	struct recording *rec = open_head, *next;
+	for (; rec; rec = next) {
+		next = rec->next_open;
+		if (!rec->written)
+			record_close(rec);
+		else if (fflush(rec->f) == EOF)
+			perror("record: fflush");
+		rec->written = 0;
+	}
+}
+
+static void *record_main(void *arg) {
+	struct timespec interval = {
+		.tv_sec = RECORD_INTERVAL / 1000,
+		.tv_nsec = RECORD_INTERVAL % 1000 * 1000000 };
+	int ticks = 0, flush_ticks = RECORD_FLUSH_INTERVAL / RECORD_INTERVAL;
+	while (!record_stopping) {
+		nanosleep(&interval, 0);
+		record_tick();
+		if (++ticks >= flush_ticks) {
+			record_flush();
+			ticks = 0;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Starts the manager's thread recording games to record_dir, unless it is
+ * not set.  Returns 0 on success, -1 on failure.
+ */
+int record_start() {
+	if (!record_dir)
+		return 0;
+	if (mkdir(record_dir, 0755) == -1 && errno != EEXIST) {
+		perror("record: mkdir");
+		return -1;
+	}
+	recordings = calloc(ARENA_SLOTS, sizeof(*recordings));
+	checkpoint_buf = malloc(CHECKPOINT_MAX);
+	if (!recordings || !checkpoint_buf) {
+		perror("record: malloc");
+		return -1;
+	}
+	int err = pthread_create(&record_thread, 0, record_main, 0);
+	if (err != 0) {
+		fprintf(stderr, "record: pthread_create: %s\n", strerror(err));
+		return -1;
+	}
+	record_running = 1;
+	return 0;
+}
+
+/**
+ * Stops recording, after the moves made so far, and closes the records.
+ * A manager taking over goes on with them.
+ */
+void record_stop() {
+	unsigned int slot;
+	if (!record_running)
+		return;
+	record_stopping = 1;
+	pthread_join(record_thread, 0);
+	record_running = 0;
+	record_tick();
+	for (slot = 0; slot < ARENA_SLOTS; slot++)
+		if (recordings[slot])
+			record_finish(slot);
+}
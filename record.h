@@ -0,0 +1,113 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conf.h"
+#include "board.h"
+#include "rules.h"
+
+/*
+ * Game records.  Every game is appended to a file of its own, named after
+ * its key, in record_dir.  The file starts with struct record_header,
+ * followed by entries starting with a varint (7 bits a byte, low bits
+ * first):
+ *   v > 0	a move, of player (v - 1) % 2 + 1 to field (v - 1) / 2
+ *   v = 0	a checkpoint, a varint length and that many bytes: the number
+ *   		of moves made, the bounds of both players' dots and the score as
+ *   		varints, then the fields of the map as runs of a varint count and
+ *   		a byte
+ * A checkpoint is written every RECORD_CHECKPOINT moves, and where moves
+ * were missed.  A record only fits a build with the same board size.
+ */
+#define RECORD_MAGIC "KREC"
+#define RECORD_VERSION 1
+
+/* suffix of record files */
+#define RECORD_SUFFIX ".krec"
+
+struct record_header {
+	char magic[4];
+	uint32_t version;
+
+	uint32_t width, height, cells;
+
+	/* key of the game, null-terminated */
+	char key[8];
+
+	/* time the record was started, in seconds since the epoch */
+	int64_t started;
+};
+
+/**
+ * Board rebuilt move by move from a record
+ */
+struct record_board {
+	/* MAP_CELLS fields, as in struct game */
+	char *map;
+
+	struct dot_bounds bounds[2];
+	struct score score;
+
+	/* moves made on the board */
+	uint32_t moves;
+
+	/* field of the last move, -1 if unknown */
+	int last_cell;
+};
+
+struct record_checkpoint {
+	/* moves made at the checkpoint */
+	uint32_t move;
+
+	/* offset of the checkpoint entry, 0 for the empty board at the start
+	   of the record */
+	size_t offset;
+};
+
+/**
+ * Record loaded for replaying, positioned at some move
+ */
+struct replay {
+	char key[7];
+
+	unsigned char *data;
+	size_t size;
+
+	/* moves made at the start of the record and at its end */
+	uint32_t first, moves;
+
+	struct record_checkpoint *checkpoints;
+	unsigned int checkpoint_count;
+
+	struct record_board board;
+
+	/* offset of the entry after the board's last move */
+	size_t pos;
+};
+
+/* directory of the records, 0 if games are not recorded */
+extern const char *record_dir;
+
+int record_board_init(struct record_board *b);
+
+void record_board_free(struct record_board *b);
+
+void record_board_apply(struct record_board *b, int cell, char player);
+
+int record_start();
+
+void record_stop();
+
+struct replay *replay_open(const char *path);
+
+struct replay *replay_open_game(const char *key);
+
+void replay_close(struct replay *r);
+
+int replay_seek(struct replay *r, uint32_t move);
+
+int replay_input(struct replay *r, char input);
+
+#endif
@@ -0,0 +1,363 @@
+#include "conf.h"
+#include "render.h"
+#include "rules.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+/* field bits that affect the way a field is drawn */
+#define FIELD_LOOK (PLAYER | DISABLED)
+
+enum ATTR {
+	ATTR_UNKNOWN = -1,
+	ATTR_PLAIN,
+	ATTR_X,
+	ATTR_O
+};
+
+static const char *attr_codes[] = { "\e[0m", "\e[1;32m", "\e[1;34m" };
+
+/**
+ * Starts an empty frame.  The terminal colour is unknown until the frame sets
+ * one.
+ */
+void frame_init(struct frame *f) {
+	f->len = 0;
+	f->attr = ATTR_UNKNOWN;
+}
+
+static void frame_put(struct frame *f, const char *s, size_t n) {
+	if (f->len + n > FRAME_SIZE) {
+		DBG(1, "frame: output truncated\n");
+		n = FRAME_SIZE - f->len;
+	}
+	memcpy(f->data + f->len, s, n);
+	f->len += n;
+}
+
+void frame_puts(struct frame *f, const char *s) {
+	frame_put(f, s, strlen(s));
+}
+
+void frame_printf(struct frame *f, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(f->data + f->len, FRAME_SIZE - f->len, format, args);
+	va_end(args);
+	if (n < 0)
+		return;
+	if (f->len + n >= FRAME_SIZE) {
+		DBG(1, "frame: output truncated\n");
+		/* vsnprintf has written a terminating null in the last byte */
+		n = FRAME_SIZE - 1 - f->len;
+	}
+	f->len += n;
+}
+
+/**
+ * Switches the colour attribute, unless it is already in effect
+ */
+static void frame_attr(struct frame *f, int attr) {
+	if (f->attr == attr)
+		return;
+	frame_puts(f, attr_codes[attr]);
+	f->attr = attr;
+}
+
+/**
+ * Moves the terminal cursor to the given row and column, counted from 1
+ */
+static void frame_goto(struct frame *f, int row, int col) {
+	char buf[16], *p = buf + sizeof(buf);
+	*--p = 'H';
+	do { *--p = '0' + col % 10; col /= 10; } while (col);
+	*--p = ';';
+	do { *--p = '0' + row % 10; row /= 10; } while (row);
+	*--p = '[';
+	*--p = '\e';
+	frame_put(f, p, buf + sizeof(buf) - p);
+}
+
+/**
+ * Writes the whole frame to the socket and empties it.  The colour attribute
+ * carries over to the next frame.
+ * Returns 0 on success, -1 on failure.
+ */
+int frame_send(struct frame *f, int sock) {
+	size_t sent = 0;
+	TRACE(TRACE_FRAME_SEND, sock, f->len, 0);
+	while (sent < f->len) {
+		ssize_t r = send(sock, f->data + sent, f->len - sent, MSG_NOSIGNAL);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("frame_send: send");
+			f->len = 0;
+			return -1;
+		}
+		sent += r;
+	}
+	f->len = 0;
+	return 0;
+}
+
+/**
+ * Outputs a single field at the current terminal cursor position
+ */
+static void print_field(struct frame *f, char field) {
+	/* for colourful background:
+	if ((i+j)%2) fputs("\e[46m", out);
+	else fputs("\e[47m", out); */
+	if ((field & PLAYER) == 1)
+		if (field & DISABLED) {
+			frame_attr(f, ATTR_PLAIN);
+			frame_put(f, "x", 1);
+		} else {
+			frame_attr(f, ATTR_X);
+			frame_put(f, "X", 1);
+		}
+	else if ((field & PLAYER) == 2)
+		if (field & DISABLED) {
+			frame_attr(f, ATTR_PLAIN);
+			frame_put(f, "o", 1);
+		} else {
+			frame_attr(f, ATTR_O);
+			frame_put(f, "O", 1);
+		}
+	/*else if (map_get(i, j) & (1 << 7)) fputs("\e[0m.", out);*/
+	else frame_put(f, " ", 1);
+}
+
+/**
+ * Moves the viewport so the cursor is in view, centring it on the cursor
+ * when it has left.  Returns 1 if the viewport moved and has to be redrawn.
+ */
+int viewport_follow(struct viewport *view, int cur_y, int cur_x) {
+	int moved = 0;
+
+	if (cur_y < view->y || cur_y >= view->y + VIEW_HEIGHT) {
+		view->y = cur_y - VIEW_HEIGHT / 2;
+		if (view->y > MAP_HEIGHT - VIEW_HEIGHT)
+			view->y = MAP_HEIGHT - VIEW_HEIGHT;
+		if (view->y < 0)
+			view->y = 0;
+		moved = 1;
+	}
+	if (cur_x < view->x || cur_x >= view->x + VIEW_WIDTH) {
+		view->x = cur_x - VIEW_WIDTH / 2;
+		if (view->x > MAP_WIDTH - VIEW_WIDTH)
+			view->x = MAP_WIDTH - VIEW_WIDTH;
+		if (view->x < 0)
+			view->x = 0;
+		moved = 1;
+	}
+	return moved;
+}
+
+/**
+ * Outputs the line below the map
+ */
+static void print_border(struct frame *f, int y, int x) {
+	int j;
+	frame_attr(f, ATTR_PLAIN);
+	frame_goto(f, y + VIEW_HEIGHT + 1, x);
+	for (j = 0; j < VIEW_WIDTH; j++)
+		frame_put(f, "=", 1);
+}
+
+/**
+ * Outputs the part of the map in view to the terminal
+ * f		Frame to draw into
+ * map		Map to draw, may be NULL for an empty map
+ * view		Part of the map to draw, its shown fields are updated
+ * y, x		Position of view's upper left corner in terminal coordinates
+ */
+void print_map(
+		struct frame *f, const char *map, struct viewport *view, int y, int x)
+{
+	int i, j;
+
+	print_border(f, y, x);
+	for (i = 0; i < VIEW_HEIGHT; i++) {
+		frame_goto(f, i + y + 1, x + 1);
+		for (j = 0; j < VIEW_WIDTH; j++) {
+			char field = map ?
+				map[CELL(view->y + i, view->x + j)] & FIELD_LOOK : 0;
+			print_field(f, field);
+			view->shown[i * VIEW_WIDTH + j] = field;
+		}
+	}
+	frame_attr(f, ATTR_PLAIN);
+}
+
+/**
+ * Outputs only the fields in view that differ from the last drawn ones and
+ * updates shown.  Runs of changed fields in a row share one cursor move.
+ * Returns the number of fields drawn.
+ */
+int print_map_delta(
+		struct frame *f, const char *map, struct viewport *view, int y, int x)
+{
+	int i, j, drawn = 0;
+
+	for (i = 0; i < VIEW_HEIGHT; i++) {
+		int next_j = -1;
+		for (j = 0; j < VIEW_WIDTH; j++) {
+			char *shown = &view->shown[i * VIEW_WIDTH + j];
+			char field = map[CELL(view->y + i, view->x + j)] & FIELD_LOOK;
+			if (field == *shown)
+				continue;
+			if (j != next_j)
+				frame_goto(f, i + y + 1, j + x + 1);
+			print_field(f, field);
+			*shown = field;
+			next_j = j + 1;
+			drawn++;
+		}
+	}
+	frame_attr(f, ATTR_PLAIN);
+	return drawn;
+}
+
+/**
+ * Draws one map field if it is in view and differs from the shown one.  next
+ * is the position in view the terminal cursor is at, so runs need a single
+ * cursor move.
+ * Returns 1 if the field was drawn.
+ */
+static int print_cell(
+		struct frame *f, const char *map, struct viewport *view, int cell,
+		int y, int x, int *next)
+{
+	int i = CELL_Y(cell) - view->y, j = CELL_X(cell) - view->x;
+	if (i < 0 || i >= VIEW_HEIGHT || j < 0 || j >= VIEW_WIDTH)
+		return 0;
+
+	int pos = i * VIEW_WIDTH + j;
+	char field = map[cell] & FIELD_LOOK;
+	if (field == view->shown[pos])
+		return 0;
+	if (pos != *next)
+		frame_goto(f, i + y + 1, j + x + 1);
+	print_field(f, field);
+	view->shown[pos] = field;
+	/* the terminal cursor does not wrap to the next row */
+	*next = (j == VIEW_WIDTH - 1) ? -1 : pos + 1;
+	return 1;
+}
+
+/**
+ * Outputs the fields changed by the moves logged since the cursor, and
+ * advances it.  Falls back to print_map_delta if the log has been overrun.
+ * Returns the number of fields drawn.
+ */
+int print_moves(
+		struct frame *f, const struct move_log *log, uint32_t *cursor,
+		const char *map, struct viewport *view, int y, int x)
+{
+	static __thread int captured[MOVE_LOG_CELLS];
+	struct move_record rec;
+	int r, i, next = -1, drawn = 0;
+
+	while ((r = move_log_read(log, cursor, &rec, captured)) == 1) {
+		drawn += print_cell(f, map, view, rec.cell, y, x, &next);
+		for (i = 0; i < rec.captured_count; i++)
+			drawn += print_cell(f, map, view, captured[i], y, x, &next);
+	}
+	if (r == -1) {
+		drawn += print_map_delta(f, map, view, y, x);
+		TRACE(TRACE_RENDER_MOVES, drawn, 1, 0);
+		return drawn;
+	}
+	frame_attr(f, ATTR_PLAIN);
+	TRACE(TRACE_RENDER_MOVES, drawn, 0, 0);
+	return drawn;
+}
+
+/**
+ * Outputs the counters of both players over the line below the map.  They
+ * only grow during a game, so nothing is left over from the last ones.
+ */
+void print_score(struct frame *f, const struct score *s) {
+	int i;
+	frame_goto(f, MAP_TOP + VIEW_HEIGHT + 1, MAP_LEFT + 3);
+	for (i = 0; i < 2; i++) {
+		frame_put(f, " ", 1);
+		frame_attr(f, i ? ATTR_O : ATTR_X);
+		frame_puts(f, i ? "O" : "X");
+		frame_attr(f, ATTR_PLAIN);
+		frame_printf(f, " %u/%u/%u ",
+				s->dots[i], s->captured[i], s->enclosed[i]);
+	}
+	frame_puts(f, " dots/captured/enclosed ");
+}
+
+/**
+ * Outputs the score and the status line and moves the terminal cursor back to
+ * the map
+ * key		Game key to display
+ * score	Counters of the game
+ * player	Number of the local player
+ * cur_y, cur_x		Cursor position in map coordinates
+ * view		Part of the map on the terminal
+ */
+void print_status(
+		struct frame *f, const char *key, const struct score *score,
+		char player, int waiting_for_opponent, int cur_y, int cur_x,
+		const struct viewport *view)
+{
+	print_score(f, score);
+	frame_printf(f, "\e[24;0H\e[0KGame #%s, You: ", key);
+	frame_attr(f, (player == 1) ? ATTR_X : ATTR_O);
+	frame_puts(f, (player == 1) ? "X" : "O");
+	frame_attr(f, ATTR_PLAIN);
+	frame_puts(f, "  q:Exit  <Space>:Move  r:Redraw ");
+	/* the whole board does not fit, tell where the cursor is */
+	if (VIEW_WIDTH < MAP_WIDTH || VIEW_HEIGHT < MAP_HEIGHT)
+		frame_printf(f, "%d,%d", cur_x, cur_y);
+
+	if (waiting_for_opponent) {
+		if (player == 1)
+			frame_puts(f, "\e[24;64H\e[0KWaiting for O...");
+		else
+			frame_puts(f, "\e[24;64H\e[0KWaiting for X...");
+	}
+	frame_goto(f, cur_y - view->y + MAP_TOP + 1,
+			cur_x - view->x + MAP_LEFT + 1);
+}
+
+/**
+ * Outputs the board of a replay at its current move, with the score and the
+ * status line.  The view follows the last move.
+ * redraw	Draws the whole map, rather than the fields that have changed
+ */
+void print_replay(
+		struct frame *f, const struct replay *r, struct viewport *view,
+		int redraw)
+{
+	const struct record_board *b = &r->board;
+	int cell = b->last_cell != -1 ? b->last_cell :
+		CELL(MAP_HEIGHT / 2, MAP_WIDTH / 2);
+	if (viewport_follow(view, CELL_Y(cell), CELL_X(cell)))
+		redraw = 1;
+
+	if (redraw) {
+		frame_puts(f, "\e[0m\e[2J\e[H");
+		print_map(f, b->map, view, MAP_TOP, MAP_LEFT);
+	} else {
+		print_map_delta(f, b->map, view, MAP_TOP, MAP_LEFT);
+		/* the score shrinks going back, clear what is left of it */
+		print_border(f, MAP_TOP, MAP_LEFT);
+	}
+	print_score(f, &b->score);
+	frame_printf(f, "\e[24;0H\e[0KReplay #%s  Move %u/%u  "
+			"h/l H/L:Step  0/$:Ends  q:Stop  r:Redraw",
+			r->key, b->moves, r->moves);
+	if (b->last_cell != -1)
+		frame_goto(f, CELL_Y(cell) - view->y + MAP_TOP + 1,
+				CELL_X(cell) - view->x + MAP_LEFT + 1);
+}
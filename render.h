@@ -0,0 +1,69 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "board.h"
+#include "move_log.h"
+#include "record.h"
+#include "rules.h"
+
+/* enough for a full map with a colour change at every field */
+#define FRAME_SIZE 16384
+
+/**
+ * Output of one screen update, sent to the terminal in a single write
+ */
+struct frame {
+	char data[FRAME_SIZE];
+	size_t len;
+	/* terminal colour attribute in effect at the end of data */
+	int attr;
+};
+
+void frame_init(struct frame *f);
+
+void frame_puts(struct frame *f, const char *s);
+
+void frame_printf(struct frame *f, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+int frame_send(struct frame *f, int sock);
+
+/**
+ * Part of the map shown on a terminal.  A zeroed viewport is valid, and is
+ * moved to the cursor by the first viewport_follow.
+ */
+struct viewport {
+	/* map coordinates of the upper left field in view */
+	int y, x;
+
+	/* fields as last drawn, for delta updates */
+	char shown[VIEW_HEIGHT * VIEW_WIDTH];
+};
+
+int viewport_follow(struct viewport *view, int cur_y, int cur_x);
+
+void print_map(
+		struct frame *f, const char *map, struct viewport *view, int y, int x);
+
+int print_map_delta(
+		struct frame *f, const char *map, struct viewport *view, int y, int x);
+
+int print_moves(
+		struct frame *f, const struct move_log *log, uint32_t *cursor,
+		const char *map, struct viewport *view, int y, int x);
+
+void print_score(struct frame *f, const struct score *s);
+
+void print_status(
+		struct frame *f, const char *key, const struct score *score,
+		char player, int waiting_for_opponent, int cur_y, int cur_x,
+		const struct viewport *view);
+
+void print_replay(
+		struct frame *f, const struct replay *r, struct viewport *view,
+		int redraw);
+
+#endif
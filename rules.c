@@ -1,138 +1,353 @@
 #include "rules.h"
+#include "bitboard.h"
+#include "trace.h"
 #include <stdio.h>
+#include <string.h>
 #include "conf.h"
 #include <assert.h>
 
-#define MAP_AT(m, y, x) m[y * MAP_WIDTH + x]
+#define min(x, y) (((x) < (y)) ? (x) : (y))
+#define max(x, y) (((x) > (y)) ? (x) : (y))
+
+#define MAP_AT(m, y, x) m[CELL(y, x)]
+
+#define IS_WALL(v, own_player) \
+	((((v) & PLAYER) == (own_player)) && !((v) & DISABLED))
+
+/* a field on the border of the walls' bounds (or outside them) can not be
+   enclosed, so reaching it is as good as reaching the edge of the map */
+#define ON_EDGE(y, x) \
+	((y) <= search_bounds.top || (y) >= search_bounds.bottom - 1 || \
+	 (x) <= search_bounds.left || (x) >= search_bounds.right - 1)
 
 /**
- * Check if there is a path to the edge of the map.
- * Does not clean up flags after returning.  The function is implemented
- * using DFS.
- * Returns 1 if edge is reached, 0 otherwise.
+ * Explicit stack and list of visited cells reused by every search of a thread.
+ * A cell is visited at most once per process_map call, so neither can
+ * overflow.
  */
-int seek_exit(char *map, int y, int x, char own_player, char visited_from) {
-	char v = MAP_AT(map, y, x);
-	if (v & VISITED) return 0;
-	MAP_AT(map, y, x) |= VISITED | visited_from;
+static __thread int search_stack[MAP_CELLS];
+static __thread int search_visited[MAP_CELLS];
+static __thread int search_visited_count;
+static __thread struct dot_bounds search_bounds;
 
-	if (((v & PLAYER) == own_player) && !(v & DISABLED)) return 0;
-	if (y == 0 || y == (MAP_HEIGHT - 1) || x == 0 || x == (MAP_WIDTH - 1))
-		return 1;
+__thread struct rules_stats rules_stats;
 
-	if (
-			seek_exit(map, y, x - 1, own_player, FROM_RIGHT) ||
-			seek_exit(map, y, x + 1, own_player, FROM_LEFT) ||
-			seek_exit(map, y - 1, x, own_player, FROM_BOT) ||
-			seek_exit(map, y + 1, x, own_player, FROM_UP)) {
-		/*MAP_AT(map, y, x) |= (1 << 7);*/
-		return 1;
-	} else
-		return 0;
+int rules_engine = RULES_ENGINE;
+
+/* fields disabled by the current process_map call */
+static __thread int *captured_out;
+static __thread int captured_count;
+static __thread struct score *score_out;
+
+/**
+ * Fills dirs with the indices of the four neighbours (left, right, up, down)
+ * ordered from the farthest to the nearest edge of the search bounds, so the
+ * nearest one ends up on top of the stack.
+ */
+static void order_directions(int y, int x, int dirs[4]) {
+	int dist[4] = {
+		x - search_bounds.left, search_bounds.right - 1 - x,
+		y - search_bounds.top, search_bounds.bottom - 1 - y
+	};
+	int i, j;
+	for (i = 0; i < 4; i++)
+		dirs[i] = i;
+	for (i = 1; i < 4; i++)
+		for (j = i; j > 0 && dist[dirs[j - 1]] < dist[dirs[j]]; j--) {
+			int t = dirs[j];
+			dirs[j] = dirs[j - 1];
+			dirs[j - 1] = t;
+		}
 }
 
 /**
- * Clear the visitied flag to the root of the path
+ * Check if there is a path to the edge of the map, searching from the given
+ * field with fields occupied by own_player acting as walls.
+ * The search is an iterative DFS that always continues towards the nearest
+ * edge and stops as soon as an edge or an OPEN field is reached.  Fields it
+ * visits are flagged VISITED and appended to search_visited.  If no exit is
+ * found, those are the whole enclosed area.
+ * Returns 1 if edge is reached, 0 otherwise.
  */
-void backtrace_clear_visited(char *map, int y, int x) {
-	char v = MAP_AT(map, y, x);
-	if (!(v & VISITED))
-		return;
+static int seek_exit(char *map, int y, int x, char own_player) {
+	static const int dy[4] = { 0, 0, -1, 1 };
+	static const int dx[4] = { -1, 1, 0, 0 };
+	int top = 0;
+
+	if (IS_WALL(MAP_AT(map, y, x), own_player))
+		return 0;
 
-	MAP_AT(map, y, x) &= ~VISITED;
-	switch (v & (3 << 5)) {
-		case FROM_UP:
-			backtrace_clear_visited(map, y - 1, x); break;
-		case FROM_BOT:
-			backtrace_clear_visited(map, y + 1, x); break;
-		case FROM_LEFT:
-			backtrace_clear_visited(map, y, x - 1); break;
-		case FROM_RIGHT:
-			backtrace_clear_visited(map, y, x + 1); break;
+	MAP_AT(map, y, x) |= VISITED;
+	search_visited[search_visited_count++] = CELL(y, x);
+	if (ON_EDGE(y, x))
+		return 1;
+	search_stack[top++] = CELL(y, x);
+
+	while (top > 0) {
+		int cur = search_stack[--top];
+		int cy = CELL_Y(cur), cx = CELL_X(cur);
+		int dirs[4], i;
+		order_directions(cy, cx, dirs);
+
+		for (i = 0; i < 4; i++) {
+			int ny = cy + dy[dirs[i]], nx = cx + dx[dirs[i]];
+			char v = MAP_AT(map, ny, nx);
+			if (v & OPEN)
+				return 1;
+			if ((v & VISITED) || IS_WALL(v, own_player))
+				continue;
+
+			MAP_AT(map, ny, nx) |= VISITED;
+			search_visited[search_visited_count++] = CELL(ny, nx);
+			if (ON_EDGE(ny, nx))
+				return 1;
+			search_stack[top++] = CELL(ny, nx);
+		}
 	}
+	return 0;
 }
 
 /**
- * Mark the given field and its surroudings, up to fields occupied by own_player
- * as disabled.
- * This function is implemented using DFS.  The area must not be open.
+ * Check the area around a single neighbour of the new dot and disable it if it
+ * has been closed.  Fields of an area with an exit are flagged OPEN, those of
+ * a closed one stay VISITED, so later neighbours in the same area are skipped.
  */
-void mark_area_disabled(char *map, int y, int x, char own_player) {
+static void process_neighbour(char *map, int y, int x, char player) {
 	assert(x >= 0);
 	assert(y >= 0);
 	assert(x < MAP_WIDTH);
 	assert(y < MAP_HEIGHT);
-	char v = MAP_AT(map, y, x);
-	if ((v & VISITED) || 
-			((v & PLAYER) == own_player) && !(v & DISABLED))
+	if (MAP_AT(map, y, x) & (VISITED | OPEN))
 		return;
-	/* TODO: Test this insted of clear_flags when a closed area is found
-	if (v & VISITED) 
-		backtrace_clear_visited(map, y, x);*/
-	MAP_AT(map, y, x) |= VISITED;
 
-	mark_area_disabled(map, y - 1, x, own_player);
-	mark_area_disabled(map, y + 1, x, own_player);
-	mark_area_disabled(map, y, x - 1, own_player);
-	mark_area_disabled(map, y, x + 1, own_player);
+	int first = search_visited_count, i;
+	rules_stats.passes++;
+	if (seek_exit(map, y, x, player))
+		for (i = first; i < search_visited_count; i++)
+			map[search_visited[i]] ^= VISITED | OPEN;
+	else
+		for (i = first; i < search_visited_count; i++) {
+			int cur = search_visited[i];
+			if (!(map[cur] & DISABLED)) {
+				if (captured_out)
+					captured_out[captured_count] = cur;
+				if (score_out)
+					SCORE_DISABLED(score_out, player, map[cur]);
+				captured_count++;
+			}
+			map[cur] = (map[cur] & PLAYER) | DISABLED | VISITED;
+		}
 }
 
 /**
- * Clear working flags and mark visited fields as disabled
+ * Disables the areas closed by the dot at the given field.  The search stays
+ * within bounds, which must hold all dots of the player, or the whole map if
+ * it is NULL.  Returns the number of newly disabled fields, which are stored
+ * in captured and counted in score unless those are NULL.
  */
-void flag_visited_as_disabled(char *map) {
-	int cur;
-	for (cur = 0; cur < MAP_HEIGHT * MAP_WIDTH; cur++)
-		if (map[cur] & VISITED)
-			map[cur] = (map[cur] & PLAYER) | DISABLED;
-		else
-			map[cur] = map[cur] & (PLAYER | DISABLED);
+int process_map(char *map, int start_y, int start_x,
+		const struct dot_bounds *bounds, int *captured, struct score *score)
+{
+	char player = MAP_AT(map, start_y, start_x);
+
+	if (bounds)
+		search_bounds = *bounds;
+	else {
+		search_bounds.top = search_bounds.left = 0;
+		search_bounds.bottom = MAP_HEIGHT;
+		search_bounds.right = MAP_WIDTH;
+	}
+	search_visited_count = 0;
+	captured_out = captured;
+	captured_count = 0;
+	score_out = score;
+	if (start_x > 0)
+		process_neighbour(map, start_y, start_x - 1, player);
+	if (start_x < MAP_WIDTH - 1)
+		process_neighbour(map, start_y, start_x + 1, player);
+	if (start_y > 0)
+		process_neighbour(map, start_y - 1, start_x, player);
+	if (start_y < MAP_HEIGHT - 1)
+		process_neighbour(map, start_y + 1, start_x, player);
+
+	/* clear working flags */
+	int i;
+	for (i = 0; i < search_visited_count; i++)
+		map[search_visited[i]] &= ~(VISITED | OPEN);
+
+	rules_stats.calls++;
+	rules_stats.visited += search_visited_count;
+	rules_stats.passes++;
+	TRACE(TRACE_PROCESS_MAP, CELL(start_y, start_x), player,
+			captured_count);
+	return captured_count;
 }
 
 /**
- * Clear working flags on the map
+ * Grows the bounds to hold the given field
  */
-void clear_flags(char *map) {
-	int cur;
-	for (cur = 0; cur < MAP_HEIGHT * MAP_WIDTH; cur++)
-		map[cur] = map[cur] & (PLAYER | DISABLED);
+void dot_bounds_add(struct dot_bounds *b, int y, int x) {
+	if (b->bottom == 0) {
+		b->top = y;
+		b->left = x;
+		b->bottom = y + 1;
+		b->right = x + 1;
+	} else {
+		b->top = min(b->top, y);
+		b->left = min(b->left, x);
+		b->bottom = max(b->bottom, y + 1);
+		b->right = max(b->right, x + 1);
+	}
 }
 
-void process_map(char *map, int start_y, int start_x) {
-	char player = MAP_AT(map, start_y, start_x);
-	DBG(3, "Processing map from %d, %d, player %d\n",
-			start_x, start_y, player);
+/**
+ * Returns the root of the set containing the given field, halving the path on
+ * the way.
+ */
+static int dot_find(int *parent, int cur) {
+	while (parent[cur]) {
+		if (parent[parent[cur] - 1])
+			parent[cur] = parent[parent[cur] - 1];
+		cur = parent[cur] - 1;
+	}
+	return cur;
+}
 
-	if (start_x > 0)
-		if (!seek_exit(map, start_y, start_x - 1, player, FROM_RIGHT)) {
-			clear_flags(map);
-			mark_area_disabled(map, start_y, start_x - 1, player);
-			flag_visited_as_disabled(map);
-		} else 
-			clear_flags(map);
+/**
+ * Tells whether a new dot at the given field may have closed an area.  Areas
+ * are closed by cycles of 8-connected dots, so this is only possible if the
+ * dot joins two separate runs of its neighbours that already belong to the
+ * same set, and leaves at least two free 4-neighbours (the outside of the map
+ * counting as one) to split.  Dots are merged into the sets on the way.
+ * Sets are never split when dots are captured, which only makes the answer
+ * more conservative.
+ */
+static int join_dot(char *map, struct dot_sets *sets, int y, int x,
+		char player)
+{
+	/* neighbours clockwise from the top */
+	static const int dy[8] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+	static const int dx[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+	int *parent = sets->parent[player - 1];
+	int cell = CELL(y, x);
+	int wall[8], run[8], run_root[8];
+	int runs = 0, free4 = 0, cycle = 0, i, j;
 
-	if (start_x < MAP_WIDTH - 1)
-		if (!seek_exit(map, start_y, start_x + 1, player, FROM_LEFT)) {
-			clear_flags(map);
-			mark_area_disabled(map, start_y, start_x + 1, player);
-			flag_visited_as_disabled(map);
-		} else 
-			clear_flags(map);
+	for (i = 0; i < 8; i++) {
+		int ny = y + dy[i], nx = x + dx[i];
+		int inside = ny >= 0 && ny < MAP_HEIGHT && nx >= 0 && nx < MAP_WIDTH;
+		wall[i] = inside && IS_WALL(MAP_AT(map, ny, nx), player);
+		if (!(i & 1) && !wall[i])
+			free4++;
+	}
+	if (free4 > 0 && (y == 0 || y == MAP_HEIGHT - 1 ||
+				x == 0 || x == MAP_WIDTH - 1))
+		/* all outside fields are one area, count at most one of them */
+		free4 = free4 - (!(y > 0) + !(y < MAP_HEIGHT - 1) +
+				!(x > 0) + !(x < MAP_WIDTH - 1)) + 1;
 
-	if (start_y > 0)
-		if (!seek_exit(map, start_y - 1, start_x, player, FROM_BOT)) {
-			clear_flags(map);
-			mark_area_disabled(map, start_y - 1, start_x, player);
-			flag_visited_as_disabled(map);
-		} else 
-			clear_flags(map);
+	/* Neighbours in a ring are 8-connected to the next one, and sides are
+	   also connected to the side after the next corner.  Label runs going
+	   around, then merge the last run into the first if they touch. */
+	for (i = 0; i < 8; i++) {
+		run[i] = -1;
+		if (!wall[i])
+			continue;
+		if (i > 0 && wall[i - 1])
+			run[i] = run[i - 1];
+		else if (!(i & 1) && i > 1 && wall[i - 2])
+			run[i] = run[i - 2];
+		else
+			run[i] = runs++;
+	}
+	if (runs > 1 && run[0] != -1 && (wall[7] || wall[6])) {
+		int last = wall[7] ? run[7] : run[6];
+		for (i = 0; i < 8; i++)
+			if (run[i] == last)
+				run[i] = run[0];
+	}
 
-	if (start_y < MAP_HEIGHT - 1)
-		if (!seek_exit(map, start_y + 1, start_x, player, FROM_UP)) {
-			clear_flags(map);
-			mark_area_disabled(map, start_y + 1, start_x, player);
-			flag_visited_as_disabled(map);
-		} else 
-			clear_flags(map);
+	for (j = 0; j < runs; j++)
+		run_root[j] = -1;
+	for (i = 0; i < 8; i++) {
+		if (run[i] == -1)
+			continue;
+		int root = dot_find(parent, CELL(y + dy[i], x + dx[i]));
+		if (run_root[run[i]] == -1)
+			run_root[run[i]] = root;
+		for (j = 0; j < runs; j++)
+			if (j != run[i] && run_root[j] == root)
+				cycle = 1;
+	}
+
+	/* merge the neighbouring sets into the new dot */
+	parent[cell] = 0;
+	for (i = 0; i < 8; i++) {
+		if (run[i] == -1)
+			continue;
+		int root = dot_find(parent, CELL(y + dy[i], x + dx[i]));
+		if (root != cell)
+			parent[root] = cell + 1;
+	}
+
+	return cycle && free4 >= 2;
 }
 
+/**
+ * Places a dot of the given player and disables the areas it closes.
+ * Searches run only if the dot may have closed an area, or if it touches
+ * fields captured before, since those are the only places where a closed area
+ * can still contain fields that are not disabled.
+ * Returns the number of newly disabled fields, which are stored in captured
+ * unless it is NULL.  captured must have room for MAP_CELLS fields.  The dot
+ * and the fields are counted in score unless it is NULL.
+ */
+int place_dot(
+		char *map, struct dot_sets *sets, int y, int x, char player,
+		int *captured, struct score *score)
+{
+	int cell = CELL(y, x);
+	int search = (map[cell] & DISABLED) != 0;
+	struct dot_bounds *b = &sets->bounds[player - 1];
+
+	map[cell] = player;
+	if (score)
+		score->dots[player - 1]++;
+	dot_bounds_add(b, y, x);
+	if (join_dot(map, sets, y, x, player))
+		search = 1;
+	if (x > 0 && (MAP_AT(map, y, x - 1) & DISABLED))
+		search = 1;
+	if (x < MAP_WIDTH - 1 && (MAP_AT(map, y, x + 1) & DISABLED))
+		search = 1;
+	if (y > 0 && (MAP_AT(map, y - 1, x) & DISABLED))
+		search = 1;
+	if (y < MAP_HEIGHT - 1 && (MAP_AT(map, y + 1, x) & DISABLED))
+		search = 1;
+
+	if (search) {
+#if BITBOARD_FITS
+		if (rules_engine == 1)
+			return process_map_bitboard(map, y, x, captured, score);
+#endif
+		return process_map(map, y, x, b, captured, score);
+	}
+
+	TRACE(TRACE_DOT_NO_SEARCH, cell, player, 0);
+	return 0;
+}
+
+/**
+ * Switches the capture engine of place_dot(), "search" or "bitboard" (see
+ * RULES_ENGINE).  Returns 0 on success, -1 if the engine is unknown or does
+ * not support the board size.
+ */
+int rules_use_engine(const char *name) {
+	if (!strcmp(name, "search"))
+		rules_engine = 0;
+	else if (!strcmp(name, "bitboard") && BITBOARD_FITS)
+		rules_engine = 1;
+	else
+		return -1;
+	return 0;
+}
@@ -1,11 +1,77 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdint.h>
+
+#include "conf.h"
+#include "board.h"
+
 /* bitflags on the map field */
 #define PLAYER		3
 #define DISABLED	(1 << 3)
 #define VISITED		(1 << 4)
-#define FROM_UP		(0 << 5)
-#define FROM_BOT	(1 << 5)
-#define FROM_LEFT	(2 << 5)
-#define FROM_RIGHT	(3 << 5)
+#define OPEN		(1 << 5)
+
+/**
+ * Rectangle holding all dots of a player, bottom and right exclusive.  Zeroed
+ * for a player without dots.
+ */
+struct dot_bounds {
+	int top, left, bottom, right;
+};
+
+/**
+ * Union-find over the 8-connected dots of each player, kept alongside the map.
+ * Indexed by player - 1, each field holds its parent's index + 1 or 0 for
+ * roots, so a zeroed structure is a valid initial state.
+ */
+struct dot_sets {
+	struct dot_bounds bounds[2];
+	int parent[2][MAP_CELLS];
+};
+
+/**
+ * Running totals of each player, indexed by player - 1.  place_dot counts the
+ * dots placed and process_map the fields it disables, dots of the opponent as
+ * captured and empty fields as enclosed.  A field stays counted when a dot is
+ * placed on it later.
+ */
+struct score {
+	uint32_t dots[2];
+	uint32_t captured[2];
+	uint32_t enclosed[2];
+};
+
+/* counts a field with value v being newly disabled by the player */
+#define SCORE_DISABLED(s, player, v) \
+	(((v) & PLAYER) ? (s)->captured[(player) - 1]++ : \
+	 (s)->enclosed[(player) - 1]++)
+
+/**
+ * Work done by process_map in the calling thread, for benchmarks.  Passes
+ * are the walks over the list of visited fields that mark, disable or clear
+ * them.
+ */
+struct rules_stats {
+	unsigned long calls;
+	unsigned long visited;
+	unsigned long passes;
+};
+
+extern __thread struct rules_stats rules_stats;
+
+/* capture engine used by place_dot(), see RULES_ENGINE */
+extern int rules_engine;
+
+void dot_bounds_add(struct dot_bounds *b, int y, int x);
+
+int process_map(char *map, int start_y, int start_x,
+		const struct dot_bounds *bounds, int *captured, struct score *score);
+
+int place_dot(
+		char *map, struct dot_sets *sets, int y, int x, char player,
+		int *captured, struct score *score);
 
-void process_map(char *map, int start_y, int start_x);
+int rules_use_engine(const char *name);
 
+#endif
@@ -0,0 +1,300 @@
+#include "conf.h"
+#include "rules.h"
+#include "bitboard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Microbenchmark of the capture engines.  Replays fixed move sequences and
+ * times process_map and process_map_bitboard on every move.  Results can be
+ * saved as a baseline and compared against later runs.
+ */
+
+#define MAP_SIZE (MAP_WIDTH * MAP_HEIGHT)
+
+/* minimal time spent replaying each corpus */
+#define BENCH_MIN_SECONDS 0.2
+
+struct move {
+	short y, x;
+	char player;
+};
+
+struct corpus {
+	const char *name;
+	struct move moves[4 * MAP_SIZE];
+	int count;
+};
+
+struct result {
+	char corpus[32];
+	char engine[16];
+	int moves;
+	double ns_per_move;
+	/* search engine only, negative for the others */
+	double visited_per_move;
+	double passes_per_move;
+};
+
+/**
+ * Formats a per move count, "-" for engines that do not report it
+ */
+const char *format_count(char *buf, double v) {
+	if (v < 0)
+		return "-";
+	sprintf(buf, "%.2f", v);
+	return buf;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void add_move(struct corpus *c, int y, int x, char player) {
+	if (y < 0 || y >= MAP_HEIGHT || x < 0 || x >= MAP_WIDTH)
+		return;
+	c->moves[c->count].y = y;
+	c->moves[c->count].x = x;
+	c->moves[c->count].player = player;
+	c->count++;
+}
+
+/**
+ * Adds the border of the rectangle at the given inset from the map edge,
+ * clockwise from the top left corner.  Fields up to skip are left out, so
+ * the caller can add them last and close the rectangle.
+ */
+void add_ring(struct corpus *c, int inset, char player, int skip) {
+	int top = inset, bottom = MAP_HEIGHT - 1 - inset;
+	int left = inset, right = MAP_WIDTH - 1 - inset;
+	int y, x, n = 0;
+	for (x = left; x < right; x++, n++)
+		if (n >= skip) add_move(c, top, x, player);
+	for (y = top; y < bottom; y++, n++)
+		if (n >= skip) add_move(c, y, right, player);
+	for (x = right; x > left; x--, n++)
+		if (n >= skip) add_move(c, bottom, x, player);
+	for (y = bottom; y > top; y--, n++)
+		if (n >= skip) add_move(c, y, left, player);
+}
+
+/* dots of alternating players on random free fields */
+void corpus_random(struct corpus *c) {
+	char taken[MAP_SIZE] = { 0 };
+	int i;
+	c->name = "random";
+	srand(1);
+	for (i = 0; i < MAP_SIZE * 2 / 3; i++) {
+		int cell = rand() % MAP_SIZE;
+		if (taken[cell])
+			continue;
+		taken[cell] = 1;
+		add_move(c, cell / MAP_WIDTH, cell % MAP_WIDTH, 1 + (i & 1));
+	}
+}
+
+/*
+ * Scattered O dots, then an X rectangle around nearly the whole map.  Every
+ * wall dot searches the open interior, the last one captures all of it.
+ */
+void corpus_enclosure(struct corpus *c) {
+	int i;
+	c->name = "enclosure";
+	srand(2);
+	for (i = 0; i < MAP_SIZE / 8; i++)
+		add_move(c, 2 + rand() % (MAP_HEIGHT - 4),
+				2 + rand() % (MAP_WIDTH - 4), 2);
+	add_ring(c, 1, 1, 1);
+	add_move(c, 1, 1, 1);
+}
+
+/*
+ * Rectangles of alternating players from the centre outwards, each one
+ * closed by its last dot and capturing all the rectangles inside
+ */
+void corpus_nested(struct corpus *c) {
+	int inset;
+	c->name = "nested";
+	for (inset = (MAP_HEIGHT - 1) / 2 - 1; inset >= 0; inset--) {
+		char player = 1 + (inset & 1);
+		add_ring(c, inset, player, 1);
+		add_move(c, inset, inset, player);
+	}
+}
+
+/*
+ * Rectangles one field apart with a gap at alternating corners, forming a
+ * winding corridor.  Placed from the outside in, so dots of inner rectangles
+ * have to walk the corridor to reach the edge.
+ */
+void corpus_spiral(struct corpus *c) {
+	int inset, ring = 0;
+	c->name = "spiral";
+	for (inset = 1; inset < (MAP_HEIGHT - 1) / 2; inset += 2, ring++) {
+		int top = inset, bottom = MAP_HEIGHT - 1 - inset;
+		int left = inset, right = MAP_WIDTH - 1 - inset;
+		int gap_y = (ring & 1) ? bottom : top;
+		int gap_x = (ring & 1) ? right - 1 : left + 1;
+		int first = c->count, i, j;
+		add_ring(c, inset, 1, 0);
+		for (i = j = first; i < c->count; i++)
+			if (c->moves[i].y != gap_y || c->moves[i].x != gap_x)
+				c->moves[j++] = c->moves[i];
+		c->count = j;
+	}
+}
+
+/**
+ * Replays the corpus until BENCH_MIN_SECONDS have passed and fills in the
+ * result.  Only the search engine reports visited fields and passes, and
+ * searches within the bounds of the moving player's dots as in a game.
+ */
+void run_corpus(const struct corpus *c, int bitboard, struct result *r) {
+	static char map[MAP_CELLS];
+	double elapsed = 0;
+	long rounds = 0;
+	struct rules_stats before = rules_stats;
+
+	while (elapsed < BENCH_MIN_SECONDS) {
+		struct dot_bounds bounds[2];
+		memset(map, 0, sizeof(map));
+		memset(bounds, 0, sizeof(bounds));
+		double start = now();
+		int i;
+		for (i = 0; i < c->count; i++) {
+			const struct move *m = &c->moves[i];
+			map[CELL(m->y, m->x)] = m->player;
+			dot_bounds_add(&bounds[m->player - 1], m->y, m->x);
+#if BITBOARD_FITS
+			if (bitboard) {
+				process_map_bitboard(map, m->y, m->x, 0, 0);
+				continue;
+			}
+#endif
+			process_map(map, m->y, m->x, &bounds[m->player - 1], 0, 0);
+		}
+		elapsed += now() - start;
+		rounds++;
+	}
+
+	long moves = rounds * c->count;
+	strncpy(r->corpus, c->name, sizeof(r->corpus) - 1);
+#if BITBOARD_FITS
+	strncpy(r->engine, bitboard ? bb_engine_name() : "search",
+			sizeof(r->engine) - 1);
+#else
+	strcpy(r->engine, "search");
+#endif
+	r->moves = c->count;
+	r->ns_per_move = elapsed * 1e9 / moves;
+	r->visited_per_move = bitboard ? -1 :
+		(double)(rules_stats.visited - before.visited) / moves;
+	r->passes_per_move = bitboard ? -1 :
+		(double)(rules_stats.passes - before.passes) / moves;
+}
+
+/**
+ * Saves the results as tab separated lines
+ * Returns 0 on success, -1 on failure.
+ */
+int save_results(const char *path, struct result *r, int count) {
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror("rules_bench: fopen");
+		return -1;
+	}
+	fprintf(f, "# corpus\tengine\tmoves\tns_per_move\tvisited_per_move\t"
+			"passes_per_move\n");
+	char visited[32], passes[32];
+	int i;
+	for (i = 0; i < count; i++)
+		fprintf(f, "%s\t%s\t%d\t%.1f\t%s\t%s\n", r[i].corpus,
+				r[i].engine, r[i].moves, r[i].ns_per_move,
+				format_count(visited, r[i].visited_per_move),
+				format_count(passes, r[i].passes_per_move));
+	return fclose(f);
+}
+
+/**
+ * Returns the baseline's time for the corpus and engine, 0 if it has none
+ */
+double baseline_ns(const char *path, const struct result *r) {
+	FILE *f = fopen(path, "r");
+	char line[256], corpus[32], engine[16];
+	double ns = 0, v;
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (line[0] != '#' && sscanf(line, "%31s %15s %*d %lf",
+					corpus, engine, &v) == 3 &&
+				!strcmp(corpus, r->corpus) && !strcmp(engine, r->engine))
+			ns = v;
+	fclose(f);
+	return ns;
+}
+
+void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [-o results] [-b baseline]\n"
+			"  -o results   save the results to a file\n"
+			"  -b baseline  compare against results saved before\n",
+			name);
+}
+
+int main(int argc, char *argv[]) {
+	const char *out_path = 0, *baseline_path = 0;
+	int opt;
+#if BITBOARD_FITS
+	bb_init();
+#endif
+	while ((opt = getopt(argc, argv, "o:b:")) != -1) {
+		switch (opt) {
+			case 'o': out_path = optarg; break;
+			case 'b': baseline_path = optarg; break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	static struct corpus corpora[4];
+	void (*build[4])(struct corpus*) = {
+		corpus_random, corpus_enclosure, corpus_nested, corpus_spiral };
+	struct result results[8];
+	char visited[32], passes[32];
+	int count = 0, i, bitboard;
+
+	memset(results, 0, sizeof(results));
+	printf("%-10s %-8s %6s %12s %10s %8s", "corpus", "engine", "moves",
+			"ns/move", "visited", "passes");
+	if (baseline_path)
+		printf(" %10s", "baseline");
+	printf("\n");
+
+	for (i = 0; i < 4; i++) {
+		build[i](&corpora[i]);
+		/* the bitboard engine only builds for small boards */
+		for (bitboard = 0; bitboard <= BITBOARD_FITS; bitboard++) {
+			struct result *r = &results[count++];
+			run_corpus(&corpora[i], bitboard, r);
+			printf("%-10s %-8s %6d %12.1f %10s %8s", r->corpus,
+					r->engine, r->moves, r->ns_per_move,
+					format_count(visited, r->visited_per_move),
+					format_count(passes, r->passes_per_move));
+			double base = baseline_path ? baseline_ns(baseline_path, r) : 0;
+			if (base > 0)
+				printf(" %+9.1f%%", (r->ns_per_move / base - 1) * 100);
+			printf("\n");
+		}
+	}
+
+	if (out_path && save_results(out_path, results, count) == -1)
+		return 1;
+	return 0;
+}
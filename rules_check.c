@@ -0,0 +1,202 @@
+#include "conf.h"
+#include "rules.h"
+#include "bitboard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Differential check of the capture engines.  Plays random games through
+ * place_dot() with every engine, next to a plain recursive search that looks
+ * at every area around every move, and compares the boards, the scores and
+ * the captured fields after each move.
+ */
+
+/* games played by default */
+#define CHECK_GAMES 200
+
+/* largest part of the board a game is played on, so games get crowded */
+#define CHECK_AREA_WIDTH 40
+#define CHECK_AREA_HEIGHT 30
+
+struct board {
+	char map[MAP_CELLS];
+	struct dot_sets sets;
+	struct score score;
+	int captured[MAP_CELLS];
+	int count;
+};
+
+/* engines as place_dot() runs them, by rules_engine and bb_use_engine() */
+static const char *engine_names[] = {
+	"search",
+#if BITBOARD_FITS
+	"scalar", "sse2", "avx2"
+#endif
+};
+#define ENGINES (sizeof(engine_names) / sizeof(engine_names[0]))
+
+static struct board boards[ENGINES], reference;
+static int available[ENGINES];
+
+/* fields of the area being filled by the reference, and the search they
+   were last seen by */
+static int area[MAP_CELLS];
+static int area_count;
+static unsigned int seen[MAP_CELLS], search;
+
+/**
+ * Collects the area of fields reachable from the given one without crossing
+ * a dot of the player that has not been captured.
+ * Returns 1 if the area reaches the edge of the map, 0 otherwise.
+ */
+static int reference_fill(const char *map, int y, int x, char player) {
+	int cell = CELL(y, x);
+	if (y < 0 || y >= MAP_HEIGHT || x < 0 || x >= MAP_WIDTH ||
+			seen[cell] == search)
+		return 0;
+	seen[cell] = search;
+	if ((map[cell] & PLAYER) == player && !(map[cell] & DISABLED))
+		return 0;
+
+	area[area_count++] = cell;
+	int edge = y == 0 || y == MAP_HEIGHT - 1 || x == 0 || x == MAP_WIDTH - 1;
+	edge |= reference_fill(map, y, x - 1, player);
+	edge |= reference_fill(map, y, x + 1, player);
+	edge |= reference_fill(map, y - 1, x, player);
+	edge |= reference_fill(map, y + 1, x, player);
+	return edge;
+}
+
+/**
+ * Places a dot and disables every area around it that does not reach the
+ * edge, as place_dot() should
+ */
+static void reference_place(struct board *b, int y, int x, char player) {
+	static const int dy[4] = { 0, 0, -1, 1 };
+	static const int dx[4] = { -1, 1, 0, 0 };
+	int i, j;
+
+	b->map[CELL(y, x)] = player;
+	b->score.dots[player - 1]++;
+	b->count = 0;
+	search++;
+	for (i = 0; i < 4; i++) {
+		area_count = 0;
+		if (reference_fill(b->map, y + dy[i], x + dx[i], player))
+			continue;
+		for (j = 0; j < area_count; j++) {
+			int cell = area[j];
+			if (!(b->map[cell] & DISABLED)) {
+				b->captured[b->count++] = cell;
+				SCORE_DISABLED(&b->score, player, b->map[cell]);
+			}
+			b->map[cell] = (b->map[cell] & PLAYER) | DISABLED;
+		}
+	}
+}
+
+static int compare_cells(const void *a, const void *b) {
+	return *(const int*)a - *(const int*)b;
+}
+
+/**
+ * Switches place_dot() to the i-th engine.  Returns 0 on success, -1 if it
+ * is not available on this machine.
+ */
+static int use_engine(int i) {
+#if BITBOARD_FITS
+	if (i > 0) {
+		rules_engine = 1;
+		return bb_use_engine(engine_names[i]);
+	}
+#endif
+	rules_engine = 0;
+	return 0;
+}
+
+/**
+ * Plays a game of random moves within a random part of the board.
+ * Returns 0 if all engines agree with the reference, -1 otherwise.
+ */
+static int play_game(int game) {
+	int width = 4 + rand() % (CHECK_AREA_WIDTH - 3);
+	int height = 4 + rand() % (CHECK_AREA_HEIGHT - 3);
+	width = width < MAP_WIDTH ? width : MAP_WIDTH;
+	height = height < MAP_HEIGHT ? height : MAP_HEIGHT;
+	int top = rand() % (MAP_HEIGHT - height + 1);
+	int left = rand() % (MAP_WIDTH - width + 1);
+	int moves = width * height * (50 + rand() % 40) / 100;
+	int move, i;
+
+	memset(boards, 0, sizeof(boards));
+	memset(&reference, 0, sizeof(reference));
+	for (move = 0; move < moves; move++) {
+		int y = top + rand() % height, x = left + rand() % width;
+		char player = 1 + (move & 1);
+		/* dots go on empty fields, enclosed ones too */
+		if (reference.map[CELL(y, x)] & PLAYER)
+			continue;
+
+		reference_place(&reference, y, x, player);
+		qsort(reference.captured, reference.count, sizeof(int),
+				compare_cells);
+		for (i = 0; i < ENGINES; i++) {
+			struct board *b = &boards[i];
+			if (!available[i])
+				continue;
+			use_engine(i);
+			b->count = place_dot(b->map, &b->sets, y, x, player,
+					b->captured, &b->score);
+			qsort(b->captured, b->count, sizeof(int), compare_cells);
+			if (b->count != reference.count ||
+					memcmp(b->captured, reference.captured,
+						b->count * sizeof(int)) ||
+					memcmp(&b->score, &reference.score, sizeof(b->score)) ||
+					memcmp(b->map, reference.map, sizeof(b->map))) {
+				fprintf(stderr, "game %d, move %d at %d,%d: %s captured %d "
+						"fields, the reference %d\n", game, move, y, x,
+						engine_names[i], b->count, reference.count);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [-g games] [-s seed]\n"
+			"  -g games  games to play, default %d\n"
+			"  -s seed   seed of the random games, default 1\n",
+			name, CHECK_GAMES);
+}
+
+int main(int argc, char *argv[]) {
+	int games = CHECK_GAMES, seed = 1, opt, i;
+	while ((opt = getopt(argc, argv, "g:s:")) != -1) {
+		switch (opt) {
+			case 'g': games = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	printf("%dx%d board, engines:", MAP_WIDTH, MAP_HEIGHT);
+	for (i = 0; i < ENGINES; i++) {
+		available[i] = use_engine(i) == 0;
+		printf(" %s%s", engine_names[i], available[i] ? "" : " (not available)");
+	}
+	printf("\n");
+
+	srand(seed);
+	for (i = 0; i < games; i++)
+		if (play_game(i) == -1)
+			return 1;
+	printf("%d games, all engines match the reference\n", games);
+	return 0;
+}
@@ -0,0 +1,202 @@
+#include "conf.h"
+#include "telnet_input.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+/* telnet commands, RFC 854 */
+#define IAC 255
+#define DONT 254
+#define DO 253
+#define WONT 252
+#define WILL 251
+#define SB 250
+#define SE 240
+
+enum INPUT_STATE {
+	INPUT_DATA = 0,
+	/* after CR, which may be followed by NUL or LF */
+	INPUT_CR,
+	/* after IAC */
+	INPUT_IAC,
+	/* after WILL, WONT, DO or DONT, before the option */
+	INPUT_OPTION,
+	/* in a subnegotiation, and after IAC in one */
+	INPUT_SB,
+	INPUT_SB_IAC,
+	/* after ESC, after ESC [ and after ESC O */
+	INPUT_ESC,
+	INPUT_CSI,
+	INPUT_SS3
+};
+
+static void add_key(struct telnet_input *in, int key) {
+	in->keys[in->count++] = key;
+}
+
+/**
+ * Returns the cursor key ending an escape sequence, 0 for other keys
+ */
+static int cursor_key(unsigned char c) {
+	switch (c) {
+		case 'A': return KEY_UP;
+		case 'B': return KEY_DOWN;
+		case 'C': return KEY_RIGHT;
+		case 'D': return KEY_LEFT;
+		default: return 0;
+	}
+}
+
+/**
+ * Decodes bytes from the client and queues their keys.  Each byte makes at
+ * most one key, and the first may also release an ESC left pending by the
+ * previous call, so the queue must have room for len + 1 keys.
+ * Returns the number of keys queued.
+ */
+int telnet_input_feed(
+		struct telnet_input *in, const unsigned char *buf, size_t len)
+{
+	int start = in->count;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+		if (c == IAC && in->state != INPUT_IAC &&
+				in->state != INPUT_OPTION && in->state != INPUT_SB &&
+				in->state != INPUT_SB_IAC) {
+			/* commands may come in the middle of anything else, which
+			   carries on after them */
+			in->resume = in->state;
+			in->state = INPUT_IAC;
+			continue;
+		}
+
+		switch (in->state) {
+			case INPUT_CR:
+				in->state = INPUT_DATA;
+				if (c == 0 || c == '\n')
+					break;
+				/* fall through */
+			case INPUT_DATA:
+				if (c == 0x1b)
+					in->state = INPUT_ESC;
+				else {
+					add_key(in, c);
+					if (c == '\r')
+						in->state = INPUT_CR;
+				}
+				break;
+
+			case INPUT_IAC:
+				if (c == IAC) {
+					/* an escaped data byte, which ends an escape sequence */
+					if (in->resume == INPUT_ESC)
+						add_key(in, 0x1b);
+					add_key(in, c);
+					in->state = INPUT_DATA;
+				} else if (c >= WILL && c <= DONT)
+					in->state = INPUT_OPTION;
+				else if (c == SB)
+					in->state = INPUT_SB;
+				else
+					in->state = in->resume;
+				break;
+			case INPUT_OPTION:
+				in->state = in->resume;
+				break;
+			case INPUT_SB:
+				if (c == IAC)
+					in->state = INPUT_SB_IAC;
+				break;
+			case INPUT_SB_IAC:
+				in->state = c == SE ? in->resume : INPUT_SB;
+				break;
+
+			case INPUT_ESC:
+				if (c == '[')
+					in->state = INPUT_CSI;
+				else if (c == 'O')
+					in->state = INPUT_SS3;
+				else {
+					/* ESC on its own, the byte after it is a key */
+					add_key(in, 0x1b);
+					in->state = INPUT_DATA;
+					i--;
+				}
+				break;
+			case INPUT_CSI:
+				/* parameters and intermediate bytes up to the final one */
+				if (c >= 0x40 && c <= 0x7e) {
+					if (cursor_key(c))
+						add_key(in, cursor_key(c));
+					in->state = INPUT_DATA;
+				}
+				break;
+			case INPUT_SS3:
+				if (cursor_key(c))
+					add_key(in, cursor_key(c));
+				in->state = INPUT_DATA;
+				break;
+		}
+	}
+	return in->count - start;
+}
+
+/**
+ * Reads what the client has sent, as much as there is room for in the
+ * queue, and queues its keys.  A slot is kept free for an ESC pending from
+ * the last read.
+ * flags	passed on to recv(), e.g. MSG_DONTWAIT
+ * Returns the number of bytes read, 0 if the connection is closed, -1 on
+ * failure.
+ */
+ssize_t telnet_input_read(struct telnet_input *in, int sock, int flags) {
+	unsigned char buf[TELNET_INPUT_SIZE];
+	if (in->next > 0) {
+		memmove(in->keys, in->keys + in->next,
+				(in->count - in->next) * sizeof(*in->keys));
+		in->count -= in->next;
+		in->next = 0;
+	}
+	if (in->count >= TELNET_INPUT_SIZE - 1) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	ssize_t n = recv(sock, buf, TELNET_INPUT_SIZE - in->count - 1, flags);
+	if (n > 0) {
+		int keys = telnet_input_feed(in, buf, n);
+		TRACE(TRACE_INPUT, sock, n, keys);
+	}
+	return n;
+}
+
+/**
+ * Returns the number of keys queued
+ */
+int telnet_input_pending(const struct telnet_input *in) {
+	return in->count - in->next;
+}
+
+/**
+ * Takes the next key off the queue.  Returns the key, -1 if there is none.
+ */
+int telnet_input_next(struct telnet_input *in) {
+	if (in->next == in->count)
+		return -1;
+	return in->keys[in->next++];
+}
+
+/**
+ * Takes the next key, reading from the client until there is one.
+ * Returns the key, -1 if the connection is closed or has failed.
+ */
+int telnet_getkey(struct telnet_input *in, int sock) {
+	while (!telnet_input_pending(in)) {
+		ssize_t n = telnet_input_read(in, sock, 0);
+		if (n == 0 || (n == -1 && errno != EINTR))
+			return -1;
+	}
+	return telnet_input_next(in);
+}
@@ -0,0 +1,43 @@
+#ifndef TELNET_INPUT_H
+#define TELNET_INPUT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "conf.h"
+
+/* keys decoded from escape sequences, past the range of single bytes */
+#define KEY_UP 0x101
+#define KEY_DOWN 0x102
+#define KEY_RIGHT 0x103
+#define KEY_LEFT 0x104
+
+/**
+ * Input from a telnet client, decoded into keys.  Telnet commands and option
+ * negotiation are dropped, CR NUL and CR LF become a single CR, and the
+ * cursor keys' escape sequences become KEY_* codes.  Sequences may be split
+ * across reads.  A zeroed structure is a valid initial state.
+ */
+struct telnet_input {
+	int state;
+
+	/* state a telnet command interrupted, resumed after it */
+	int resume;
+
+	/* keys decoded and not taken yet, from next to count */
+	int keys[TELNET_INPUT_SIZE];
+	int next, count;
+};
+
+ssize_t telnet_input_read(struct telnet_input *in, int sock, int flags);
+
+int telnet_input_feed(
+		struct telnet_input *in, const unsigned char *buf, size_t len);
+
+int telnet_input_pending(const struct telnet_input *in);
+
+int telnet_input_next(struct telnet_input *in);
+
+int telnet_getkey(struct telnet_input *in, int sock);
+
+#endif
@@ -0,0 +1,144 @@
+#include "conf.h"
+#include "telnet_input.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/*
+ * Checks the telnet input decoder on input split across reads: sequences cut
+ * between two reads, telnet commands in the middle of escape sequences and a
+ * full queue after a pending ESC.
+ */
+
+#define IAC "\xff"
+#define NOP "\xf1"
+#define WILL "\xfb"
+#define SB "\xfa"
+#define SE "\xf0"
+
+static int failures;
+
+/**
+ * Feeds the chunks one after another and compares the keys queued with the
+ * expected ones, ended by -1
+ */
+static void check_feed(const char *name, const char *const *chunks,
+		const int *expected)
+{
+	struct telnet_input in;
+	int i, n = 0;
+	memset(&in, 0, sizeof(in));
+	for (i = 0; chunks[i]; i++)
+		telnet_input_feed(&in, (const unsigned char*)chunks[i],
+				strlen(chunks[i]));
+	for (i = 0; expected[i] != -1; i++) {
+		int key = telnet_input_next(&in);
+		if (key != expected[i]) {
+			fprintf(stderr, "%s: key %d is %d, expected %d\n", name, i, key,
+					expected[i]);
+			failures++;
+			return;
+		}
+		n++;
+	}
+	if (telnet_input_pending(&in)) {
+		fprintf(stderr, "%s: %d keys left over after %d\n", name,
+				telnet_input_pending(&in), n);
+		failures++;
+	}
+}
+
+/**
+ * Sends an ESC on its own and then more than the queue holds, so the ESC is
+ * pending when the queue is filled by the next read
+ */
+static void check_full_queue() {
+	struct telnet_input in;
+	char buf[TELNET_INPUT_SIZE * 2];
+	int sv[2], i;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		perror("socketpair");
+		failures++;
+		return;
+	}
+	memset(&in, 0, sizeof(in));
+	memset(buf, 'a', sizeof(buf));
+
+	if (write(sv[1], "\x1b", 1) != 1 ||
+			telnet_input_read(&in, sv[0], 0) != 1 ||
+			write(sv[1], buf, sizeof(buf)) != sizeof(buf)) {
+		perror("full queue");
+		failures++;
+		goto out;
+	}
+	ssize_t n = telnet_input_read(&in, sv[0], 0);
+	if (in.count > TELNET_INPUT_SIZE || in.next != 0 ||
+			n != TELNET_INPUT_SIZE - 1) {
+		fprintf(stderr, "full queue: read %zd bytes, count %d, next %d\n",
+				n, in.count, in.next);
+		failures++;
+		goto out;
+	}
+	if (telnet_input_read(&in, sv[0], 0) != -1 || errno != ENOBUFS) {
+		fputs("full queue: read past the end of the queue\n", stderr);
+		failures++;
+		goto out;
+	}
+	if (telnet_input_next(&in) != 0x1b) {
+		fputs("full queue: the pending ESC is lost\n", stderr);
+		failures++;
+		goto out;
+	}
+	for (i = 1; telnet_input_next(&in) == 'a'; i++)
+		;
+	/* the queue is emptied, so the rest is read as before */
+	n = telnet_input_read(&in, sv[0], MSG_DONTWAIT);
+	if (i != TELNET_INPUT_SIZE || n != TELNET_INPUT_SIZE - 1 ||
+			telnet_input_pending(&in) != n) {
+		fprintf(stderr, "full queue: %d keys, then %zd bytes\n", i, n);
+		failures++;
+	}
+out:
+	close(sv[0]);
+	close(sv[1]);
+}
+
+int main() {
+	static const struct {
+		const char *name;
+		const char *chunks[4];
+		int keys[8];
+	} cases[] = {
+		{ "cursor key", { "\x1b[A" }, { KEY_UP, -1 } },
+		{ "ESC at the end of a read", { "x\x1b", "[B" },
+			{ 'x', KEY_DOWN, -1 } },
+		{ "ESC then a plain key", { "\x1b", "q" }, { 0x1b, 'q', -1 } },
+		{ "CSI split after [", { "\x1b[", "C" }, { KEY_RIGHT, -1 } },
+		{ "SS3", { "\x1bO", "D" }, { KEY_LEFT, -1 } },
+		{ "CSI with parameters", { "\x1b[1;5", "A" }, { KEY_UP, -1 } },
+		{ "IAC in CSI", { "\x1b[" IAC NOP "A" }, { KEY_UP, -1 } },
+		{ "IAC after ESC, split", { "\x1b" IAC, NOP "[D" },
+			{ KEY_LEFT, -1 } },
+		{ "option in CSI", { "\x1b[" IAC WILL, "\x01" "B" },
+			{ KEY_DOWN, -1 } },
+		{ "subnegotiation in CSI",
+			{ "\x1b[" IAC SB "\x18", "xterm" IAC SE "C" }, { KEY_RIGHT, -1 } },
+		{ "escaped IAC after ESC", { "\x1b" IAC IAC }, { 0x1b, 0xff, -1 } },
+		{ "CR LF split", { "a\r", "\nb" }, { 'a', '\r', 'b', -1 } },
+		{ "IAC between CR and LF", { "\r" IAC NOP, "\n" }, { '\r', -1 } },
+	};
+	int i;
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		check_feed(cases[i].name, cases[i].chunks, cases[i].keys);
+	check_full_queue();
+
+	if (failures) {
+		fprintf(stderr, "%d telnet input checks failed\n", failures);
+		return 1;
+	}
+	printf("telnet input decoded as expected\n");
+	return 0;
+}
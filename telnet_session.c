@@ -1,15 +1,25 @@
 #include "conf.h"
+#include "arena.h"
+#include "feed.h"
 #include "game_manager.h"
 #include "ipc_message.h"
+#include "record.h"
+#include "render.h"
 #include "rules.h"
+#include "telnet_input.h"
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <errno.h>
+#include <poll.h>
+#include <string.h>
 #include <unistd.h>
-#include <signal.h>
-#include <sys/shm.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 
 #define min(x, y) (((x) < (y)) ? (x) : (y))
@@ -19,12 +29,38 @@ pid_t own_pid = 0;
 char own_player_num = 0;
 
 /**
- * Shared memory segment containing the game's map
+ * Arena slot containing the game's map
  */
 struct game *own_game = 0;
 char *map = 0;
 
-volatile sig_atomic_t map_updated = 0;
+/**
+ * Part of the map on the terminal, with its fields as last drawn
+ */
+struct viewport view;
+
+/* moves read from the game's log */
+uint32_t log_cursor;
+
+/**
+ * Screen updates are rendered here and sent with a single write
+ */
+struct frame screen;
+
+/**
+ * Keys typed by the user, read in batches
+ */
+struct telnet_input input;
+
+/**
+ * Eventfd written by the opponent after a move and by the manager when the
+ * opponent leaves
+ */
+int poke_fd = -1;
+
+/* opponent's eventfd, fetched from the manager on the first move */
+int opponent_poke_fd = -1;
+
 int waiting_for_opponent = 0;
 
 /**
@@ -34,17 +70,17 @@ char map_get(int y, int x) {
 	if (!map)
 		return 0;
 	else
-		return map[y * MAP_WIDTH + x];
+		return map[CELL(y, x)];
 }
 
 void poke_opponent() {
-	if (own_pid == own_game->sessions[0] &&
-			own_game->sessions[1] != 0)
-		kill(own_game->sessions[1], SIGUSR1);
-	else if (own_pid == own_game->sessions[1])
-		kill(own_game->sessions[0], SIGUSR1);
-	else
+	uint64_t one = 1;
+	if (opponent_poke_fd == -1)
+		opponent_poke_fd = get_opponent_poke(own_pid);
+	if (opponent_poke_fd == -1) {
 		DBG(2, "Noone to poke\n");
+	} else if (write(opponent_poke_fd, &one, sizeof(one)) == -1)
+		perror("client: poke");
 }
 
 /**
@@ -54,218 +90,476 @@ void poke_opponent() {
 void map_set(int y, int x, char v) {
 	assert(map != 0);
 
-	map[y * MAP_WIDTH + x] = v;
-	process_map(map, y, x);
+	static int captured[MAP_CELLS];
+	int count = place_dot(map, &own_game->dots, y, x, v, captured,
+			&own_game->score);
+	move_log_append(&own_game->log, CELL(y, x), v, captured, count);
+	feed_publish(&own_game->feed, &own_game->log, map, &own_game->score,
+			3 - v);
 
 	poke_opponent();
 }
 
 /**
- * Requests the game's shared memory segment from the game manager.
+ * Attaches to the game in the arena slot.
  * Returns 0 on success, -1 on failure.
  */
-int init_map() {
-	int shmid = get_map_shm(own_pid);
-	if (shmid == -1) {
+int init_game(int slot) {
+	own_game = arena_game(slot);
+	if (!own_game)
 		return -1;
-	}
-	own_game = (struct game*)shmat(shmid, 0, 0);
 	map = own_game->map;
-	if (map == (char*)-1) {
-		perror("client: shmat");
-		exit(1);
-	}
 
 	own_player_num = (own_game->sessions[0] == own_pid) ? 1 : 2;
+
+	/* forget pokes from the previous game.  Moves made before that are
+	   already in the log. */
+	uint64_t pokes;
+	if (read(poke_fd, &pokes, sizeof(pokes)) == -1 && errno != EAGAIN)
+		perror("client: read");
+
+	/* the host moves first, a player rejoining a game waits if they made
+	   the last move */
+	char last = move_log_last_player(&own_game->log);
+	waiting_for_opponent = last ? last == own_player_num : own_player_num == 1;
 	return 0;
 }
 
 /**
- * Handle SIGUSR1 meaning the other player has made a move
+ * Requests the game's arena slot from the game manager.
+ * Returns 0 on success, -1 on failure.
  */
-void handle_signal_poke(int sig) {
-	map_updated = 1;
+int init_map() {
+	return init_game(get_game_slot(own_pid));
 }
 
 /**
- * Outputs the full map state to the terminal
- * out		Output stream to the terminal
- * y, x		Position of map's upper left corner in terminal coordinates
+ * Reads a game key typed in by the user into game_key, which must have room
+ * for 7 characters.  Returns 0 on success, -1 if the key is invalid.
  */
-void print_map(FILE* out, int y, int x) {
-	int i, j;
-	
-	fprintf(out, "\e[%d;%dH", y + MAP_HEIGHT + 1, x);
-	for (j = 0; j < MAP_WIDTH; j++)
-		fputs("=", out);
-
-	for (i = 0; i < MAP_HEIGHT; i++) {
-		fprintf(out, "\e[%d;%dH", i + y + 1, x + 1);
-		for (j = 0; j < MAP_WIDTH; j++) {
-			char field = map_get(i, j);
-			/* for colourful background:
-			if ((i+j)%2) fputs("\e[46m", out);
-			else fputs("\e[47m", out); */
-			if ((field & PLAYER) == 1) 
-				if (field & DISABLED)
-					fputs("\e[0mx", out);
-				else
-					fputs("\e[1;32mX", out);
-			else if ((field & PLAYER) == 2)
-				if (field & DISABLED)
-					fputs("\e[0mo", out);
-				else
-					fputs("\e[1;34mO", out);
-			/*else if (map_get(i, j) & (1 << 7)) fputs("\e[0m.", out);*/
-			else fputs(" ", out);
-		}
+int session_read_key(FILE* out, int sock, char *game_key) {
+	int i;
+	fputs("\r\nEnter game key: ", out);
+	fflush(out);
+	for(i = 0; i < 6; i++) {
+		int key = telnet_getkey(&input, sock);
+		if (key < 'a' || key > 'z')
+			return -1;
+		game_key[i] = key;
+		fputc(key, out);
+		fflush(out);
 	}
-	fputs("\e[0m", out);
+	game_key[6] = 0;
+	return 0;
 }
 
 int session_join(FILE* out, int sock) {
 	char game_key[7] = "";
-	int i;
-	fputs("\r\nEnter game key: ", out);
+	if (session_read_key(out, sock, game_key) == -1)
+		return -1;
+	notify_join_game(own_pid, game_key, poke_fd);
+	return 0;
+}
+
+/**
+ * Gets an opponent from the manager's quick-match queue, waiting for one
+ * until the user gives up with q.
+ * Returns 0 once in a game, -1 if the user has given up.
+ */
+int session_match(FILE* out, int sock) {
+	int slot = request_match(own_pid, poke_fd);
+	if (slot == MATCH_FAILED) {
+		fputs("\r\nNo match", out);
+		return -1;
+	}
+	if (slot == MATCH_WAITING) {
+		struct pollfd fds[2] = {
+			{ .fd = sock, .events = POLLIN },
+			{ .fd = poke_fd, .events = POLLIN } };
+		uint64_t pokes;
+		fputs("\r\nWaiting for an opponent, [q] to cancel", out);
+		fflush(out);
+		while (slot < 0) {
+			ssize_t status = 1;
+			if (!telnet_input_pending(&input)) {
+				if (poll(fds, 2, -1) == -1) {
+					if (errno == EINTR)
+						continue;
+					perror("client: poll");
+					slot = cancel_match(own_pid);
+					break;
+				}
+				if (fds[1].revents & POLLIN) {
+					/* the manager pokes once the game has been set up */
+					if (read(poke_fd, &pokes, sizeof(pokes)) == -1)
+						continue;
+					slot = get_game_slot(own_pid);
+					continue;
+				}
+				status = telnet_input_read(&input, sock, 0);
+				if (status == -1 && errno == EINTR)
+					continue;
+			}
+			int key;
+			while ((key = telnet_input_next(&input)) != -1 && key != 'q')
+				;
+			if (status > 0 && key != 'q')
+				continue;
+			/* an opponent may have been found meanwhile */
+			slot = cancel_match(own_pid);
+			if (status <= 0) {
+				/* the connection is gone, leave the game to the opponent */
+				if (slot >= 0)
+					notify(own_pid, MSG_SESSION_QUIT);
+				exit(1);
+			}
+			break;
+		}
+	}
+	return init_game(slot);
+}
+
+/**
+ * Sends the whole iovec, which holds len bytes
+ * Returns 0 on success, -1 on failure.
+ */
+int send_iov(int sock, struct iovec *iov, int count, size_t len) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	while (len > 0) {
+		ssize_t r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		len -= r;
+		while (msg.msg_iovlen > 0 && r >= msg.msg_iov->iov_len) {
+			r -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + r;
+			msg.msg_iov->iov_len -= r;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Shows a game until it ends or the spectator leaves.  The players render
+ * each update once into the game's feed, this only passes the bytes on,
+ * looking for new ones every SPECTATE_TICK ms.
+ * Returns 0 when the spectator is back at the menu, -1 if the connection is
+ * gone.
+ */
+int session_spectate(FILE* out, int sock, struct game *g, const char *key) {
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	uint32_t cursor = 0;
+	int redraw = 1;
+
 	fflush(out);
-	for(i = 0; i < 6; i++) {
-		if (recv(sock, game_key + i, 1, 0) != 1)
+	frame_init(&screen);
+	view.y = FEED_VIEW_Y;
+	view.x = FEED_VIEW_X;
+	while (1) {
+		if (g->state != GAME_ACTIVE || strcmp(g->key, key) != 0) {
+			frame_puts(&screen, "\e[0m\e[2J\e[HThe game is over\r\n");
+			frame_send(&screen, sock);
+			return 0;
+		}
+
+		feed_watch(&g->feed);
+		if (redraw) {
+			/* output published while the map is drawn is sent as well,
+			   drawing those fields twice does no harm */
+			cursor = feed_head(&g->feed);
+			frame_puts(&screen, "\e[0m\e[2J\e[H");
+			print_map(&screen, g->map, &view, MAP_TOP, MAP_LEFT);
+			print_score(&screen, &g->score);
+			frame_printf(&screen, "\e[24;0H\e[0KWatching game #%s  "
+					"q:Stop watching  r:Redraw", key);
+			if (frame_send(&screen, sock) == -1)
+				return -1;
+			redraw = 0;
+		} else {
+			struct iovec iov[2];
+			ssize_t len = feed_peek(&g->feed, cursor, iov);
+			if (len > 0 && send_iov(sock, iov, 2, len) == -1)
+				return -1;
+			if (len == -1 || feed_overrun(&g->feed, cursor)) {
+				redraw = 1;
+				continue;
+			}
+			cursor += len;
+		}
+
+		if (!telnet_input_pending(&input)) {
+			if (poll(&pfd, 1, SPECTATE_TICK) == -1) {
+				if (errno == EINTR)
+					continue;
+				perror("client: poll");
+				return -1;
+			}
+			ssize_t status = 0;
+			if (pfd.revents)
+				status = telnet_input_read(&input, sock, 0);
+			if (pfd.revents && (status == 0 ||
+						(status == -1 && errno != EINTR)))
+				return -1;
+		}
+		int key;
+		while ((key = telnet_input_next(&input)) != -1) {
+			if (key == 'q') {
+				frame_puts(&screen, "\e[0m\e[2J\e[H");
+				frame_send(&screen, sock);
+				return 0;
+			}
+			if (key == 'r' || key == 0x0c)
+				redraw = 1;
+		}
+	}
+}
+
+/**
+ * Replays a recorded game, moving through it on the keys of replay_input(),
+ * until the user leaves.
+ * Returns 0 when the user is back at the menu, -1 if the connection is gone.
+ */
+int session_replay(FILE* out, int sock, struct replay *r) {
+	int redraw = 1;
+
+	fflush(out);
+	frame_init(&screen);
+	memset(&view, 0, sizeof(view));
+	while (1) {
+		print_replay(&screen, r, &view, redraw);
+		if (frame_send(&screen, sock) == -1)
 			return -1;
-		if (game_key[i] < 'a' || game_key[i] > 'z')
+		redraw = 0;
+
+		/* all keys read together make one screen update */
+		int key = telnet_getkey(&input, sock);
+		if (key == -1)
 			return -1;
-		fputc(game_key[i], out);
-		fflush(out);
+		do {
+			if (key == 'q') {
+				frame_puts(&screen, "\e[0m\e[2J\e[H");
+				frame_send(&screen, sock);
+				return 0;
+			}
+			if (key == 'r' || key == 0x0c)
+				redraw = 1;
+			else if (key < 0x100)
+				replay_input(r, key);
+		} while ((key = telnet_input_next(&input)) != -1);
 	}
-	game_key[7] = 0;
-	notify_join_game(own_pid, game_key);
-	return 0;
 }
 
-void session_start(FILE* out, int sock) {
+void session_print_menu(FILE* out) {
 	fputs("kropkid\r\n"
 			"<http://github.com/PawelStiasny/kropkid>\r\n"
 			"Your terminal should be at least 80x24 characters\r\n\r\n"
-			"[h]ost / [j]oin / [q]uit? ", out);
+			"[h]ost / [j]oin / [m]atch / [c]omputer / [w]atch / "
+			"[r]eplay / [q]uit? ", out);
 	fflush(out);
-	char input = 0;
+}
+
+void session_start(FILE* out, int sock) {
+	session_print_menu(out);
 	while (1) {
-		size_t status = recv(sock, &input, 1, 0);
-		if (status != 1 || input == 'q') {
+		int key = telnet_getkey(&input, sock);
+		if (key == -1 || key == 'q') {
 			fputs("\r\nGoodbye\r\n", out);
 			fflush(out);
 			exit(1);
-		} else if (input == 'h') {
+		} else if (key == 'h') {
 			/* host game */
-			notify_idle_session(own_pid);
-			waiting_for_opponent = 1;
-			init_map();
-			break;
-		} else if (input == 'j') {
+			notify_idle_session(own_pid, poke_fd);
+			if (init_map() == 0)
+				break;
+			/* the arena or the limit of games is full */
+			fputs("\r\nCould not host a game\r\n"
+					"[h]ost / [j]oin / [m]atch / [c]omputer / "
+					"[w]atch / [r]eplay / [q]uit? ", out);
+			fflush(out);
+		} else if (key == 'j') {
 			/* join game */
 			if (session_join(out, sock) == -1) {
-				fputs("\r\n[h]ost / [j]oin / [q]uit? ", out);
+				fputs("\r\n[h]ost / [j]oin / [m]atch / [c]omputer / "
+						"[w]atch / [r]eplay / [q]uit? ", out);
 				fflush(out);
 				continue;
 			}
-			waiting_for_opponent = 0;
 			if (init_map() == -1) {
 				fputs("\r\nNo games to join\r\n"
-						"[h]ost / [j]oin / [q]uit? ", out);
+						"[h]ost / [j]oin / [m]atch / [c]omputer / "
+						"[w]atch / [r]eplay / [q]uit? ", out);
 				fflush(out);
 			} else
 				break;
+		} else if (key == 'm') {
+			/* quick match */
+			if (session_match(out, sock) == 0)
+				break;
+			fputs("\r\n[h]ost / [j]oin / [m]atch / [c]omputer / "
+					"[w]atch / [r]eplay / [q]uit? ", out);
+			fflush(out);
+		} else if (key == 'c') {
+			/* play the computer */
+			notify_idle_session(own_pid, poke_fd);
+			if (init_game(request_bot(own_pid)) == 0)
+				break;
+			notify(own_pid, MSG_SESSION_QUIT);
+			fputs("\r\nNo computer player\r\n"
+					"[h]ost / [j]oin / [m]atch / [c]omputer / "
+					"[w]atch / [r]eplay / [q]uit? ", out);
+			fflush(out);
+		} else if (key == 'w') {
+			/* watch game */
+			char game_key[7];
+			struct game *g = 0;
+			if (session_read_key(out, sock, game_key) == 0)
+				g = arena_game(get_spectated_slot(own_pid, game_key));
+			if (!g) {
+				fputs("\r\nNo game to watch\r\n"
+						"[h]ost / [j]oin / [m]atch / [c]omputer / "
+						"[w]atch / [r]eplay / [q]uit? ", out);
+				fflush(out);
+			} else if (session_spectate(out, sock, g, game_key) == 0)
+				session_print_menu(out);
+		} else if (key == 'r') {
+			/* replay a recorded game */
+			char game_key[7];
+			struct replay *r = 0;
+			if (session_read_key(out, sock, game_key) == 0)
+				r = replay_open_game(game_key);
+			if (!r) {
+				fputs("\r\nNo record of the game\r\n"
+						"[h]ost / [j]oin / [m]atch / [c]omputer / "
+						"[w]atch / [r]eplay / [q]uit? ", out);
+				fflush(out);
+				continue;
+			}
+			int ret = session_replay(out, sock, r);
+			replay_close(r);
+			if (ret == 0)
+				session_print_menu(out);
 		}
 	}
 }
 
 void session_ingame(FILE* out, int sock) {
 	int exit = 0, cur_y = MAP_HEIGHT / 2, cur_x = MAP_WIDTH / 2;
-	int escape_status = 0; /* for reading escape sequences (arrow keys) */
+	struct pollfd fds[2] = {
+		{ .fd = sock, .events = POLLIN },
+		{ .fd = poke_fd, .events = POLLIN } };
+	uint64_t pokes;
+
+	/* menu output goes first */
+	fflush(out);
+	frame_init(&screen);
 
 	/* clear screen (ansi sequences) */
-	fputs("\e[2J\e[H", out);
+	frame_puts(&screen, "\e[2J\e[H");
 
-	print_map(out, MAP_TOP, MAP_LEFT);
+	log_cursor = move_log_head(&own_game->log);
+	view.y = view.x = 0;
+	viewport_follow(&view, cur_y, cur_x);
+	print_map(&screen, map, &view, MAP_TOP, MAP_LEFT);
 
 	while (!exit) {
-		fprintf(out,
-				"\e[24;0H\e[0KGame #%s, You: %s\e[0m  q:Exit  <Space>:Move ",
-				own_game->key,
-				(own_player_num == 1) ? "\e[1;32mX" : "\e[1;34mO");
-
-		if (waiting_for_opponent) {
-			if (own_player_num == 1)
-				fputs("\e[24;64H\e[0KWaiting for O...", out);
-			else
-				fputs("\e[24;64H\e[0KWaiting for X...", out);
+		print_status(&screen, own_game->key, &own_game->score,
+				own_player_num, waiting_for_opponent, cur_y, cur_x, &view);
+		frame_send(&screen, sock);
+
+		if (!telnet_input_pending(&input)) {
+			if (poll(fds, 2, -1) == -1) {
+				if (errno == EINTR)
+					continue;
+				perror("client: poll");
+				break;
+			}
+
+			if (fds[1].revents & POLLIN) {
+				/* the opponent has moved or left */
+				if (read(poke_fd, &pokes, sizeof(pokes)) == -1)
+					continue;
+				if (own_game->state == GAME_ORPHANED) {
+					frame_puts(&screen,
+							"\e[0m\e[2J\e[HThe other player has left\r\n");
+					exit = 1;
+				} else {
+					print_moves(&screen, &own_game->log, &log_cursor, map,
+							&view, MAP_TOP, MAP_LEFT);
+					waiting_for_opponent = 0;
+					frame_puts(&screen, "\e[8;50H\e[0K");
+				}
+				continue;
+			}
+
+			ssize_t status = telnet_input_read(&input, sock, 0);
+			if (status == -1 && errno != EINTR) {
+				perror("client: recv");
+				break;
+			} else if (status == 0) {
+				break;
+			}
 		}
-		fprintf(out, "\e[%d;%dH", cur_y + MAP_TOP + 1, cur_x + MAP_LEFT + 1);
-		fflush(out);
 
-		char input;
-		size_t status = recv(sock, &input, 1, 0);
-		if (status == 1) {
-			switch(input) {
+		/* all keys read together make one screen update, keys after q are
+		   left to the menu */
+		int key, redraw = 0;
+		while (!exit && (key = telnet_input_next(&input)) != -1) {
+			switch(key) {
 				case 'q':
-					fprintf(out, "\e[0m\e[2J\e[H");
+					frame_puts(&screen, "\e[0m\e[2J\e[H");
 					exit = 1;
 					break;
-				case 'A':
-					if (escape_status != 2) break;
+				case KEY_UP:
 				case 'k' :
 					cur_y = max(0, cur_y - 1); break;
-				case 'B':
-					if (escape_status != 2) break;
+				case KEY_DOWN:
 				case 'j':
 					cur_y = min(MAP_HEIGHT - 1, cur_y + 1); break;
-				case 'D':
-					if (escape_status != 2) break;
+				case KEY_LEFT:
 				case 'h' :
 					cur_x = max(0, cur_x - 1); break;
-				case 'C':
-					if (escape_status != 2) break;
+				case KEY_RIGHT:
 				case 'l':
 					cur_x = min(MAP_WIDTH - 1, cur_x + 1); break;
 				case ' ':
 					if (!waiting_for_opponent && (map_get(cur_y, cur_x)&3) == 0) {
 						map_set(cur_y, cur_x, own_player_num);
 						waiting_for_opponent = 1;
-						print_map(out, MAP_TOP, MAP_LEFT);
+						print_moves(&screen, &own_game->log, &log_cursor,
+								map, &view, MAP_TOP, MAP_LEFT);
 					}
 					break;
-				case 0x1b:
-					if (escape_status == 0) escape_status = 1;
-					break;
-				case '[':
-					if (escape_status == 1) escape_status = 2;
+				case 'r':
+				case 0x0c: /* ^L */
+					redraw = 1;
 					break;
 			}
-			if ((escape_status == 1 && input != 0x1b) ||
-					(escape_status == 2 && input != '['))
-				escape_status = 0;
-			fflush(out);
-		} else if (status == -1 && errno != EINTR) {
-			perror("client: recv");
-			break;
-		} else if (status != 1 && errno == EINTR) {
-			if (map_updated) {
-				if (own_game->state == GAME_ORPHANED) {
-					fprintf(out, "\e[0m\e[2J\e[HThe other player has left\r\n");
-					exit = 1;
-				} else {
-					print_map(out, MAP_TOP, MAP_LEFT);
-					map_updated = 0;
-					waiting_for_opponent = 0;
-					fputs("\e[8;50H\e[0K", out);
-				}
-			}
-		} else if (status == 0) {
-			break;
-		} else
-			DBG(1, "???\n");
+		}
+		if (!exit) {
+			/* a run of redraws would not fit in the frame, draw once */
+			int scrolled = viewport_follow(&view, cur_y, cur_x);
+			if (redraw)
+				frame_puts(&screen, "\e[0m\e[2J\e[H");
+			if (redraw || scrolled)
+				print_map(&screen, map, &view, MAP_TOP, MAP_LEFT);
+		}
+	}
+	frame_send(&screen, sock);
+	own_game = 0;
+	map = 0;
+	if (opponent_poke_fd != -1) {
+		close(opponent_poke_fd);
+		opponent_poke_fd = -1;
 	}
-	fflush(out);
-	shmdt(map);
 	notify(own_pid, MSG_SESSION_QUIT);
 }
 
@@ -283,18 +577,17 @@ void telnet_session(int sock) {
 		exit(1);
 	}
 
+	/* every screen update is a single write, send it without delay */
+	int yes = 1;
+	if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1)
+		perror("client: setsockopt");
+
 	/* set raw terminal, no echo (telnet protocol) */
 	fputs("\xff\xfb\x01\xff\xfb\x03\xff\xfd\x0f3", out);
 
-	struct sigaction usr1_sig_action;
-	usr1_sig_action.sa_handler = handle_signal_poke;
-	/* It is important to allow interruption of system calls, so recv waiting
-	   for user input can be interrupted after opponents move. */
-	usr1_sig_action.sa_flags = 0;
-	sigemptyset(&usr1_sig_action.sa_mask);
-
-	if (sigaction(SIGUSR1, &usr1_sig_action, 0) == -1) {
-		perror("client: sigaction");
+	poke_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (poke_fd == -1) {
+		perror("client: eventfd");
 		exit(1);
 	}
 
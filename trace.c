@@ -0,0 +1,147 @@
+#include "conf.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Ring of the most recent trace records of this process.  Writers claim an
+ * index with one atomic add and never wait, so the ring can stay on in
+ * production.  After a fork the child starts from a copy of its parent's
+ * records.
+ */
+static struct trace_record trace_ring[TRACE_SIZE];
+static uint32_t trace_head = 0;
+
+static uint16_t trace_threads = 0;
+static __thread uint16_t trace_thread = 0;
+
+const struct trace_event_info trace_events[TRACE_EVENT_COUNT] = {
+	[TRACE_IPC_SEND] = { "ipc_send", { "type", "pid", "want_reply" } },
+	[TRACE_IPC_HANDLE] = { "ipc_handle", { "type", "pid", "ns" } },
+	[TRACE_GAME_CREATE] = { "game_create", { "slot", "pid", 0 } },
+	[TRACE_GAME_JOIN] = { "game_join", { "slot", "pid", "ok" } },
+	[TRACE_SESSION_QUIT] = { "session_quit", { "slot", "pid", 0 } },
+	[TRACE_GAME_DESTROY] = { "game_destroy", { "slot", 0, 0 } },
+	[TRACE_GAME_SLOT] = { "game_slot", { "slot", "pid", 0 } },
+	[TRACE_POKE] = { "poke", { "pid", 0, 0 } },
+	[TRACE_PROCESS_MAP] = { "process_map", { "cell", "player", "captured" } },
+	[TRACE_PROCESS_MAP_BITBOARD] =
+		{ "process_map_bitboard", { "cell", "player", "captured" } },
+	[TRACE_DOT_NO_SEARCH] = { "dot_no_search", { "cell", "player", 0 } },
+	[TRACE_FRAME_SEND] = { "frame_send", { "sock", "bytes", 0 } },
+	[TRACE_RENDER_MOVES] = { "render_moves", { "drawn", "overrun", 0 } },
+	[TRACE_CONN_OPEN] = { "conn_open", { "sid", 0, 0 } },
+	[TRACE_CONN_CLOSE] = { "conn_close", { "sid", 0, 0 } },
+	[TRACE_FEED_PUBLISH] = { "feed_publish", { "bytes", "to_move", 0 } },
+	[TRACE_SPECTATE] = { "spectate", { "slot", "pid", 0 } },
+	[TRACE_MATCH] = { "match", { "slot", "pid", "opponent" } },
+	[TRACE_MCTS_SEARCH] = { "mcts_search", { "cell", "playouts", "ms" } },
+	[TRACE_INPUT] = { "input", { "sock", "bytes", "keys" } },
+	[TRACE_FRAME_DROP] = { "frame_drop", { "sock", "pending", 0 } }
+};
+
+static void at_trace_signal(int sig) {
+	int saved_errno = errno;
+	trace_dump();
+	errno = saved_errno;
+}
+
+/**
+ * Dumps the ring on SIGUSR2.  Call before forking, so every process dumps its
+ * own ring.
+ */
+void trace_init() {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = at_trace_signal;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR2, &sa, 0);
+}
+
+void trace_record(int event, int32_t a, int32_t b, int32_t c) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (!trace_thread)
+		trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+	uint32_t i = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+	struct trace_record *r = &trace_ring[i & (TRACE_SIZE - 1)];
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	r->ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	r->event = event;
+	r->thread = trace_thread;
+	r->args[0] = a;
+	r->args[1] = b;
+	r->args[2] = c;
+	__atomic_store_n(&r->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+	while (size > 0) {
+		ssize_t r = write(fd, data, size);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		data = (const char*)data + r;
+		size -= r;
+	}
+	return 0;
+}
+
+/**
+ * Writes the ring to TRACE_PATH.<pid>, for kropkid_trace to decode.  Only
+ * uses async-signal-safe calls, so it can run in a signal handler.
+ */
+void trace_dump() {
+	char path[sizeof(TRACE_PATH) + 16], digits[12];
+	int len = 0, n = 0;
+	pid_t pid = getpid();
+
+	memcpy(path, TRACE_PATH, sizeof(TRACE_PATH) - 1);
+	len = sizeof(TRACE_PATH) - 1;
+	path[len++] = '.';
+	do { digits[n++] = '0' + pid % 10; pid /= 10; } while (pid);
+	while (n)
+		path[len++] = digits[--n];
+	path[len] = 0;
+
+	/* the path is predictable and usually in /tmp, so only a file of our
+	   own is replaced and neither a link nor a file planted there is
+	   written through */
+	unlink(path);
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+			0600);
+	if (fd == -1)
+		return;
+
+	uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	uint32_t count = head < TRACE_SIZE ? head : TRACE_SIZE;
+	uint32_t first = (head - count) & (TRACE_SIZE - 1);
+
+	struct timespec mono, real;
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	struct trace_file_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRACE_MAGIC, 4);
+	h.version = TRACE_VERSION;
+	h.record_size = sizeof(struct trace_record);
+	h.count = count;
+	h.pid = getpid();
+	h.realtime_offset_ns = (real.tv_sec - mono.tv_sec) * 1000000000ll +
+		real.tv_nsec - mono.tv_nsec;
+
+	/* oldest records first, up to the end of the array, then the rest */
+	uint32_t tail = count < TRACE_SIZE - first ? count : TRACE_SIZE - first;
+	if (write_all(fd, &h, sizeof(h)) == 0 &&
+			write_all(fd, trace_ring + first,
+				tail * sizeof(struct trace_record)) == 0)
+		write_all(fd, trace_ring, (count - tail) * sizeof(struct trace_record));
+	close(fd);
+}
@@ -0,0 +1,88 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "conf.h"
+
+enum TRACE_EVENT {
+	TRACE_IPC_SEND,
+	TRACE_IPC_HANDLE,
+	TRACE_GAME_CREATE,
+	TRACE_GAME_JOIN,
+	TRACE_SESSION_QUIT,
+	TRACE_GAME_DESTROY,
+	TRACE_GAME_SLOT,
+	TRACE_POKE,
+	TRACE_PROCESS_MAP,
+	TRACE_PROCESS_MAP_BITBOARD,
+	TRACE_DOT_NO_SEARCH,
+	TRACE_FRAME_SEND,
+	TRACE_RENDER_MOVES,
+	TRACE_CONN_OPEN,
+	TRACE_CONN_CLOSE,
+	TRACE_FEED_PUBLISH,
+	TRACE_SPECTATE,
+	TRACE_MATCH,
+	TRACE_MCTS_SEARCH,
+	TRACE_INPUT,
+	TRACE_FRAME_DROP,
+
+	/* keep last */
+	TRACE_EVENT_COUNT
+};
+
+/**
+ * One entry of the trace ring.  seq is written last, so a record being
+ * overwritten while the ring is dumped can be told apart.
+ */
+struct trace_record {
+	/* CLOCK_MONOTONIC */
+	uint64_t ns;
+
+	/* index of the record + 1 */
+	uint32_t seq;
+
+	uint16_t event;
+
+	/* number of the writing thread within the process, from 1 */
+	uint16_t thread;
+
+	int32_t args[3];
+};
+
+/* start of a dump, followed by the records from the oldest on */
+struct trace_file_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t count;
+	uint32_t pid;
+
+	/* CLOCK_REALTIME - CLOCK_MONOTONIC when dumped */
+	int64_t realtime_offset_ns;
+};
+
+#define TRACE_MAGIC "KTRC"
+#define TRACE_VERSION 1
+
+struct trace_event_info {
+	const char *name;
+	const char *args[3];
+};
+
+extern const struct trace_event_info trace_events[TRACE_EVENT_COUNT];
+
+void trace_init();
+
+void trace_record(int event, int32_t a, int32_t b, int32_t c);
+
+void trace_dump();
+
+#if TRACE_ENABLED
+	#define TRACE(event, a, b, c) trace_record((event), (a), (b), (c))
+#else
+	#define TRACE(event, a, b, c) {}
+#endif
+
+#endif